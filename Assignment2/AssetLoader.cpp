@@ -0,0 +1,295 @@
+#include "AssetLoader.h"
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#include <iostream>
+
+using namespace std;
+
+AssetHandle::AssetHandle(int type, const char* filename, TMesh* target) : type(type), filename(filename), target(target) {
+	compress = false;
+	wrapMode = Texture::WRAP_REPEAT;
+	filterMode = Texture::FILTER_TRILINEAR;
+	optimize = false;
+	backFaceCulling = false;
+	mesh = NULL;
+	texture = NULL;
+	committed = false;
+	failed = false;
+	decoded = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+AssetHandle::~AssetHandle() {
+	if (mesh != NULL) {
+		mesh->Clear();
+		delete mesh;
+	}
+	if (texture != NULL) {
+		delete texture;
+	}
+	CloseHandle((HANDLE)decoded);
+}
+
+/**
+ * Return true if the asset has been published to the target mesh.
+ *
+ * @return		true if the asset is ready to be rendered
+ */
+bool AssetHandle::IsReady() const {
+	return committed;
+}
+
+/**
+ * Return true if the asset could not be loaded.
+ *
+ * @return		true if the loading failed
+ */
+bool AssetHandle::IsFailed() const {
+	return failed;
+}
+
+/**
+ * Decode the asset into a private object.
+ * This function is called on a worker thread.
+ */
+void AssetHandle::Decode() {
+	// an exception, e.g. running out of memory for a large mesh, fails the asset
+	// so that the event is always signaled and the waiters do not hang
+	try {
+		if (type == TYPE_MESH) {
+			mesh = new TMesh();
+			if (mesh->Load((char*)filename.c_str())) {
+				mesh->Translate(centroid - mesh->GetCentroid());
+				if (optimize) mesh->OptimizeVertexCache();
+
+				// the triangles are grouped before the ambient occlusion is cached, since the cache is keyed by their order
+				mesh->BuildMeshlets();
+
+				// the ambient occlusion is baked once and cached next to the mesh file
+				mesh->BakeAmbientOcclusion((filename + ".ao").c_str());
+
+				// the levels of detail inherit the baked ambient occlusion
+				mesh->BuildLODs();
+
+				// a nearly closed mesh, e.g. a scan with small holes, is opted in after the levels of detail are built,
+				// since BuildMeshlets() enables the culling only for an exactly closed one
+				if (backFaceCulling) mesh->SetBackFaceCulling(true);
+			} else {
+				// the target mesh stays empty
+				failed = true;
+			}
+		} else {
+			try {
+				texture = new Texture(filename.c_str(), compress);
+				texture->SetWrapMode(wrapMode);
+				texture->SetFilterMode(filterMode);
+				cerr << "INFO: loaded texture: " << filename << " (" << texture->GetMemorySize() / 1024 << " KB" << (compress ? ", compressed" : "") << ")" << endl;
+			} catch (const char* msg) {
+				cerr << "INFO: cannot load texture: " << filename << " (" << msg << ")" << endl;
+				texture = NULL;
+				failed = true;
+			}
+		}
+	} catch (...) {
+		cerr << "INFO: cannot load asset: " << filename << endl;
+		failed = true;
+	}
+
+	SetEvent((HANDLE)decoded);
+}
+
+/**
+ * Publish the decoded asset to the target mesh.
+ * This function has to be called on the GUI thread.
+ */
+void AssetHandle::Commit() {
+	if (type == TYPE_MESH) {
+		if (mesh != NULL) {
+			if (!failed) target->Swap(*mesh);
+			mesh->Clear();
+			delete mesh;
+			mesh = NULL;
+		}
+	} else if (texture != NULL && !failed) {
+		target->SetTexture(texture);
+		texture = NULL;
+	} else {
+		target->SetTexturePending(false);
+	}
+
+	committed = true;
+}
+
+/**
+ * Start the worker threads.
+ *
+ * @param threadsN		the number of worker threads (0 means one thread per processor)
+ */
+AssetLoader::AssetLoader(int threadsN) {
+	if (threadsN <= 0) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		threadsN = info.dwNumberOfProcessors;
+	}
+
+	stopping = false;
+	lock = new CRITICAL_SECTION;
+	InitializeCriticalSection((CRITICAL_SECTION*)lock);
+	available = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+
+	for (int i = 0; i < threadsN; i++) {
+		threads.push_back((void*)_beginthreadex(NULL, 0, WorkerMain, this, 0, NULL));
+	}
+}
+
+/**
+ * Stop the worker threads after the queued assets are decoded.
+ */
+AssetLoader::~AssetLoader() {
+	stopping = true;
+	ReleaseSemaphore((HANDLE)available, (LONG)threads.size(), NULL);
+	for (int i = 0; i < threads.size(); i++) {
+		WaitForSingleObject((HANDLE)threads[i], INFINITE);
+		CloseHandle((HANDLE)threads[i]);
+	}
+
+	for (int i = 0; i < handles.size(); i++) {
+		delete handles[i];
+	}
+
+	CloseHandle((HANDLE)available);
+	DeleteCriticalSection((CRITICAL_SECTION*)lock);
+	delete (CRITICAL_SECTION*)lock;
+}
+
+/**
+ * Request to load the mesh from the specified file into the target mesh.
+ * The target mesh stays empty until the handle is committed.
+ *
+ * @param target		the mesh that receives the loaded geometry
+ * @param filename		the bin file name
+ * @param centroid		the loaded mesh is translated such that its centroid is placed here
+ * @param optimize		true if the triangles are reordered for the vertex cache
+ * @param backFaceCulling	true if the meshlets facing away are culled even if the mesh has small holes
+ * @return				the handle of the asset
+ */
+AssetHandle* AssetLoader::LoadMesh(TMesh* target, const char* filename, const V3 &centroid, bool optimize, bool backFaceCulling) {
+	AssetHandle* handle = new AssetHandle(AssetHandle::TYPE_MESH, filename, target);
+	handle->centroid = centroid;
+	handle->optimize = optimize;
+	handle->backFaceCulling = backFaceCulling;
+	Enqueue(handle);
+	return handle;
+}
+
+/**
+ * Request to load the texture from the specified file for the target mesh.
+ * The target mesh is rendered with the placeholder texture until the handle is committed.
+ *
+ * @param target		the mesh that receives the loaded texture
+ * @param filename		the texture file name
+ * @param compress		true if the texture is stored in the block-compressed format
+ * @param wrapMode		WRAP_REPEAT, WRAP_CLAMP, or WRAP_MIRROR
+ * @param filterMode	FILTER_NEAREST, FILTER_BILINEAR, or FILTER_TRILINEAR
+ * @return				the handle of the asset
+ */
+AssetHandle* AssetLoader::LoadTexture(TMesh* target, const char* filename, bool compress, int wrapMode, int filterMode) {
+	AssetHandle* handle = new AssetHandle(AssetHandle::TYPE_TEXTURE, filename, target);
+	handle->compress = compress;
+	handle->wrapMode = wrapMode;
+	handle->filterMode = filterMode;
+	target->SetTexturePending(true);
+	Enqueue(handle);
+	return handle;
+}
+
+/**
+ * Publish all the assets that have been decoded since the last call.
+ * This function has to be called on the GUI thread.
+ *
+ * @return		true if any asset was published
+ */
+bool AssetLoader::Update() {
+	bool updated = false;
+
+	for (int i = 0; i < handles.size(); i++) {
+		if (handles[i]->committed) continue;
+		if (WaitForSingleObject((HANDLE)handles[i]->decoded, 0) != WAIT_OBJECT_0) continue;
+
+		handles[i]->Commit();
+		updated = true;
+	}
+
+	return updated;
+}
+
+/**
+ * Block until the specified asset is decoded, and publish it.
+ *
+ * @param handle		the handle of the asset
+ */
+void AssetLoader::Wait(AssetHandle* handle) {
+	if (handle->committed) return;
+
+	WaitForSingleObject((HANDLE)handle->decoded, INFINITE);
+	handle->Commit();
+}
+
+/**
+ * Block until all the requested assets are decoded, and publish them.
+ */
+void AssetLoader::WaitAll() {
+	for (int i = 0; i < handles.size(); i++) {
+		Wait(handles[i]);
+	}
+}
+
+/**
+ * Return true if all the requested assets have been published.
+ *
+ * @return		true if there is no pending asset
+ */
+bool AssetLoader::IsIdle() const {
+	for (int i = 0; i < handles.size(); i++) {
+		if (!handles[i]->committed) return false;
+	}
+	return true;
+}
+
+void AssetLoader::Enqueue(AssetHandle* handle) {
+	handles.push_back(handle);
+
+	EnterCriticalSection((CRITICAL_SECTION*)lock);
+	queue.push_back(handle);
+	LeaveCriticalSection((CRITICAL_SECTION*)lock);
+
+	ReleaseSemaphore((HANDLE)available, 1, NULL);
+}
+
+/**
+ * The main loop of the worker threads.
+ * Each worker takes the next asset from the queue and decodes it.
+ */
+unsigned int __stdcall AssetLoader::WorkerMain(void* arg) {
+	AssetLoader* loader = (AssetLoader*)arg;
+
+	while (true) {
+		WaitForSingleObject((HANDLE)loader->available, INFINITE);
+
+		EnterCriticalSection((CRITICAL_SECTION*)loader->lock);
+		AssetHandle* handle = NULL;
+		if (!loader->queue.empty()) {
+			handle = loader->queue.front();
+			loader->queue.pop_front();
+		}
+		LeaveCriticalSection((CRITICAL_SECTION*)loader->lock);
+
+		if (handle != NULL) {
+			handle->Decode();
+		} else if (loader->stopping) {
+			break;
+		}
+	}
+
+	return 0;
+}
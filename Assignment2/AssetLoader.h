@@ -0,0 +1,113 @@
+#pragma once
+
+#include "V3.h"
+#include "TMesh.h"
+#include "Texture.h"
+#include <vector>
+#include <deque>
+#include <string>
+
+/**
+ * Handle of an asset that is loaded asynchronously.
+ * The handle is owned by the AssetLoader.
+ */
+class AssetHandle {
+friend class AssetLoader;
+
+public:
+	enum { TYPE_MESH = 0, TYPE_TEXTURE };
+
+private:
+	/** mesh or texture */
+	int type;
+
+	/** the file name of the asset */
+	std::string filename;
+
+	/** the mesh that receives the loaded geometry or texture */
+	TMesh* target;
+
+	/** the centroid of the loaded mesh (only for TYPE_MESH) */
+	V3 centroid;
+
+	/** true if the texture is block-compressed (only for TYPE_TEXTURE) */
+	bool compress;
+
+	/** the wrap mode and the filter of the texture (only for TYPE_TEXTURE) */
+	int wrapMode;
+	int filterMode;
+
+	/** true if the triangles are reordered for the vertex cache (only for TYPE_MESH) */
+	bool optimize;
+
+	/** true if the meshlets facing away are culled even if the mesh is not exactly closed (only for TYPE_MESH) */
+	bool backFaceCulling;
+
+	/** the decoded mesh, which is swapped into the target when the handle is committed */
+	TMesh* mesh;
+
+	/** the decoded texture, which is handed over to the target when the handle is committed */
+	Texture* texture;
+
+	/** manual-reset event that is signaled when the worker finished decoding */
+	void* decoded;
+
+	/** true once the asset is published to the target */
+	bool committed;
+
+	/** true if the asset could not be loaded */
+	bool failed;
+
+public:
+	bool IsReady() const;
+	bool IsFailed() const;
+
+private:
+	AssetHandle(int type, const char* filename, TMesh* target);
+	~AssetHandle();
+	void Decode();
+	void Commit();
+};
+
+/**
+ * Load meshes and textures on a pool of worker threads.
+ * The workers only decode the assets into private objects, and the decoded assets are
+ * published to the target meshes by Update() or Wait() on the GUI thread,
+ * so that the renderer never sees a half-loaded asset.
+ */
+class AssetLoader {
+private:
+	/** worker thread handles */
+	std::vector<void*> threads;
+
+	/** the assets waiting for a worker */
+	std::deque<AssetHandle*> queue;
+
+	/** all the assets that have been requested */
+	std::vector<AssetHandle*> handles;
+
+	/** critical section that guards the queue */
+	void* lock;
+
+	/** semaphore that counts the assets in the queue */
+	void* available;
+
+	/** true when the workers should exit */
+	volatile bool stopping;
+
+public:
+	AssetLoader(int threadsN = 0);
+	~AssetLoader();
+
+	AssetHandle* LoadMesh(TMesh* target, const char* filename, const V3 &centroid, bool optimize = true, bool backFaceCulling = false);
+	AssetHandle* LoadTexture(TMesh* target, const char* filename, bool compress = false, int wrapMode = Texture::WRAP_REPEAT, int filterMode = Texture::FILTER_TRILINEAR);
+	bool Update();
+	void Wait(AssetHandle* handle);
+	void WaitAll();
+	bool IsIdle() const;
+
+private:
+	void Enqueue(AssetHandle* handle);
+	static unsigned int __stdcall WorkerMain(void* arg);
+};
+
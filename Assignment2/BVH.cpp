@@ -0,0 +1,441 @@
+#include "BVH.h"
+#include <algorithm>
+#include <math.h>
+#include <limits>
+
+using namespace std;
+
+/** the number of the top levels built serially before the subtrees are built in parallel */
+#define PARALLEL_DEPTH			4
+
+/** the number of the triangles below which the tree is built serially */
+#define PARALLEL_MIN_TRIS		4096
+
+/** the size of the traversal stack, which limits the depth of the tree */
+#define STACK_SIZE				64
+
+/**
+ * Return the distance to the intersection of the ray with the triangle (Moller-Trumbore),
+ * or a negative value if the ray misses the triangle.
+ */
+static inline float IntersectTriangle(const V3 &orig, const V3 &dir, const V3 &p0, const V3 &p1, const V3 &p2) {
+	V3 e1 = p1 - p0;
+	V3 e2 = p2 - p0;
+	V3 pv = dir ^ e2;
+	float det = e1 * pv;
+	if (fabsf(det) < 1e-12f) return -1.0f;
+
+	float inv = 1.0f / det;
+	V3 tv = orig - p0;
+	float s = (tv * pv) * inv;
+	if (s < 0.0f || s > 1.0f) return -1.0f;
+
+	V3 qv = tv ^ e1;
+	float t = (dir * qv) * inv;
+	if (t < 0.0f || s + t > 1.0f) return -1.0f;
+
+	return (e2 * qv) * inv;
+}
+
+/**
+ * Return the reciprocal of the direction, where the zero components are replaced by tiny values
+ * so that the slab test does not produce NaN.
+ */
+static inline V3 InvertDirection(const V3 &dir) {
+	float d[3] = { dir.x(), dir.y(), dir.z() };
+	for (int k = 0; k < 3; k++) {
+		if (fabsf(d[k]) < 1e-20f) d[k] = d[k] < 0.0f ? -1e-20f : 1e-20f;
+	}
+	return V3(1.0f / d[0], 1.0f / d[1], 1.0f / d[2]);
+}
+
+/**
+ * Return the surface area of the box given by 6 floats (min xyz, max xyz).
+ */
+static inline float SurfaceArea(const float* b) {
+	float dx = b[3] - b[0];
+	float dy = b[4] - b[1];
+	float dz = b[5] - b[2];
+	if (dx < 0.0f || dy < 0.0f || dz < 0.0f) return 0.0f;
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+/**
+ * Grow the box given by 6 floats (min xyz, max xyz) to include the other box.
+ */
+static inline void Grow(float* b, const float* o) {
+	for (int k = 0; k < 3; k++) {
+		b[k] = min(b[k], o[k]);
+		b[k + 3] = max(b[k + 3], o[k + 3]);
+	}
+}
+
+/**
+ * Set the box given by 6 floats (min xyz, max xyz) to be empty.
+ */
+static inline void Empty(float* b) {
+	b[0] = b[1] = b[2] = (numeric_limits<float>::max)();
+	b[3] = b[4] = b[5] = -(numeric_limits<float>::max)();
+}
+
+BVH::BVH() {
+	verts = NULL;
+	tris = NULL;
+	tris16 = NULL;
+	trisN = 0;
+}
+
+/**
+ * Build the tree over the triangles of the mesh.
+ * The top PARALLEL_DEPTH levels are built serially, and the subtrees below them are built in parallel
+ * into separate node lists, which are appended to the tree afterwards.
+ *
+ * @param verts		the vertices of the mesh
+ * @param tris		the vertex indices of the triangles in 32 bits (or NULL)
+ * @param tris16	the vertex indices of the triangles in 16 bits (or NULL)
+ * @param trisN		the number of triangles
+ */
+void BVH::Build(const Vertex* verts, const unsigned int* tris, const unsigned short* tris16, int trisN) {
+	this->verts = verts;
+	this->tris = tris;
+	this->tris16 = tris16;
+	this->trisN = trisN;
+
+	nodes.clear();
+	indices.resize(trisN);
+	if (trisN == 0) return;
+
+	// the bounds and the centroids of the triangles
+	vector<float> bounds(trisN * 6);
+	vector<float> centroids(trisN * 3);
+
+	#pragma omp parallel for
+	for (int i = 0; i < trisN; i++) {
+		float* b = &bounds[i * 6];
+		Empty(b);
+		for (int j = 0; j < 3; j++) {
+			const V3 &p = verts[FetchIndex(tris, tris16, i * 3 + j)].v;
+			float pb[6] = { p.x(), p.y(), p.z(), p.x(), p.y(), p.z() };
+			Grow(b, pb);
+		}
+		for (int k = 0; k < 3; k++) {
+			centroids[i * 3 + k] = (b[k] + b[k + 3]) * 0.5f;
+		}
+		indices[i] = i;
+	}
+
+	nodes.resize(1);
+	if (trisN < PARALLEL_MIN_TRIS) {
+		BuildNode(nodes, 0, 0, trisN, &centroids[0], &bounds[0], 0, -1, NULL);
+		return;
+	}
+
+	// the top levels leave the subtrees as (node, begin, end) triples
+	vector<int> pending;
+	BuildNode(nodes, 0, 0, trisN, &centroids[0], &bounds[0], 0, PARALLEL_DEPTH, &pending);
+
+	int subtreesN = (int)pending.size() / 3;
+	vector<vector<BVHNode> > subtrees(subtreesN);
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int i = 0; i < subtreesN; i++) {
+		subtrees[i].resize(1);
+		BuildNode(subtrees[i], 0, pending[i * 3 + 1], pending[i * 3 + 2], &centroids[0], &bounds[0], PARALLEL_DEPTH, -1, NULL);
+	}
+
+	// the root of each subtree replaces its placeholder, and the other nodes are appended
+	for (int i = 0; i < subtreesN; i++) {
+		int base = (int)nodes.size() - 1;
+		vector<BVHNode> &subtree = subtrees[i];
+		for (int j = 0; j < (int)subtree.size(); j++) {
+			if (subtree[j].count == 0) subtree[j].first += base;
+		}
+		nodes[pending[i * 3]] = subtree[0];
+		nodes.insert(nodes.end(), subtree.begin() + 1, subtree.end());
+	}
+}
+
+/**
+ * Build the node over the triangles indices[begin, end) and its descendants.
+ * The split is chosen among the bin boundaries of all three axes by the surface area heuristic.
+ *
+ * @param out			the node list
+ * @param node			the index of the node in the list
+ * @param begin			the first index into the triangle list
+ * @param end			the last index (exclusive) into the triangle list
+ * @param centroids		the centroids of the triangles
+ * @param bounds		the bounds of the triangles
+ * @param depth			the depth of the node
+ * @param depthToStop	the depth at which the subtrees are left to the caller (-1 means never)
+ * @param pending		the list that receives the subtrees left to the caller
+ */
+void BVH::BuildNode(vector<BVHNode> &out, int node, int begin, int end, const float* centroids, const float* bounds, int depth, int depthToStop, vector<int>* pending) {
+	float nb[6];
+	float cb[6];
+	Empty(nb);
+	Empty(cb);
+	for (int i = begin; i < end; i++) {
+		Grow(nb, &bounds[indices[i] * 6]);
+		const float* c = &centroids[indices[i] * 3];
+		float pb[6] = { c[0], c[1], c[2], c[0], c[1], c[2] };
+		Grow(cb, pb);
+	}
+
+	BVHNode &n = out[node];
+	n.minX = nb[0];
+	n.minY = nb[1];
+	n.minZ = nb[2];
+	n.maxX = nb[3];
+	n.maxY = nb[4];
+	n.maxZ = nb[5];
+	n.first = begin;
+	n.count = end - begin;
+
+	// the depth is limited by the traversal stack
+	if (end - begin <= LEAF_SIZE || depth >= STACK_SIZE - 2) return;
+
+	if (depthToStop == 0) {
+		pending->push_back(node);
+		pending->push_back(begin);
+		pending->push_back(end);
+		return;
+	}
+
+	// find the cheapest split among the bin boundaries
+	float bestCost = (numeric_limits<float>::max)();
+	int bestAxis = -1;
+	int bestSplit = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		float extent = cb[axis + 3] - cb[axis];
+		if (extent <= 0.0f) continue;
+		float scale = BINS_N / extent;
+
+		int counts[BINS_N];
+		float binBounds[BINS_N][6];
+		for (int b = 0; b < BINS_N; b++) {
+			counts[b] = 0;
+			Empty(binBounds[b]);
+		}
+		for (int i = begin; i < end; i++) {
+			int b = min(BINS_N - 1, (int)((centroids[indices[i] * 3 + axis] - cb[axis]) * scale));
+			counts[b]++;
+			Grow(binBounds[b], &bounds[indices[i] * 6]);
+		}
+
+		// the costs of the right sides are accumulated from the right
+		float rightCosts[BINS_N];
+		float rb[6];
+		Empty(rb);
+		int rightN = 0;
+		for (int b = BINS_N - 1; b > 0; b--) {
+			Grow(rb, binBounds[b]);
+			rightN += counts[b];
+			rightCosts[b] = SurfaceArea(rb) * rightN;
+		}
+
+		float lb[6];
+		Empty(lb);
+		int leftN = 0;
+		for (int b = 0; b < BINS_N - 1; b++) {
+			Grow(lb, binBounds[b]);
+			leftN += counts[b];
+			float cost = SurfaceArea(lb) * leftN + rightCosts[b + 1];
+			if (leftN > 0 && leftN < end - begin && cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b + 1;
+			}
+		}
+	}
+
+	// all the centroids coincide, so the triangles cannot be separated
+	if (bestAxis < 0) return;
+
+	float scale = BINS_N / (cb[bestAxis + 3] - cb[bestAxis]);
+	int mid = begin;
+	for (int i = begin; i < end; i++) {
+		int b = min(BINS_N - 1, (int)((centroids[indices[i] * 3 + bestAxis] - cb[bestAxis]) * scale));
+		if (b < bestSplit) swap(indices[i], indices[mid++]);
+	}
+
+	int left = (int)out.size();
+	out.resize(left + 2);
+	out[node].first = left;
+	out[node].count = 0;
+
+	BuildNode(out, left, begin, mid, centroids, bounds, depth + 1, depthToStop - 1, pending);
+	BuildNode(out, left + 1, mid, end, centroids, bounds, depth + 1, depthToStop - 1, pending);
+}
+
+/**
+ * Update the bounds of all the nodes after the vertices have moved.
+ * The leaves are refit in parallel, and then the interior nodes are refit from the bottom,
+ * which is the reverse order of the list since every child comes after its parent.
+ *
+ * @param verts		the moved vertices (the triangles should be the same as when the tree was built)
+ */
+void BVH::Refit(const Vertex* verts) {
+	this->verts = verts;
+
+	int nodesN = (int)nodes.size();
+
+	#pragma omp parallel for
+	for (int i = 0; i < nodesN; i++) {
+		BVHNode &n = nodes[i];
+		if (n.count == 0) continue;
+
+		float b[6];
+		Empty(b);
+		for (int j = n.first; j < n.first + n.count; j++) {
+			for (int k = 0; k < 3; k++) {
+				const V3 &p = verts[FetchIndex(tris, tris16, indices[j] * 3 + k)].v;
+				float pb[6] = { p.x(), p.y(), p.z(), p.x(), p.y(), p.z() };
+				Grow(b, pb);
+			}
+		}
+		n.minX = b[0];
+		n.minY = b[1];
+		n.minZ = b[2];
+		n.maxX = b[3];
+		n.maxY = b[4];
+		n.maxZ = b[5];
+	}
+
+	for (int i = nodesN - 1; i >= 0; i--) {
+		BVHNode &n = nodes[i];
+		if (n.count > 0) continue;
+
+		const BVHNode &l = nodes[n.first];
+		const BVHNode &r = nodes[n.first + 1];
+		n.minX = min(l.minX, r.minX);
+		n.minY = min(l.minY, r.minY);
+		n.minZ = min(l.minZ, r.minZ);
+		n.maxX = max(l.maxX, r.maxX);
+		n.maxY = max(l.maxY, r.maxY);
+		n.maxZ = max(l.maxZ, r.maxZ);
+	}
+}
+
+/**
+ * Return true if the ray segment reaches the box of the node.
+ */
+bool BVH::HitsNode(const BVHNode &node, const V3 &orig, const V3 &invDir, float maxDist) const {
+	float t0x = (node.minX - orig.x()) * invDir.x();
+	float t1x = (node.maxX - orig.x()) * invDir.x();
+	float t0y = (node.minY - orig.y()) * invDir.y();
+	float t1y = (node.maxY - orig.y()) * invDir.y();
+	float t0z = (node.minZ - orig.z()) * invDir.z();
+	float t1z = (node.maxZ - orig.z()) * invDir.z();
+
+	float tmin = max(max(min(t0x, t1x), min(t0y, t1y)), max(min(t0z, t1z), 0.0f));
+	float tmax = min(min(max(t0x, t1x), max(t0y, t1y)), min(max(t0z, t1z), maxDist));
+
+	return tmin <= tmax;
+}
+
+/**
+ * Return true if the ray hits any triangle within the specified distance.
+ * This is used for the occlusion rays, which do not need the closest hit.
+ *
+ * @param orig		the origin of the ray
+ * @param dir		the direction of the ray
+ * @param maxDist	the maximum distance (in the length of dir)
+ * @return			true if the ray hits a triangle
+ */
+bool BVH::Intersects(const V3 &orig, const V3 &dir, float maxDist) const {
+	if (nodes.empty()) return false;
+
+	V3 invDir = InvertDirection(dir);
+
+	int stack[STACK_SIZE];
+	int stackN = 0;
+	stack[stackN++] = 0;
+
+	while (stackN > 0) {
+		const BVHNode &n = nodes[stack[--stackN]];
+		if (!HitsNode(n, orig, invDir, maxDist)) continue;
+
+		if (n.count == 0) {
+			stack[stackN++] = n.first;
+			stack[stackN++] = n.first + 1;
+			continue;
+		}
+
+		for (int i = n.first; i < n.first + n.count; i++) {
+			int t = indices[i] * 3;
+			float d = IntersectTriangle(orig, dir, verts[FetchIndex(tris, tris16, t)].v, verts[FetchIndex(tris, tris16, t + 1)].v, verts[FetchIndex(tris, tris16, t + 2)].v);
+			if (d > 0.0f && d < maxDist) return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Find the closest triangle that the ray hits within the specified distance, e.g. for picking.
+ *
+ * @param orig		the origin of the ray
+ * @param dir		the direction of the ray
+ * @param maxDist	the maximum distance (in the length of dir)
+ * @param tri		the index of the closest triangle (-1 if none is hit)
+ * @return			the distance to the closest hit (maxDist if none is hit)
+ */
+float BVH::Intersect(const V3 &orig, const V3 &dir, float maxDist, int &tri) const {
+	tri = -1;
+	if (nodes.empty()) return maxDist;
+
+	V3 invDir = InvertDirection(dir);
+
+	int stack[STACK_SIZE];
+	int stackN = 0;
+	stack[stackN++] = 0;
+
+	while (stackN > 0) {
+		const BVHNode &n = nodes[stack[--stackN]];
+		if (!HitsNode(n, orig, invDir, maxDist)) continue;
+
+		if (n.count == 0) {
+			stack[stackN++] = n.first;
+			stack[stackN++] = n.first + 1;
+			continue;
+		}
+
+		for (int i = n.first; i < n.first + n.count; i++) {
+			int t = indices[i] * 3;
+			float d = IntersectTriangle(orig, dir, verts[FetchIndex(tris, tris16, t)].v, verts[FetchIndex(tris, tris16, t + 1)].v, verts[FetchIndex(tris, tris16, t + 2)].v);
+			if (d > 0.0f && d < maxDist) {
+				maxDist = d;
+				tri = indices[i];
+			}
+		}
+	}
+
+	return maxDist;
+}
+
+/**
+ * Add the bounds of the whole mesh to the specified box.
+ *
+ * @param aabb		the box
+ */
+void BVH::GetBounds(AABB &aabb) const {
+	if (nodes.empty()) return;
+
+	aabb.AddPoint(V3(nodes[0].minX, nodes[0].minY, nodes[0].minZ));
+	aabb.AddPoint(V3(nodes[0].maxX, nodes[0].maxY, nodes[0].maxZ));
+}
+
+int BVH::GetNodesN() const {
+	return (int)nodes.size();
+}
+
+const BVHNode& BVH::GetNode(int i) const {
+	return nodes[i];
+}
+
+/**
+ * Return the triangle indices referenced by the leaves.
+ */
+const int* BVH::GetIndices() const {
+	return indices.empty() ? NULL : &indices[0];
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "V3.h"
+#include "TMesh.h"
+#include <vector>
+
+/**
+ * A node of the BVH, which fits in 32 bytes, so that two nodes share a cache line.
+ * The children of an interior node are stored next to each other.
+ */
+typedef struct {
+	float minX;
+	float minY;
+	float minZ;
+	float maxX;
+	float maxY;
+	float maxZ;
+
+	/** the index of the left child (interior node), or the first index into the triangle list (leaf) */
+	int first;
+
+	/** the number of the triangles (0 means an interior node) */
+	int count;
+} BVHNode;
+
+/**
+ * Bounding volume hierarchy over the triangles of a mesh.
+ * The tree is built by the surface area heuristic over binned centroids. The subtrees below the top levels
+ * are built in parallel. When the vertices move but the triangles stay the same, Refit() updates the bounds
+ * without rebuilding the tree.
+ */
+class BVH {
+public:
+	/** the maximum number of triangles in a leaf */
+	enum { LEAF_SIZE = 4 };
+
+	/** the number of the bins of the surface area heuristic */
+	enum { BINS_N = 12 };
+
+private:
+	/** the nodes (the root is the first one, and every child comes after its parent) */
+	std::vector<BVHNode> nodes;
+
+	/** the triangle indices referenced by the leaves */
+	std::vector<int> indices;
+
+	/** the mesh */
+	const Vertex* verts;
+	const unsigned int* tris;
+	const unsigned short* tris16;
+	int trisN;
+
+public:
+	BVH();
+
+	void Build(const Vertex* verts, const unsigned int* tris, const unsigned short* tris16, int trisN);
+	void Refit(const Vertex* verts);
+	bool Intersects(const V3 &orig, const V3 &dir, float maxDist) const;
+	float Intersect(const V3 &orig, const V3 &dir, float maxDist, int &tri) const;
+	void GetBounds(AABB &aabb) const;
+	int GetNodesN() const;
+	const BVHNode& GetNode(int i) const;
+	const int* GetIndices() const;
+
+private:
+	void BuildNode(std::vector<BVHNode> &out, int node, int begin, int end, const float* centroids, const float* bounds, int depth, int depthToStop, std::vector<int>* pending);
+	bool HitsNode(const BVHNode &node, const V3 &orig, const V3 &invDir, float maxDist) const;
+};
+
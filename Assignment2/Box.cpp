@@ -122,6 +122,7 @@ Box::Box(const V3 &p0, const V3 &p1, const V3 &col) {
 
 	for (int i = 0; i < vertsN; i++) {
 		verts[i].c = col;
+		verts[i].ao = 1.0f;
 	}
 
 	// bottom
@@ -168,4 +169,6 @@ Box::Box(const V3 &p0, const V3 &p1, const V3 &col) {
 	tris[33] = 20;
 	tris[34] = 22;
 	tris[35] = 23;
+
+	PackIndices();
 }
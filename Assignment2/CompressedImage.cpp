@@ -0,0 +1,193 @@
+#include "CompressedImage.h"
+#include <math.h>
+
+/**
+ * Pack 8-bit RGB into RGB565.
+ */
+static unsigned int PackRGB565(float r, float g, float b) {
+	int r5 = (int)(r * 31.0f / 255.0f + 0.5f);
+	int g6 = (int)(g * 63.0f / 255.0f + 0.5f);
+	int b5 = (int)(b * 31.0f / 255.0f + 0.5f);
+	if (r5 < 0) r5 = 0;
+	if (r5 > 31) r5 = 31;
+	if (g6 < 0) g6 = 0;
+	if (g6 > 63) g6 = 63;
+	if (b5 < 0) b5 = 0;
+	if (b5 > 31) b5 = 31;
+
+	return (r5 << 11) | (g6 << 5) | b5;
+}
+
+/**
+ * Expand RGB565 into 8-bit RGB.
+ */
+static void UnpackRGB565(unsigned int c, int rgb[3]) {
+	int r5 = (c >> 11) & 31;
+	int g6 = (c >> 5) & 63;
+	int b5 = c & 31;
+	rgb[0] = (r5 << 3) | (r5 >> 2);
+	rgb[1] = (g6 << 2) | (g6 >> 4);
+	rgb[2] = (b5 << 3) | (b5 >> 2);
+}
+
+/**
+ * Compress the specified RGBA image.
+ * The alpha channel is discarded.
+ *
+ * @param image		the RGBA image (the same byte order as TIFFReadRGBAImage)
+ * @param width		the width of the image
+ * @param height	the height of the image
+ */
+CompressedImage::CompressedImage(const unsigned int* image, int width, int height) : width(width), height(height) {
+	blocksX = (width + 3) / 4;
+	blocksY = (height + 3) / 4;
+	blocks = new unsigned int[blocksX * blocksY * 2];
+
+	for (int by = 0; by < blocksY; by++) {
+		for (int bx = 0; bx < blocksX; bx++) {
+			EncodeBlock(image, bx, by, &blocks[(by * blocksX + bx) * 2]);
+		}
+	}
+}
+
+CompressedImage::~CompressedImage() {
+	delete [] blocks;
+}
+
+/**
+ * Decode the texel (x, y).
+ *
+ * @param x		the x coordinate of the texel
+ * @param y		the y coordinate of the texel
+ * @return		the color in the same byte order as TIFFReadRGBAImage
+ */
+unsigned int CompressedImage::GetTexel(int x, int y) const {
+	const unsigned int* block = &blocks[((y >> 2) * blocksX + (x >> 2)) * 2];
+	int index = (block[1] >> (((y & 3) * 4 + (x & 3)) * 2)) & 3;
+
+	int c0[3], c1[3];
+	UnpackRGB565(block[0] & 0xFFFF, c0);
+	if (index == 0) return 0xFF000000 | c0[0] | (c0[1] << 8) | (c0[2] << 16);
+	UnpackRGB565(block[0] >> 16, c1);
+	if (index == 1) return 0xFF000000 | c1[0] | (c1[1] << 8) | (c1[2] << 16);
+
+	// index 2 is 2/3 c0 + 1/3 c1, and index 3 is 1/3 c0 + 2/3 c1
+	int w0 = (index == 2) ? 2 : 1;
+	int w1 = 3 - w0;
+	int r = (c0[0] * w0 + c1[0] * w1) / 3;
+	int g = (c0[1] * w0 + c1[1] * w1) / 3;
+	int b = (c0[2] * w0 + c1[2] * w1) / 3;
+
+	return 0xFF000000 | r | (g << 8) | (b << 16);
+}
+
+/**
+ * Return the memory size of the compressed image in bytes.
+ *
+ * @return		the memory size in bytes
+ */
+int CompressedImage::GetSize() const {
+	return blocksX * blocksY * 2 * sizeof(unsigned int);
+}
+
+/**
+ * Encode one 4x4 block.
+ * The two endpoints are chosen along the principal axis of the block colors,
+ * and each texel is assigned to the nearest of the four palette colors.
+ *
+ * @param image		the RGBA image
+ * @param bx		the x index of the block
+ * @param by		the y index of the block
+ * @param block		the encoded block
+ */
+void CompressedImage::EncodeBlock(const unsigned int* image, int bx, int by, unsigned int* block) {
+	float texels[16][3];
+	float mean[3] = {0.0f, 0.0f, 0.0f};
+
+	// gather the texels (the texels outside the image are clamped to the edge)
+	for (int i = 0; i < 16; i++) {
+		int x = bx * 4 + (i & 3);
+		int y = by * 4 + (i >> 2);
+		if (x >= width) x = width - 1;
+		if (y >= height) y = height - 1;
+
+		unsigned int c = image[x + y * width];
+		for (int k = 0; k < 3; k++) {
+			texels[i][k] = (float)((c >> (k * 8)) & 0xFF);
+			mean[k] += texels[i][k] / 16.0f;
+		}
+	}
+
+	// compute the covariance matrix
+	float cov[3][3] = {{0.0f}};
+	for (int i = 0; i < 16; i++) {
+		float d[3] = {texels[i][0] - mean[0], texels[i][1] - mean[1], texels[i][2] - mean[2]};
+		for (int j = 0; j < 3; j++) {
+			for (int k = 0; k < 3; k++) {
+				cov[j][k] += d[j] * d[k];
+			}
+		}
+	}
+
+	// find the principal axis by power iteration
+	float axis[3] = {1.0f, 1.0f, 1.0f};
+	for (int iter = 0; iter < 8; iter++) {
+		float next[3];
+		for (int j = 0; j < 3; j++) {
+			next[j] = cov[j][0] * axis[0] + cov[j][1] * axis[1] + cov[j][2] * axis[2];
+		}
+		float len = sqrtf(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+		if (len < 1e-6f) break;
+		for (int j = 0; j < 3; j++) axis[j] = next[j] / len;
+	}
+
+	// the endpoints are the extreme projections onto the principal axis
+	float tmin = 0.0f, tmax = 0.0f;
+	for (int i = 0; i < 16; i++) {
+		float t = (texels[i][0] - mean[0]) * axis[0] + (texels[i][1] - mean[1]) * axis[1] + (texels[i][2] - mean[2]) * axis[2];
+		if (t < tmin) tmin = t;
+		if (t > tmax) tmax = t;
+	}
+
+	unsigned int c0 = PackRGB565(mean[0] + axis[0] * tmax, mean[1] + axis[1] * tmax, mean[2] + axis[2] * tmax);
+	unsigned int c1 = PackRGB565(mean[0] + axis[0] * tmin, mean[1] + axis[1] * tmin, mean[2] + axis[2] * tmin);
+
+	// c0 > c1 selects the four color mode
+	if (c0 < c1) {
+		unsigned int temp = c0;
+		c0 = c1;
+		c1 = temp;
+	}
+	block[0] = c0 | (c1 << 16);
+	block[1] = 0;
+	if (c0 == c1) return;
+
+	// build the palette
+	int e0[3], e1[3];
+	UnpackRGB565(c0, e0);
+	UnpackRGB565(c1, e1);
+	float palette[4][3];
+	for (int k = 0; k < 3; k++) {
+		palette[0][k] = (float)e0[k];
+		palette[1][k] = (float)e1[k];
+		palette[2][k] = (float)((e0[k] * 2 + e1[k]) / 3);
+		palette[3][k] = (float)((e0[k] + e1[k] * 2) / 3);
+	}
+
+	// assign each texel to the nearest palette color
+	for (int i = 0; i < 16; i++) {
+		int best = 0;
+		float bestDist = 0.0f;
+		for (int j = 0; j < 4; j++) {
+			float dr = texels[i][0] - palette[j][0];
+			float dg = texels[i][1] - palette[j][1];
+			float db = texels[i][2] - palette[j][2];
+			float dist = dr * dr + dg * dg + db * db;
+			if (j == 0 || dist < bestDist) {
+				best = j;
+				bestDist = dist;
+			}
+		}
+		block[1] |= best << (i * 2);
+	}
+}
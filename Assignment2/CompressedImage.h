@@ -0,0 +1,38 @@
+#pragma once
+
+/**
+ * Block-compressed RGB image.
+ * The image is divided into 4x4 texel blocks, and each block is stored in 8 bytes
+ * (two RGB565 endpoints and sixteen 2-bit palette indices, same layout as BC1/DXT1 without alpha),
+ * so that the memory footprint is 1/8 of the 32-bit RGBA image.
+ * The texels are decoded on the fly by GetTexel().
+ */
+class CompressedImage {
+private:
+	/** two unsigned ints per block: endpoints (c0 | c1 << 16) and indices */
+	unsigned int* blocks;
+
+	/** the number of blocks in horizontal direction */
+	int blocksX;
+
+	/** the number of blocks in vertical direction */
+	int blocksY;
+
+public:
+	/** the image width */
+	int width;
+
+	/** the image height */
+	int height;
+
+public:
+	CompressedImage(const unsigned int* image, int width, int height);
+	~CompressedImage();
+
+	unsigned int GetTexel(int x, int y) const;
+	int GetSize() const;
+
+private:
+	void EncodeBlock(const unsigned int* image, int bx, int by, unsigned int* block);
+};
+
@@ -2,6 +2,7 @@
 #include <libtiff/tiffio.h>
 #include <iostream>
 #include "scene.h"
+#include "MeshInstance.h"
 #include <math.h>
 #include <algorithm>
 
@@ -9,6 +10,105 @@ using namespace std;
 
 extern int rasterization_mode;
 
+/** the relative tolerance of the equal-depth test against the z-prepass */
+#define DEPTH_EQUAL_TOLERANCE	1e-4f
+
+/** the coarse shading is used if the normals at the block corners are within about 4 degrees of the center */
+#define COARSE_SHADING_COS		0.9975f
+
+/** the number of the pixels of an instance that a thread shades at a time in Reshade() */
+#define RESHADE_CHUNK			256
+
+/**
+ * Return true if the point with the depth z fails the depth test against the stored depth d.
+ */
+static inline bool IsHidden(float d, float z, int depthTest) {
+	if (depthTest == FrameBuffer::DEPTH_TEST_EQUAL) {
+		// the pixel has been shaded, or the point is behind the depth of the z-prepass
+		return d < 0.0f || d > z * (1.0f + DEPTH_EQUAL_TOLERANCE);
+	}
+
+	return d >= z;
+}
+
+/**
+ * Return the perspective-correct barycentric coordinates at the screen position (x, y).
+ *
+ * @param q		the rows of the inverse of [p0-C p1-C p2-C] times the camera matrix
+ */
+static inline void GetPerspectiveWeights(const float q[3][3], float x, float y, float &s, float &t) {
+	float a0 = q[0][0] * x + q[0][1] * y + q[0][2];
+	float a1 = q[1][0] * x + q[1][1] * y + q[1][2];
+	float a2 = q[2][0] * x + q[2][1] * y + q[2][2];
+	float w = a0 + a1 + a2;
+	s = a1 / w;
+	t = a2 / w;
+}
+
+/**
+ * Light the point of the triangle by Phong shading.
+ * The position is located by the perspective-correct weights (s2, t2), and the color and the normal are
+ * interpolated by the weights (s, t) of the rasterization mode.
+ */
+static inline V3 ShadePhong(int u, int v, const Vertex &p0, const Vertex &p1, const Vertex &p2, float s, float t, float s2, float t2) {
+	// locate the corresponding point on the triangle plane.
+	V3 p = p0.v * (1 - s2 - t2) + p1.v * s2 + p2.v * t2;
+
+	// interpolate the color, the normal, and the ambient occlusion
+	V3 c = p0.c * (1.0f - s - t) + p1.c * s + p2.c * t;
+	V3 n = p0.n * (1.0f - s - t) + p1.n * s + p2.n * t;
+	float ao = p0.ao * (1.0f - s - t) + p1.ao * s + p2.ao * t;
+
+	return scene->lights->GetColor(u, v, p, c, n, ao);
+}
+
+/**
+ * Light the triangle once by flat shading.
+ * The centroid is lit with the average color and ambient occlusion of the vertices and the face normal, which is flipped
+ * to agree with the vertex normals.
+ */
+static inline V3 ShadeFlat(const Vertex &p0, const Vertex &p1, const Vertex &p2) {
+	V3 p = (p0.v + p1.v + p2.v) / 3.0f;
+	V3 c = (p0.c + p1.c + p2.c) / 3.0f;
+	V3 n = (p1.v - p0.v) ^ (p2.v - p0.v);
+	if (n * (p0.n + p1.n + p2.n) < 0.0f) n = n * -1.0f;
+	float ao = (p0.ao + p1.ao + p2.ao) / 3.0f;
+
+	return scene->lights->GetColor(p, c, n.UnitVector(), ao);
+}
+
+/**
+ * Write the pixel that has passed the depth test.
+ * Under the equal-depth test, the shaded pixels are marked by negating their depth until
+ * FrameBuffer::SetDepthTest() restores them.
+ */
+static inline void WritePixel(const RasterTarget &target, int index, unsigned int clr, float z) {
+	target.pix[index] = clr;
+	if (target.visMesh != NULL) target.visMesh[index] = -1;
+	if (target.depthTest == FrameBuffer::DEPTH_TEST_EQUAL) {
+		target.zb[index] = -target.zb[index];
+	} else {
+		target.zb[index] = z;
+	}
+}
+
+/**
+ * Record the triangle and the weights that the lit pixel was shaded with in the visibility buffer.
+ * This is called after WritePixel(), which has marked the pixel as not lit.
+ */
+static inline void RecordVisibility(const RasterTarget &target, int index, int shading, float s, float t, float s2, float t2) {
+	if (target.visMesh == NULL) return;
+
+	target.visMesh[index] = target.mesh;
+	target.visTri[index] = target.triangle;
+	target.visShading[index] = (unsigned char)shading;
+	float* weights = &target.visWeights[index * 4];
+	weights[0] = s;
+	weights[1] = t;
+	weights[2] = s2;
+	weights[3] = t2;
+}
+
 // makes an OpenGL window that supports SW, HW rendering, that can be displayed on screen
 //        and that receives UI events, i.e. keyboard, mouse, etc.
 FrameBuffer::FrameBuffer(int u0, int v0, int _w, int _h) : Fl_Gl_Window(u0, v0, _w, _h, 0) {
@@ -16,10 +116,22 @@ FrameBuffer::FrameBuffer(int u0, int v0, int _w, int _h) : Fl_Gl_Window(u0, v0,
 	h = _h;
 	pix = new unsigned int[w*h];
 	zb  = new float[w*h];
+	depthTest = DEPTH_TEST_LESS;
+	ResetStats();
+
+	visMesh = new int[w*h];
+	visTri = new int[w*h];
+	visWeights = new float[w*h*4];
+	visShading = new unsigned char[w*h];
+	ClearVisibility();
 }
 
 FrameBuffer::~FrameBuffer() {
 	delete [] pix;
+	delete [] visMesh;
+	delete [] visTri;
+	delete [] visWeights;
+	delete [] visShading;
 }
 
 // rendering callback; see header file comment
@@ -67,6 +179,20 @@ void FrameBuffer::KeyboardHandle() {
     case 'a':
 		cerr << "pressed a" << endl;
 		break;
+	case 'f':
+		// toggle the flat shading of the meshes lit by Phong shading
+		scene->flat_shading = !scene->flat_shading;
+		cerr << "INFO: flat shading " << (scene->flat_shading ? "on" : "off") << endl;
+		scene->Render();
+		PrintStats();
+		break;
+	case 'r':
+		// cycle the shading rate of Phong shading (1x1, 2x2, 4x4)
+		scene->shading_rate = (scene->shading_rate >= 4) ? 1 : scene->shading_rate * 2;
+		cerr << "INFO: shading rate " << scene->shading_rate << "x" << scene->shading_rate << endl;
+		scene->Render();
+		PrintStats();
+		break;
 	default:
 		cerr << "INFO: do not understand keypress" << endl;
 	}
@@ -132,10 +258,9 @@ void FrameBuffer::Set(int u, int v, unsigned int clr) {
  * @param z		z buffer
  */
 void FrameBuffer::Set(int u, int v, unsigned int clr, float z) {
-	if (zb[(h-1-v)*w+u] >= z) return;
+	if (isHidden(u, v, z)) return;
 
-	pix[(h-1-v)*w+u] = clr;
-	zb[(h-1-v)*w+u] = z;
+	WritePixel(GetTarget(), (h-1-v)*w+u, clr, z);
 }
 
 /**
@@ -159,6 +284,24 @@ void FrameBuffer::SetZB(float z0) {
 	}
 }
 
+/**
+ * Change the depth test.
+ * After the z-prepass has filled the z buffer by the depth-only rasterizer, the color pass with DEPTH_TEST_EQUAL
+ * shades only the visible point of each pixel. Switching back to DEPTH_TEST_LESS restores the depth of
+ * the pixels shaded by the color pass.
+ *
+ * @param depthTest		DEPTH_TEST_LESS or DEPTH_TEST_EQUAL
+ */
+void FrameBuffer::SetDepthTest(int depthTest) {
+	if (this->depthTest == DEPTH_TEST_EQUAL && depthTest != DEPTH_TEST_EQUAL) {
+		for (int i = 0; i < w*h; i++) {
+			if (zb[i] < 0.0f) zb[i] = -zb[i];
+		}
+	}
+
+	this->depthTest = depthTest;
+}
+
 /**
  * Draw 2D segment with color interpolation.
  *
@@ -311,211 +454,509 @@ void FrameBuffer::Draw3DBigPoint(PPC* ppc, const V3 &p, int psize, const V3 &col
 	Draw2DBigPoint(pp.x(), pp.y(), psize, color, pp.z());
 }
 
+/**
+ * Return true if the point at the pixel (u, v) with the specified depth fails the depth test.
+ *
+ * @param u		x coordinate of the pixel
+ * @param v		y coordinate of the pixel
+ * @param z		the depth (1/w)
+ * @return		true if the point is hidden
+ */
 bool FrameBuffer::isHidden(int u, int v, float z) {
-	if (zb[(h-1-v)*w+u] >= z) return true;
-	else return false;
+	return IsHidden(zb[(h-1-v)*w+u], z, depthTest);
 }
 
-void FrameBuffer::rasterize(PPC* ppc, const M33 &camMat, const Vertex &p0, const Vertex &p1, const Vertex &p2) {
-	AABB box;
-
-	// if the area is too small, skip this triangle.
-	if (((p1.v - p0.v) ^ (p2.v - p0.v)).Length() < 1e-7) return;
+/**
+ * Reset the statistics of the rasterization, which is called at the beginning of every frame.
+ */
+void FrameBuffer::ResetStats() {
+	stats.trianglesN = 0;
+	stats.pixelsN = 0;
+	stats.shadingsN = 0;
+	stats.coarseBlocksN = 0;
+	stats.culledMeshesN = 0;
+	stats.lodMeshesN = 0;
+	stats.lodTrianglesSavedN = 0;
+	stats.culledMeshletsN = 0;
+	stats.culledMeshletTrianglesN = 0;
+}
 
-	bool isFront = false;
-	V3 pp0, pp1, pp2;
-	if (!ppc->Project(p0.v, pp0)) return;
-	if (!ppc->Project(p1.v, pp1)) return;
-	if (!ppc->Project(p2.v, pp2)) return;
+/**
+ * Print the statistics of the last frame.
+ */
+void FrameBuffer::PrintStats() {
+	cerr << "INFO: " << stats.trianglesN << " triangles, " << stats.pixelsN << " pixels, "
+		<< stats.shadingsN << " lighting evaluations (" << stats.coarseBlocksN << " coarse blocks), "
+		<< stats.culledMeshesN << " meshes culled, " << stats.lodMeshesN << " meshes simplified ("
+		<< stats.lodTrianglesSavedN << " triangles saved), " << stats.culledMeshletsN << " meshlets culled ("
+		<< stats.culledMeshletTrianglesN << " triangles)" << endl;
+}
 
-	// compute the bounding box
-	box.AddPoint(pp0);
-	box.AddPoint(pp1);
-	box.AddPoint(pp2);
+/**
+ * Mark all the pixels as not lit, which is called before the meshes are rendered.
+ */
+void FrameBuffer::ClearVisibility() {
+	for (int i = 0; i < w*h; i++) {
+		visMesh[i] = -1;
+	}
+}
 
-	// the bounding box should be inside the screen
-	int u_min = (int)(box.minCorner().x() + 0.5f);
-	if (u_min < 0) u_min = 0;;
-	int u_max = (int)(box.maxCorner().x() - 0.5f);
-	if (u_max >= w) u_max = w - 1;
-	int v_min = (int)(box.minCorner().y() + 0.5f);
-	if (v_min < 0) v_min = 0;
-	int v_max = (int)(box.maxCorner().y() - 0.5f);
-	if (v_max >= h) v_max = h - 1;
-
-	// setup some variables
-	float denom = ((pp1 - pp0) ^ (pp2 - pp0)).z();
-	M33 Q;
-	Q.SetColumn(0, p0.v - ppc->C);
-	Q.SetColumn(1, p1.v - ppc->C);
-	Q.SetColumn(2, p2.v - ppc->C);
-	Q = Q.Inverted() * camMat;
-
-	// vertex colors that will be used only for Gouraud shading
-	V3 c0 = scene->light->GetColor(ppc, p0.v, p0.c, p0.n);
-	V3 c1 = scene->light->GetColor(ppc, p1.v, p1.c, p1.n);
-	V3 c2 = scene->light->GetColor(ppc, p2.v, p2.c, p2.n);
-
-	for (int u = u_min; u <= u_max; u++) {
-		for (int v = v_min; v <= v_max; v++) {
-			V3 pp((u + 0.5f) * ppc->a.Length(), (v + 0.5f) * ppc->b.Length(), 0.0f);
-
-			float s = ((pp - pp0) ^ (pp2 - pp0)).z() / denom;
-			float t = -((pp - pp0) ^ (pp1 - pp0)).z() / denom;
-
-			// if the point is outside the triangle, skip it.
-			if (s < 0 || s > 1 || t < 0 || t > 1 || s + t > 1) continue;
-				
-			V3 a = Q * V3((float)u + 0.5f, (float)v + 0.5f, 1.0f);
-			float w2 = a.x() + a.y() + a.z();
-			float s2 = a.y() / w2;
-			float t2 = a.z() / w2;
-
-			// locate the corresponding point on the triangle plane.
-			V3 p = p0.v * (1 - s2 - t2) + p1.v * s2 + p2.v * t2;
-
-			if (scene->rasterization_mode == MODEL_SPACE_RASTERIZATION) {
-				// project the point on the screen space.
-				// if the point is behind the camera, skip this pixel.
-				if (!ppc->Project(p, pp)) continue;
-			} else {
-				// interpolate the z coordinate
-				pp[2] = pp0.z() * (1.0f - s - t) + pp1.z() * s + pp2.z() * t;
-
-				// if the point is behind the camera, skip this pixel.
-				if (pp.z() <= 0) continue;
-			}
+/**
+ * Light the pixels again from the visibility buffer without rasterizing the meshes.
+ * This is valid only if the camera, the instances, and the rendering modes are the same as when the visibility
+ * buffer was recorded, and only the lights have changed. Each lit pixel is shaded with the same triangle and
+ * the same weights as the last rasterization, so the image is the same as rendering the frame again.
+ * The pixels that are not lit keep their colors.
+ * The instances of the same mesh share the scratch buffers of the vertex stage, so the pixels are bucketed by
+ * the instance, and the vertices of each instance are transformed (and lit for Gouraud shading) once
+ * before its pixels are shaded.
+ *
+ * @param ppc			the camera
+ * @param instances		the instances indexed by the mesh id of the visibility buffer
+ * @param instancesN	the number of instances
+ */
+void FrameBuffer::Reshade(PPC* ppc, MeshInstance** instances, int instancesN) {
+	// the pixels of each instance in the scanline order
+	vector<int> offsets(instancesN + 1, 0);
+	for (int i = 0; i < w * h; i++) {
+		if (visMesh[i] >= 0 && visMesh[i] < instancesN) offsets[visMesh[i] + 1]++;
+	}
+	for (int i = 0; i < instancesN; i++) {
+		offsets[i + 1] += offsets[i];
+	}
+	vector<int> pixels(max(offsets[instancesN], 1));
+	vector<int> fill(offsets.begin(), offsets.end() - 1);
+	for (int i = 0; i < w * h; i++) {
+		if (visMesh[i] >= 0 && visMesh[i] < instancesN) pixels[fill[visMesh[i]]++] = i;
+	}
 
-			// check if the point is occluded by other triangles.
-			if (zb[(h-1-v)*w+u] >= pp.z()) continue;
+	int shadingsN = 0;
+
+	for (int k = 0; k < instancesN; k++) {
+		int begin = offsets[k];
+		int end = offsets[k + 1];
+		if (begin == end) continue;
+
+		TMesh* mesh = instances[k]->GetDrawnMesh();
+		const Vertex* verts = instances[k]->TransformVertices();
+		const Vertex* lit = NULL;
+		for (int j = begin; j < end; j++) {
+			if (visShading[pixels[j]] != GOURAUD_SHADING) continue;
+			mesh->LightVertices(verts);
+			shadingsN += mesh->GetVerticesN();
+			lit = mesh->GetLitVertices();
+			break;
+		}
 
-			
-			if (scene->rasterization_mode == MODEL_SPACE_RASTERIZATION) {
-				s = s2;
-				t = t2;
+		// the pixels are shaded in chunks, within which the color of the left neighbor is reused
+		// for the pixels of a coarse block sharing the triangle and the weights
+		int chunksN = (end - begin + RESHADE_CHUNK - 1) / RESHADE_CHUNK;
+		#pragma omp parallel for reduction(+:shadingsN)
+		for (int c = 0; c < chunksN; c++) {
+			int chunkBegin = begin + c * RESHADE_CHUNK;
+			int chunkEnd = min(chunkBegin + RESHADE_CHUNK, end);
+
+			for (int j = chunkBegin; j < chunkEnd; j++) {
+				int index = pixels[j];
+				int u = index % w;
+				int v = h - 1 - index / w;
+
+				const float* weights = &visWeights[index * 4];
+				int lastIndex = index - 1;
+				if (j > chunkBegin && pixels[j - 1] == lastIndex && u > 0 && visTri[lastIndex] == visTri[index] && visShading[lastIndex] == visShading[index]) {
+					const float* lastWeights = &visWeights[lastIndex * 4];
+					if (lastWeights[0] == weights[0] && lastWeights[1] == weights[1] && lastWeights[2] == weights[2] && lastWeights[3] == weights[3]) {
+						pix[index] = pix[lastIndex];
+						continue;
+					}
+				}
+
+				unsigned int tri[3];
+				mesh->GetTriangle(visTri[index], tri);
+				float s = weights[0];
+				float t = weights[1];
+
+				if (visShading[index] == GOURAUD_SHADING) {
+					V3 c = lit[tri[0]].c * (1.0f - s - t) + lit[tri[1]].c * s + lit[tri[2]].c * t;
+					pix[index] = c.GetColor();
+				} else if (visShading[index] == FLAT_SHADING) {
+					pix[index] = ShadeFlat(verts[tri[0]], verts[tri[1]], verts[tri[2]]).GetColor();
+					shadingsN++;
+				} else {
+					pix[index] = ShadePhong(u, v, verts[tri[0]], verts[tri[1]], verts[tri[2]], s, t, weights[2], weights[3]).GetColor();
+					shadingsN++;
+				}
 			}
+		}
+	}
 
-			V3 c;
-
-			if (scene->shading_mode == PHONG_SHADING) {
-				// interpolate the color
-				c = p0.c * (1.0f - s - t) + p1.c * s + p2.c * t;
+	stats.shadingsN += shadingsN;
+}
 
-				// interpolate the normal for Phong shading
-				V3 n = p0.n * (1.0f - s - t) + p1.n * s + p2.n * t;
-				c = scene->light->GetColor(ppc, p, c, n);
-			} else if (scene->shading_mode == GOURAUD_SHADING) {
-				// just interpolate the vertex colors
-				c = c0 * (1.0f - s - t) + c1 * s + c2 * t;
-			}
+/**
+ * Return the buffers of this frame buffer as the target of the rasterization.
+ *
+ * @return		the target
+ */
+RasterTarget FrameBuffer::GetTarget() {
+	RasterTarget target;
+	target.pix = pix;
+	target.zb = zb;
+	target.w = w;
+	target.h = h;
+	target.depthTest = depthTest;
+	target.stats = &stats;
+	target.visMesh = visMesh;
+	target.visTri = visTri;
+	target.visWeights = visWeights;
+	target.visShading = visShading;
+	target.mesh = -1;
+	target.triangle = -1;
+
+	return target;
+}
 
-			// draw the pixel (u,v) with the interpolated color.
-			Set(u, v, c.GetColor(), pp.z());
+/**
+ * Choose the instantiation of the triangle kernel for the current rasterization mode, shading mode, and shading rate.
+ * This should be called once per mesh, and the returned kernel is used for all its triangles.
+ * The textured meshes are not lit, so their kernels do not depend on the shading mode.
+ *
+ * @param textured		true if the mesh is textured
+ * @param depthOnly		true if only the z buffer is written
+ * @return				the kernel
+ */
+FrameBuffer::Rasterizer FrameBuffer::GetRasterizer(bool textured, bool depthOnly) {
+	static const Rasterizer untexturedKernels[2][2] = {
+		{
+			&rasterizeKernel<SCREEN_SPACE_RASTERIZATION, NO_SHADING, false, false, 1>,
+			&rasterizeKernel<SCREEN_SPACE_RASTERIZATION, GOURAUD_SHADING, false, false, 1>
+		}, {
+			&rasterizeKernel<MODEL_SPACE_RASTERIZATION, NO_SHADING, false, false, 1>,
+			&rasterizeKernel<MODEL_SPACE_RASTERIZATION, GOURAUD_SHADING, false, false, 1>
+		}
+	};
+	// the flat shaded color does not depend on the position in the triangle, so the rasterization mode does not matter
+	static const Rasterizer flatKernel = &rasterizeKernel<SCREEN_SPACE_RASTERIZATION, FLAT_SHADING, false, false, 1>;
+	static const Rasterizer phongKernels[2][3] = {
+		{
+			&rasterizeKernel<SCREEN_SPACE_RASTERIZATION, PHONG_SHADING, false, false, 1>,
+			&rasterizeKernel<SCREEN_SPACE_RASTERIZATION, PHONG_SHADING, false, false, 2>,
+			&rasterizeKernel<SCREEN_SPACE_RASTERIZATION, PHONG_SHADING, false, false, 4>
+		}, {
+			&rasterizeKernel<MODEL_SPACE_RASTERIZATION, PHONG_SHADING, false, false, 1>,
+			&rasterizeKernel<MODEL_SPACE_RASTERIZATION, PHONG_SHADING, false, false, 2>,
+			&rasterizeKernel<MODEL_SPACE_RASTERIZATION, PHONG_SHADING, false, false, 4>
 		}
+	};
+	static const Rasterizer texturedKernels[2] = {
+		&rasterizeKernel<SCREEN_SPACE_RASTERIZATION, NO_SHADING, true, false, 1>,
+		&rasterizeKernel<MODEL_SPACE_RASTERIZATION, NO_SHADING, true, false, 1>
+	};
+
+	if (depthOnly) return &rasterizeKernel<SCREEN_SPACE_RASTERIZATION, NO_SHADING, false, true, 1>;
+
+	if (textured) {
+		return texturedKernels[Scene::rasterization_mode];
+	} else if (Scene::shading_mode == PHONG_SHADING) {
+		int rate = Scene::shading_rate >= 4 ? 2 : (Scene::shading_rate >= 2 ? 1 : 0);
+		return phongKernels[Scene::rasterization_mode][rate];
+	} else if (Scene::shading_mode == FLAT_SHADING) {
+		return flatKernel;
+	} else {
+		return untexturedKernels[Scene::rasterization_mode][Scene::shading_mode];
 	}
 }
 
-void FrameBuffer::rasterizeWithTexture(PPC* ppc, const M33 &camMat, const Vertex &p0, const Vertex &p1, const Vertex &p2, Texture* texture) {
-	AABB box;
-
+/**
+ * Rasterize the triangle.
+ * Each combination of the rasterization mode, the shading mode, the texturing, and the depth-only pass is
+ * instantiated separately, so the per-pixel loop has no branch on them, and each variant interpolates
+ * only the attributes it uses.
+ *
+ * The coverage and the depth (1/w, which is linear in the screen space) are computed in the same way
+ * for all the variants, so that the color pass finds exactly the depth laid down by the z-prepass.
+ * The depth-only variant skips the color, the shading, and the perspective-correct interpolation.
+ * The flat shading variant lights the triangle once and writes the constant color without interpolating any attribute.
+ * The Phong variants with RATE > 1 light a RATE x RATE block of pixels once if the normal is nearly constant
+ * over the block, while the coverage and the depth are still resolved per pixel.
+ *
+ * @param target		the buffers to be written
+ * @param ppc			the camera
+ * @param camMat		the camera matrix [a b c]
+ * @param p0			the first vertex of the triangle
+ * @param p1			the second vertex of the triangle
+ * @param p2			the third vertex of the triangle
+ * @param pp0			the first vertex projected by TMesh::ProjectVertices() (in front of the camera)
+ * @param pp1			the second projected vertex
+ * @param pp2			the third projected vertex
+ * @param texture		the texture (used only for the textured variants)
+ */
+template<int RASTER, int SHADING, bool TEXTURED, bool DEPTH_ONLY, int RATE>
+void FrameBuffer::rasterizeKernel(const RasterTarget &target, PPC* ppc, const M33 &camMat, const Vertex &p0, const Vertex &p1, const Vertex &p2, const V3 &pp0, const V3 &pp1, const V3 &pp2, Texture* texture) {
 	// if the area is too small, skip this triangle.
 	if (((p1.v - p0.v) ^ (p2.v - p0.v)).Length() < 1e-7) return;
 
-	bool isFront = false;
-	V3 pp0, pp1, pp2;
-	if (!ppc->Project(p0.v, pp0)) return;
-	if (!ppc->Project(p1.v, pp1)) return;
-	if (!ppc->Project(p2.v, pp2)) return;
+	float x0 = pp0.x();
+	float y0 = pp0.y();
+	float z0 = pp0.z();
+	float dx1 = pp1.x() - x0;
+	float dy1 = pp1.y() - y0;
+	float dz1 = pp1.z() - z0;
+	float dx2 = pp2.x() - x0;
+	float dy2 = pp2.y() - y0;
+	float dz2 = pp2.z() - z0;
 
-	// compute the bounding box
-	box.AddPoint(pp0);
-	box.AddPoint(pp1);
-	box.AddPoint(pp2);
+	float denom = dx1 * dy2 - dy1 * dx2;
+	if (fabsf(denom) < 1e-7f) return;
 
 	// the bounding box should be inside the screen
-	int u_min = (int)(box.minCorner().x() + 0.5f);
-	if (u_min < 0) u_min = 0;;
-	if (u_min > w) return;
-	int u_max = (int)(box.maxCorner().x() - 0.5f);
-	if (u_max >= w) u_max = w - 1;
-	if (u_max < 0) return;
-	int v_min = (int)(box.minCorner().y() + 0.5f);
-	if (v_min < 0) v_min = 0;
-	if (v_min > h) return;
-	int v_max = (int)(box.maxCorner().y() - 0.5f);
-	if (v_max >= h) v_max = h - 1;
-	if (v_max < 0) return;
-
-	// the bounding box of texture coordinate
-	AABB boxTexCoord;
-	boxTexCoord.AddPoint(V3(p0.t[0], p0.t[1], 0.0f));
-	boxTexCoord.AddPoint(V3(p1.t[0], p1.t[1], 0.0f));
-	boxTexCoord.AddPoint(V3(p2.t[0], p2.t[1], 0.0f));
-
-	// set the mipmap according to the AABB
-	texture->SetMipMap(u_max - u_min, v_max - v_min, boxTexCoord.maxCorner().x() - boxTexCoord.minCorner().x(), boxTexCoord.maxCorner().y() - boxTexCoord.minCorner().y());
-
-	// setup some variables
-	float denom = ((pp1 - pp0) ^ (pp2 - pp0)).z();
-	M33 Q;
-	Q.SetColumn(0, p0.v - ppc->C);
-	Q.SetColumn(1, p1.v - ppc->C);
-	Q.SetColumn(2, p2.v - ppc->C);
-	Q = Q.Inverted() * camMat;
-
-
-
-	for (int u = u_min; u <= u_max; u++) {
+	int w = target.w;
+	int h = target.h;
+	int u_min = max(0, (int)(min(x0, min(pp1.x(), pp2.x())) + 0.5f));
+	int u_max = min(w - 1, (int)(max(x0, max(pp1.x(), pp2.x())) - 0.5f));
+	int v_min = max(0, (int)(min(y0, min(pp1.y(), pp2.y())) + 0.5f));
+	int v_max = min(h - 1, (int)(max(y0, max(pp1.y(), pp2.y())) - 0.5f));
+	if (u_min > u_max || v_min > v_max) return;
+
+	// the barycentric coordinates are linear functions of the pixel position
+	float dsdu = dy2 / denom;
+	float dsdv = -dx2 / denom;
+	float dtdu = -dy1 / denom;
+	float dtdv = dx1 / denom;
+	float su = (u_min + 0.5f - x0) * dsdu;
+	float tu = (u_min + 0.5f - x0) * dtdu;
+
+	float* zb = target.zb;
+
+	if (DEPTH_ONLY) {
 		for (int v = v_min; v <= v_max; v++) {
-			V3 pp((u + 0.5f) * ppc->a.Length(), (v + 0.5f) * ppc->b.Length(), 0.0f);
-
-			float s = ((pp - pp0) ^ (pp2 - pp0)).z() / denom;
-			float t = -((pp - pp0) ^ (pp1 - pp0)).z() / denom;
-
-			// if the point is outside the triangle, skip it.
-			if (s < 0 || s > 1 || t < 0 || t > 1 || s + t > 1) continue;
-				
-			V3 a = Q * V3((float)u + 0.5f, (float)v + 0.5f, 1.0f);
-			float w2 = a.x() + a.y() + a.z();
-			float s2 = a.y() / w2;
-			float t2 = a.z() / w2;
-
-			// unproject and locate the corresponding point on the triangle plane.
-			V3 p = p0.v * (1 - s2 - t2) + p1.v * s2 + p2.v * t2;
-
-			if (scene->rasterization_mode == MODEL_SPACE_RASTERIZATION) {
-				// project the point on the screen space.
-				// if the point is behind the camera, skip this pixel.
-				if (!ppc->Project(p, pp)) continue;
-			} else {
-				// interpolate the z coordinate
-				pp[2] = pp0.z() * (1.0f - s - t) + pp1.z() * s + pp2.z() * t;
-
-				// if the point is behind the camera, skip this pixel.
-				if (pp.z() <= 0) continue;
+			float s0 = su + (v + 0.5f - y0) * dsdv;
+			float t0 = tu + (v + 0.5f - y0) * dtdv;
+			float* row = &zb[(h - 1 - v) * w];
+
+			for (int u = u_min; u <= u_max; u++) {
+				float s = s0 + (u - u_min) * dsdu;
+				float t = t0 + (u - u_min) * dtdu;
+				if (s < 0.0f || t < 0.0f || s + t > 1.0f) continue;
+
+				float z = z0 + dz1 * s + dz2 * t;
+				if (row[u] >= z) continue;
+				row[u] = z;
 			}
+		}
+		return;
+	}
 
-			// check if the point is occluded by other triangles.
-			if (zb[(h-1-v)*w+u] >= pp.z()) continue;
+	// the perspective-correct barycentric coordinates are needed for the model space rasterization,
+	// and for locating the point to be lit by Phong shading
+	const bool PERSPECTIVE = (RASTER == MODEL_SPACE_RASTERIZATION) || (SHADING == PHONG_SHADING);
+	float q[3][3];
+	if (PERSPECTIVE) {
+		M33 Q;
+		Q.SetColumn(0, p0.v - ppc->C);
+		Q.SetColumn(1, p1.v - ppc->C);
+		Q.SetColumn(2, p2.v - ppc->C);
+		Q = Q.Inverted() * camMat;
+		for (int i = 0; i < 3; i++) {
+			V3 row = Q.GetRow(i);
+			q[i][0] = row.x();
+			q[i][1] = row.y();
+			q[i][2] = row.z();
+		}
+	}
 
-			if (scene->rasterization_mode == MODEL_SPACE_RASTERIZATION) {
-				s = s2;
-				t = t2;
+	int pixelsN = 0;
+	int shadingsN = 0;
+	int coarseBlocksN = 0;
+
+
+	if (RATE > 1) {
+		// the blocks are aligned to the screen, so that the adjacent triangles agree on the block boundaries
+		for (int bu = u_min - u_min % RATE; bu <= u_max; bu += RATE) {
+			for (int bv = v_min - v_min % RATE; bv <= v_max; bv += RATE) {
+				// the block is lit once at its center if the normal varies little over it,
+				// which is decided when the first visible pixel is found
+				bool decided = false;
+				bool coarse = false;
+				unsigned int blockColor = 0;
+				float blockS = 0.0f, blockT = 0.0f, blockS2 = 0.0f, blockT2 = 0.0f;
+
+				for (int u = max(bu, u_min); u <= min(bu + RATE - 1, u_max); u++) {
+					for (int v = max(bv, v_min); v <= min(bv + RATE - 1, v_max); v++) {
+						float s = su + (v + 0.5f - y0) * dsdv + (u - u_min) * dsdu;
+						float t = tu + (v + 0.5f - y0) * dtdv + (u - u_min) * dtdu;
+						if (s < 0.0f || t < 0.0f || s + t > 1.0f) continue;
+
+						float z = z0 + dz1 * s + dz2 * t;
+						int index = (h - 1 - v) * w + u;
+						if (IsHidden(zb[index], z, target.depthTest)) continue;
+
+						if (!decided) {
+							decided = true;
+
+							// the normals at the center and the corners of the block
+							// (the barycentric coordinates are extrapolated outside the triangle)
+							V3 normals[5];
+							float xs[5] = { bu + RATE * 0.5f, (float)bu, (float)(bu + RATE), (float)bu, (float)(bu + RATE) };
+							float ys[5] = { bv + RATE * 0.5f, (float)bv, (float)bv, (float)(bv + RATE), (float)(bv + RATE) };
+							for (int k = 0; k < 5; k++) {
+								float sk, tk;
+								if (RASTER == MODEL_SPACE_RASTERIZATION) {
+									GetPerspectiveWeights(q, xs[k], ys[k], sk, tk);
+								} else {
+									sk = (xs[k] - x0) * dsdu + (ys[k] - y0) * dsdv;
+									tk = (xs[k] - x0) * dtdu + (ys[k] - y0) * dtdv;
+								}
+								normals[k] = (p0.n * (1.0f - sk - tk) + p1.n * sk + p2.n * tk).UnitVector();
+							}
+
+							coarse = true;
+							for (int k = 1; k < 5; k++) {
+								if (normals[0] * normals[k] < COARSE_SHADING_COS) coarse = false;
+							}
+
+							if (coarse) {
+								float sc = (xs[0] - x0) * dsdu + (ys[0] - y0) * dsdv;
+								float tc = (xs[0] - x0) * dtdu + (ys[0] - y0) * dtdv;
+								float sc2, tc2;
+								GetPerspectiveWeights(q, xs[0], ys[0], sc2, tc2);
+								if (RASTER == MODEL_SPACE_RASTERIZATION) {
+									sc = sc2;
+									tc = tc2;
+								}
+								blockColor = ShadePhong(min(bu + RATE / 2, w - 1), min(bv + RATE / 2, h - 1), p0, p1, p2, sc, tc, sc2, tc2).GetColor();
+								blockS = sc;
+								blockT = tc;
+								blockS2 = sc2;
+								blockT2 = tc2;
+								shadingsN++;
+								coarseBlocksN++;
+							}
+						}
+
+						if (coarse) {
+							WritePixel(target, index, blockColor, z);
+							RecordVisibility(target, index, SHADING, blockS, blockT, blockS2, blockT2);
+						} else {
+							float s2, t2;
+							GetPerspectiveWeights(q, u + 0.5f, v + 0.5f, s2, t2);
+							if (RASTER == MODEL_SPACE_RASTERIZATION) {
+								s = s2;
+								t = t2;
+							}
+							WritePixel(target, index, ShadePhong(u, v, p0, p1, p2, s, t, s2, t2).GetColor(), z);
+							RecordVisibility(target, index, SHADING, s, t, s2, t2);
+							shadingsN++;
+						}
+						pixelsN++;
+					}
+				}
 			}
+		}
+	} else {
+		// the visible pixels are textured in batches of up to 16 pixels along each column
+		const int BATCH = 16;
+		int batchIndex[BATCH];
+		float batchZ[BATCH], batchS[BATCH], batchT[BATCH], batchLOD[BATCH];
+		unsigned int batchColors[BATCH];
+		int batchN = 0;
+		float lod = 0.0f;
+
+		// the color of the flat shaded triangle
+		bool flatShaded = false;
+		unsigned int flatColor = 0;
+
+		if (TEXTURED) {
+			// set the mipmap according to the AABB of the texture coordinates
+			AABB boxTexCoord;
+			boxTexCoord.AddPoint(V3(p0.t[0], p0.t[1], 0.0f));
+			boxTexCoord.AddPoint(V3(p1.t[0], p1.t[1], 0.0f));
+			boxTexCoord.AddPoint(V3(p2.t[0], p2.t[1], 0.0f));
+			texture->SetMipMap(u_max - u_min, v_max - v_min, boxTexCoord.maxCorner().x() - boxTexCoord.minCorner().x(), boxTexCoord.maxCorner().y() - boxTexCoord.minCorner().y());
+			lod = texture->GetLOD();
+		}
 
+		for (int u = u_min; u <= u_max; u++) {
+			for (int v = v_min; v <= v_max; v++) {
+				float s = su + (v + 0.5f - y0) * dsdv + (u - u_min) * dsdu;
+				float t = tu + (v + 0.5f - y0) * dtdv + (u - u_min) * dtdu;
+
+				// if the point is outside the triangle, skip it.
+				if (s < 0.0f || t < 0.0f || s + t > 1.0f) continue;
+
+				// check if the point is occluded by other triangles.
+				float z = z0 + dz1 * s + dz2 * t;
+				int index = (h - 1 - v) * w + u;
+				if (IsHidden(zb[index], z, target.depthTest)) continue;
+
+				float s2 = s;
+				float t2 = t;
+				if (PERSPECTIVE) GetPerspectiveWeights(q, u + 0.5f, v + 0.5f, s2, t2);
+
+				if (RASTER == MODEL_SPACE_RASTERIZATION) {
+					s = s2;
+					t = t2;
+				}
+
+				if (TEXTURED) {
+					// interpolate the texture coordinates
+					batchIndex[batchN] = index;
+					batchZ[batchN] = z;
+					batchS[batchN] = p0.t[0] * (1.0f - s - t) + p1.t[0] * s + p2.t[0] * t;
+					batchT[batchN] = p0.t[1] * (1.0f - s - t) + p1.t[1] * s + p2.t[1] * t;
+					batchLOD[batchN] = lod;
+					batchN++;
+
+					if (batchN == BATCH) {
+						texture->GetColors(batchS, batchT, batchLOD, batchN, batchColors);
+						for (int i = 0; i < batchN; i++) {
+							WritePixel(target, batchIndex[i], batchColors[i], batchZ[i]);
+						}
+						batchN = 0;
+					}
+				} else if (SHADING == FLAT_SHADING) {
+					// the triangle is lit once when its first pixel is found
+					if (!flatShaded) {
+						flatColor = ShadeFlat(p0, p1, p2).GetColor();
+						flatShaded = true;
+						shadingsN++;
+					}
+					WritePixel(target, index, flatColor, z);
+					RecordVisibility(target, index, SHADING, 0.0f, 0.0f, 0.0f, 0.0f);
+				} else {
+					V3 c;
+
+					if (SHADING == PHONG_SHADING) {
+						c = ShadePhong(u, v, p0, p1, p2, s, t, s2, t2);
+						shadingsN++;
+					} else {
+						// Gouraud shading interpolates the vertex colors, which have been lit by TMesh::LightVertices(),
+						// and NO_SHADING interpolates the unlit vertex colors
+						c = p0.c * (1.0f - s - t) + p1.c * s + p2.c * t;
+					}
+
+					// draw the pixel (u,v) with the interpolated color.
+					WritePixel(target, index, c.GetColor(), z);
+					if (SHADING != NO_SHADING) RecordVisibility(target, index, SHADING, s, t, s2, t2);
+				}
+				pixelsN++;
+			}
 
-
-			// get the corresponding color by using bi-linear interpolation lookup
-			float t_x = p0.t[0] * (1.0f - s - t) + p1.t[0] * s + p2.t[0] * t;
-			float t_y = p0.t[1] * (1.0f - s - t) + p1.t[1] * s + p2.t[1] * t;
-
-
-
-			V3 c = texture->GetColor(t_x, t_y);
-
-			// draw the pixel (u,v) with the interpolated color.
-			Set(u, v, c.GetColor(), pp.z());
+			// flush the rest of the column
+			if (TEXTURED && batchN > 0) {
+				texture->GetColors(batchS, batchT, batchLOD, batchN, batchColors);
+				for (int i = 0; i < batchN; i++) {
+					WritePixel(target, batchIndex[i], batchColors[i], batchZ[i]);
+				}
+				batchN = 0;
+			}
 		}
 	}
 
+	if (target.stats != NULL) {
+		target.stats->trianglesN++;
+		target.stats->pixelsN += pixelsN;
+		target.stats->shadingsN += shadingsN;
+		target.stats->coarseBlocksN += coarseBlocksN;
+	}
 }
@@ -9,10 +9,71 @@
 #include "PPC.h"
 #include "Texture.h"
 
+class MeshInstance;
+
+/** the statistics of the rasterization in a frame */
+typedef struct {
+	/** the number of triangles that reached the rasterizer */
+	int trianglesN;
+
+	/** the number of pixels written */
+	int pixelsN;
+
+	/** the number of lighting evaluations */
+	int shadingsN;
+
+	/** the number of blocks shaded once by the coarse shading */
+	int coarseBlocksN;
+
+	/** the number of meshes culled by the view frustum */
+	int culledMeshesN;
+
+	/** the number of meshes drawn with a simplified level of detail, and the triangles saved by them */
+	int lodMeshesN;
+	int lodTrianglesSavedN;
+
+	/** the number of meshlets culled by the view frustum or by facing away, and the triangles in them */
+	int culledMeshletsN;
+	int culledMeshletTrianglesN;
+} FrameStats;
+
+/** the buffers that a triangle is rasterized into */
+typedef struct {
+	/** the color buffer (NULL for the depth-only rasterization) */
+	unsigned int* pix;
+
+	/** the z buffer (1/w, the first pixel is the bottom left corner) */
+	float* zb;
+
+	int w;
+	int h;
+
+	/** FrameBuffer::DEPTH_TEST_LESS or FrameBuffer::DEPTH_TEST_EQUAL */
+	int depthTest;
+
+	/** the statistics to be updated (NULL if not needed) */
+	FrameStats* stats;
+
+	/** the visibility buffer to be written (NULL if not needed, see FrameBuffer::Reshade()) */
+	int* visMesh;
+	int* visTri;
+	float* visWeights;
+	unsigned char* visShading;
+
+	/** the mesh and the triangle being rasterized */
+	int mesh;
+	int triangle;
+} RasterTarget;
+
 // framebuffer + window class
 
 class FrameBuffer : public Fl_Gl_Window {
 public:
+	enum { DEPTH_TEST_LESS = 0, DEPTH_TEST_EQUAL };
+
+	/** an instantiation of the triangle kernel */
+	typedef void (*Rasterizer)(const RasterTarget &target, PPC* ppc, const M33 &camMat, const Vertex &p0, const Vertex &p1, const Vertex &p2, const V3 &pp0, const V3 &pp1, const V3 &pp2, Texture* texture);
+
 	/** software color buffer (The first pixel is the bottom left corner.) */
 	unsigned int *pix;
 
@@ -25,6 +86,29 @@ public:
 	/** image height resolution */
 	int h;
 
+	/**
+	 * DEPTH_TEST_LESS passes the nearer points as usual.
+	 * DEPTH_TEST_EQUAL passes only the points at the depth laid down by the z-prepass, and each pixel
+	 * passes at most once.
+	 */
+	int depthTest;
+
+	/** the statistics of the current frame */
+	FrameStats stats;
+
+	/**
+	 * The visibility buffer, which records what each lit pixel shows, so that the pixels can be lit again
+	 * without the rasterization when only the lighting changes.
+	 * visMesh is -1 for the pixels that are not lit (the background, the textured meshes, and NO_SHADING).
+	 * The flat shaded pixels record zero weights, since the color is constant over the triangle.
+	 * visWeights holds 4 floats per pixel: the interpolation weights (s, t) and the perspective-correct
+	 * weights (s2, t2) that the pixel was shaded with.
+	 */
+	int* visMesh;
+	int* visTri;
+	float* visWeights;
+	unsigned char* visShading;
+
 	/** the last position of the mouse pointer */
 	V3 lastPosition;
 
@@ -48,6 +132,11 @@ public:
 	void Set(int u, int v, unsigned int clr, float z);
 	void SetGuarded(int u, int v, unsigned int clr, float z);
 	void SetZB(float z0);
+	void SetDepthTest(int depthTest);
+	void ResetStats();
+	void PrintStats();
+	void ClearVisibility();
+	void Reshade(PPC* ppc, MeshInstance** instances, int instancesN);
 	void Draw2DSegment(const V3 &p0, const V3 &c0, const V3 &p1, const V3 &c1);
 	void Draw3DSegment(PPC* ppc, const V3 &p0, const V3 &c0, const V3 &p1, const V3 &c1);
 	void DrawRectangle(const V3 &p0, const V3 &p1, const V3 &c);
@@ -60,8 +149,12 @@ public:
 
 	bool isHidden(int u, int v, float z);
 
-	void rasterize(PPC* ppc, const M33 &camMat, const Vertex &p0, const Vertex &p1, const Vertex &p2);
-	void rasterizeWithTexture(PPC* ppc, const M33 &camMat, const Vertex &p0, const Vertex &p1, const Vertex &p2, Texture* texture);
+	RasterTarget GetTarget();
+	static Rasterizer GetRasterizer(bool textured, bool depthOnly);
+
+private:
+	template<int RASTER, int SHADING, bool TEXTURED, bool DEPTH_ONLY, int RATE>
+	static void rasterizeKernel(const RasterTarget &target, PPC* ppc, const M33 &camMat, const Vertex &p0, const Vertex &p1, const Vertex &p2, const V3 &pp0, const V3 &pp1, const V3 &pp2, Texture* texture);
 };
 
 
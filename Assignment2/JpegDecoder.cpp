@@ -0,0 +1,589 @@
+#include "JpegDecoder.h"
+#include <fstream>
+#include <iostream>
+#include <string.h>
+#include <ctype.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+using namespace std;
+
+/** the index in the natural order of each coefficient in the zig-zag order */
+static const int zigzag[64] = {
+	0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/**
+ * Reader of the entropy-coded bits.
+ * The byte stuffing has been removed beforehand, so that the reader simply reads the bytes.
+ * After the end of the data, zero bits are returned.
+ */
+class BitReader {
+private:
+	const unsigned char* p;
+	const unsigned char* end;
+
+public:
+	/** the valid bits are aligned to the most significant bit */
+	unsigned int buf;
+	int bits;
+
+public:
+	BitReader(const unsigned char* data, int length) : p(data), end(data + length), buf(0), bits(0) {}
+
+	void Fill() {
+		while (bits <= 24) {
+			unsigned int c = (p < end) ? *p++ : 0;
+			buf |= c << (24 - bits);
+			bits += 8;
+		}
+	}
+
+	void Consume(int n) {
+		buf <<= n;
+		bits -= n;
+	}
+
+	int GetBits(int n) {
+		if (n == 0) return 0;
+		Fill();
+		int ret = buf >> (32 - n);
+		Consume(n);
+		return ret;
+	}
+};
+
+/**
+ * Convert the n-bit magnitude category value into the signed value.
+ */
+static int Extend(int v, int n) {
+	return (v < (1 << (n - 1))) ? v - (1 << n) + 1 : v;
+}
+
+static int Read16(const unsigned char* p) {
+	return (p[0] << 8) | p[1];
+}
+
+/**
+ * Cosine table of the inverse DCT.
+ * The only instance is filled by the static initialization before any decoder runs,
+ * so that the decoders on the worker threads only read it.
+ */
+class IDCTTable {
+public:
+	/** table[x][u] = C(u) / 2 * cos((2x + 1) u pi / 16) */
+	float table[8][8];
+
+public:
+	IDCTTable() {
+		for (int x = 0; x < 8; x++) {
+			for (int u = 0; u < 8; u++) {
+				float cu = (u == 0) ? 1.0f / sqrtf(2.0f) : 1.0f;
+				table[x][u] = cu / 2.0f * cosf((float)((2 * x + 1) * u) * (float)M_PI / 16.0f);
+			}
+		}
+	}
+};
+
+static const IDCTTable idct;
+
+static unsigned char ClampToByte(float x) {
+	if (x <= 0.0f) return 0;
+	if (x >= 255.0f) return 255;
+	return (unsigned char)(x + 0.5f);
+}
+
+JpegDecoder::JpegDecoder() {
+	width = 0;
+	height = 0;
+	componentsN = 0;
+	restartInterval = 0;
+	ycc = true;
+	scanOffset = 0;
+	memset(qt, 0, sizeof(qt));
+	memset(dcTables, 0, sizeof(dcTables));
+	memset(acTables, 0, sizeof(acTables));
+	for (int i = 0; i < 3; i++) {
+		components[i].coefs = NULL;
+		components[i].plane = NULL;
+	}
+}
+
+JpegDecoder::~JpegDecoder() {
+	for (int i = 0; i < 3; i++) {
+		delete [] components[i].coefs;
+		delete [] components[i].plane;
+	}
+}
+
+/**
+ * Return true if the specified file name has the extension of JPEG files.
+ *
+ * @param filename		the file name
+ * @return				true if the extension is .jpg or .jpeg
+ */
+bool JpegDecoder::IsJpegFilename(const char* filename) {
+	const char* ext = strrchr(filename, '.');
+	if (ext == NULL) return false;
+
+	char lower[8];
+	int i;
+	for (i = 0; i < 7 && ext[i] != '\0'; i++) {
+		lower[i] = (char)tolower(ext[i]);
+	}
+	lower[i] = '\0';
+
+	return strcmp(lower, ".jpg") == 0 || strcmp(lower, ".jpeg") == 0;
+}
+
+/**
+ * Read the specified JPEG file and parse the headers.
+ * The image size is available after this function successes.
+ *
+ * @param filename		the JPEG file name
+ * @return				true if the file is a supported JPEG image
+ */
+bool JpegDecoder::Open(const char* filename) {
+	ifstream ifs(filename, ios::binary);
+	if (ifs.fail()) {
+		cerr << "INFO: cannot open file: " << filename << endl;
+		return false;
+	}
+
+	ifs.seekg(0, ios::end);
+	int size = (int)ifs.tellg();
+	ifs.seekg(0, ios::beg);
+	data.resize(size);
+	if (size > 0) ifs.read((char*)&data[0], size);
+	ifs.close();
+
+	if (!ParseHeaders()) {
+		cerr << "INFO: unsupported JPEG file: " << filename << endl;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Parse the markers up to the start of the scan.
+ *
+ * @return		true if the image is a supported baseline JPEG
+ */
+bool JpegDecoder::ParseHeaders() {
+	int size = (int)data.size();
+	if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+
+	bool frame = false;
+	int pos = 2;
+	while (pos + 4 <= size) {
+		if (data[pos] != 0xFF) return false;
+		int marker = data[pos + 1];
+		if (marker == 0xFF) {
+			// fill byte
+			pos++;
+			continue;
+		}
+
+		int length = Read16(&data[pos + 2]);
+		const unsigned char* p = &data[pos + 4];
+		int end = pos + 2 + length;
+		if (end > size) return false;
+
+		switch (marker) {
+		case 0xC0:
+		case 0xC1:
+			// baseline / extended sequential frame
+			if (p[0] != 8) return false;
+			height = Read16(&p[1]);
+			width = Read16(&p[3]);
+			componentsN = p[5];
+			if (componentsN != 1 && componentsN != 3) return false;
+			if (width <= 0 || height <= 0) return false;
+
+			hmax = vmax = 1;
+			for (int i = 0; i < componentsN; i++) {
+				components[i].id = p[6 + i * 3];
+				components[i].h = p[7 + i * 3] >> 4;
+				components[i].v = p[7 + i * 3] & 15;
+				components[i].tq = p[8 + i * 3] & 3;
+				if (components[i].h < 1 || components[i].h > 4 || components[i].v < 1 || components[i].v > 4) return false;
+				if (components[i].h > hmax) hmax = components[i].h;
+				if (components[i].v > vmax) vmax = components[i].v;
+			}
+			if (componentsN == 1) {
+				// a single component is never interleaved, so one block is one MCU
+				components[0].h = components[0].v = hmax = vmax = 1;
+			}
+			frame = true;
+			break;
+		case 0xC2:
+		case 0xC3:
+		case 0xC5:
+		case 0xC6:
+		case 0xC7:
+		case 0xC9:
+		case 0xCA:
+		case 0xCB:
+		case 0xCD:
+		case 0xCE:
+		case 0xCF:
+			// progressive, lossless, hierarchical, and arithmetic-coded frames are not supported
+			return false;
+		case 0xC4:
+			// Huffman tables
+			while (p < &data[0] + end) {
+				int tc = p[0] >> 4;
+				int th = p[0] & 3;
+				HuffmanTable &table = (tc == 0) ? dcTables[th] : acTables[th];
+				int count = 0;
+				table.bits[0] = 0;
+				for (int i = 1; i <= 16; i++) {
+					table.bits[i] = p[i];
+					count += p[i];
+				}
+				if (count > 256) return false;
+				memcpy(table.values, &p[17], count);
+				BuildHuffmanTable(table);
+				p += 17 + count;
+			}
+			break;
+		case 0xDB:
+			// quantization tables
+			while (p < &data[0] + end) {
+				int pq = p[0] >> 4;
+				int tq = p[0] & 3;
+				for (int i = 0; i < 64; i++) {
+					qt[tq][zigzag[i]] = (pq == 0) ? p[1 + i] : Read16(&p[1 + i * 2]);
+				}
+				p += 1 + ((pq == 0) ? 64 : 128);
+			}
+			break;
+		case 0xDD:
+			restartInterval = Read16(p);
+			break;
+		case 0xEE:
+			// Adobe marker: the transform flag 0 means that the three components are RGB
+			if (length >= 14 && memcmp(p, "Adobe", 5) == 0) {
+				ycc = p[11] != 0;
+			}
+			break;
+		case 0xDA:
+			{
+				// start of scan
+				if (!frame) return false;
+				int ns = p[0];
+				if (ns != componentsN) return false;
+				for (int i = 0; i < ns; i++) {
+					int id = p[1 + i * 2];
+					int c;
+					for (c = 0; c < componentsN; c++) {
+						if (components[c].id == id) break;
+					}
+					if (c == componentsN) return false;
+					components[c].td = p[2 + i * 2] >> 4;
+					components[c].ta = p[2 + i * 2] & 3;
+				}
+
+				mcusX = (width + hmax * 8 - 1) / (hmax * 8);
+				mcusY = (height + vmax * 8 - 1) / (vmax * 8);
+				for (int c = 0; c < componentsN; c++) {
+					components[c].blocksW = mcusX * components[c].h;
+					components[c].blocksH = mcusY * components[c].v;
+				}
+
+				scanOffset = end;
+				return true;
+			}
+		default:
+			// APPn, COM, and the other markers are skipped
+			break;
+		}
+
+		pos = end;
+	}
+
+	return false;
+}
+
+/**
+ * Build the decoding tables of the canonical Huffman codes.
+ *
+ * @param table		the Huffman table whose bits and values are filled
+ */
+void JpegDecoder::BuildHuffmanTable(HuffmanTable &table) {
+	int code = 0;
+	int k = 0;
+	memset(table.lookupLen, 0, sizeof(table.lookupLen));
+
+	for (int len = 1; len <= 16; len++) {
+		table.valptr[len] = k;
+		table.mincode[len] = code;
+		for (int i = 0; i < table.bits[len]; i++) {
+			// codes up to 9 bits are resolved by the lookup table
+			if (len <= 9) {
+				int first = code << (9 - len);
+				for (int j = 0; j < (1 << (9 - len)); j++) {
+					table.lookupLen[first + j] = (unsigned char)len;
+					table.lookupValue[first + j] = table.values[k];
+				}
+			}
+			code++;
+			k++;
+		}
+		table.maxcode[len] = (table.bits[len] > 0) ? code - 1 : -1;
+		code <<= 1;
+	}
+	table.maxcode[17] = 0x7FFFFFFF;
+}
+
+/**
+ * Decode one Huffman-coded symbol.
+ */
+static int DecodeHuffman(BitReader &br, const unsigned char* lookupLen, const unsigned char* lookupValue, const int* maxcode, const int* valptr, const int* mincode, const unsigned char* values) {
+	br.Fill();
+
+	int look = br.buf >> (32 - 9);
+	int len = lookupLen[look];
+	if (len > 0) {
+		br.Consume(len);
+		return lookupValue[look];
+	}
+
+	for (len = 10; len <= 16; len++) {
+		int code = br.buf >> (32 - len);
+		if (code <= maxcode[len]) {
+			br.Consume(len);
+			return values[valptr[len] + code - mincode[len]];
+		}
+	}
+
+	// corrupted data
+	br.Consume(16);
+	return 0;
+}
+
+/**
+ * Decode the MCUs in one entropy-coded segment (the data between two restart markers).
+ * The DC predictors are reset at the beginning of each segment, so the segments are independent.
+ *
+ * @param segment		the entropy-coded data without the byte stuffing
+ * @param length		the length of the data
+ * @param mcuStart		the index of the first MCU in the segment
+ * @param mcuEnd		the index next to the last MCU in the segment
+ * @return				true if the segment is decoded
+ */
+bool JpegDecoder::DecodeSegment(const unsigned char* segment, int length, int mcuStart, int mcuEnd) {
+	BitReader br(segment, length);
+	int pred[3] = {0, 0, 0};
+
+	for (int mcu = mcuStart; mcu < mcuEnd; mcu++) {
+		int mx = mcu % mcusX;
+		int my = mcu / mcusX;
+
+		for (int c = 0; c < componentsN; c++) {
+			Component &comp = components[c];
+			const HuffmanTable &dc = dcTables[comp.td];
+			const HuffmanTable &ac = acTables[comp.ta];
+
+			for (int by = 0; by < comp.v; by++) {
+				for (int bx = 0; bx < comp.h; bx++) {
+					int blockX = mx * comp.h + bx;
+					int blockY = my * comp.v + by;
+					short* block = &comp.coefs[(blockY * comp.blocksW + blockX) * 64];
+
+					// DC coefficient
+					int t = DecodeHuffman(br, dc.lookupLen, dc.lookupValue, dc.maxcode, dc.valptr, dc.mincode, dc.values);
+					int diff = (t > 0) ? Extend(br.GetBits(t), t) : 0;
+					pred[c] += diff;
+					block[0] = (short)pred[c];
+
+					// AC coefficients
+					for (int k = 1; k < 64; ) {
+						int rs = DecodeHuffman(br, ac.lookupLen, ac.lookupValue, ac.maxcode, ac.valptr, ac.mincode, ac.values);
+						int r = rs >> 4;
+						int s = rs & 15;
+						if (s == 0) {
+							if (r != 15) break;
+							k += 16;
+							continue;
+						}
+						k += r;
+						if (k > 63) return false;
+						block[zigzag[k]] = (short)Extend(br.GetBits(s), s);
+						k++;
+					}
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Dequantize the block and apply the inverse DCT.
+ *
+ * @param coefs		the quantized coefficients in the natural order
+ * @param q			the quantization table in the natural order
+ * @param out		the top left sample of the block in the plane
+ * @param stride	the width of the plane
+ */
+void JpegDecoder::InverseDCT(const short* coefs, const unsigned short* q, unsigned char* out, int stride) {
+	// rows (u -> x) then columns (v -> y)
+	float temp[64];
+	for (int v = 0; v < 8; v++) {
+		float row[8];
+		bool zero = true;
+		for (int u = 0; u < 8; u++) {
+			row[u] = (float)(coefs[v * 8 + u] * q[v * 8 + u]);
+			if (row[u] != 0.0f) zero = false;
+		}
+		for (int x = 0; x < 8; x++) {
+			float sum = 0.0f;
+			if (!zero) {
+				for (int u = 0; u < 8; u++) {
+					sum += idct.table[x][u] * row[u];
+				}
+			}
+			temp[v * 8 + x] = sum;
+		}
+	}
+
+	for (int x = 0; x < 8; x++) {
+		for (int y = 0; y < 8; y++) {
+			float sum = 0.0f;
+			for (int v = 0; v < 8; v++) {
+				sum += idct.table[y][v] * temp[v * 8 + x];
+			}
+			out[y * stride + x] = ClampToByte(sum + 128.0f);
+		}
+	}
+}
+
+/**
+ * Decode the image.
+ * The image is stored from the bottom row to the top row in the same byte order as TIFFReadRGBAImage,
+ * so that it can be used as a texture in the same way as the tiff images.
+ *
+ * @param image		the buffer of width * height pixels
+ * @return			true if the image is decoded
+ */
+bool JpegDecoder::Decode(unsigned int* image) {
+	if (scanOffset == 0) return false;
+
+	int size = (int)data.size();
+
+	// remove the byte stuffing, and split the data at the restart markers
+	vector<unsigned char> stream;
+	vector<int> segments;
+	stream.reserve(size - scanOffset);
+	segments.push_back(0);
+	for (int pos = scanOffset; pos < size; pos++) {
+		if (data[pos] != 0xFF) {
+			stream.push_back(data[pos]);
+			continue;
+		}
+		if (pos + 1 >= size) break;
+
+		int next = data[pos + 1];
+		if (next == 0x00) {
+			stream.push_back(0xFF);
+			pos++;
+		} else if (next >= 0xD0 && next <= 0xD7) {
+			segments.push_back((int)stream.size());
+			pos++;
+		} else if (next != 0xFF) {
+			// EOI or another marker ends the scan
+			break;
+		}
+	}
+	segments.push_back((int)stream.size());
+	if (stream.empty()) stream.push_back(0);
+
+	for (int c = 0; c < componentsN; c++) {
+		int n = components[c].blocksW * components[c].blocksH;
+		components[c].coefs = new short[n * 64];
+		memset(components[c].coefs, 0, sizeof(short) * n * 64);
+		components[c].plane = new unsigned char[n * 64];
+	}
+
+	// decode the entropy-coded segments in parallel
+	int mcusN = mcusX * mcusY;
+	int interval = (restartInterval > 0) ? restartInterval : mcusN;
+	int segmentsN = (int)segments.size() - 1;
+	if (segmentsN > (mcusN + interval - 1) / interval) segmentsN = (mcusN + interval - 1) / interval;
+	bool ok = true;
+
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < segmentsN; i++) {
+		int mcuEnd = (i + 1) * interval;
+		if (mcuEnd > mcusN) mcuEnd = mcusN;
+		if (!DecodeSegment(&stream[0] + segments[i], segments[i + 1] - segments[i], i * interval, mcuEnd)) {
+			ok = false;
+		}
+	}
+
+	if (!ok) {
+		cerr << "INFO: corrupted JPEG data" << endl;
+	}
+
+	// inverse DCT of all the blocks in parallel over the block rows
+	for (int c = 0; c < componentsN; c++) {
+		Component &comp = components[c];
+		int stride = comp.blocksW * 8;
+
+#pragma omp parallel for
+		for (int by = 0; by < comp.blocksH; by++) {
+			for (int bx = 0; bx < comp.blocksW; bx++) {
+				InverseDCT(&comp.coefs[(by * comp.blocksW + bx) * 64], qt[comp.tq], &comp.plane[by * 8 * stride + bx * 8], stride);
+			}
+		}
+
+		delete [] comp.coefs;
+		comp.coefs = NULL;
+	}
+
+	// upsample and convert the colors in parallel over the rows
+#pragma omp parallel for
+	for (int y = 0; y < height; y++) {
+		unsigned int* row = &image[(height - 1 - y) * width];
+
+		for (int x = 0; x < width; x++) {
+			unsigned char samples[3];
+			for (int c = 0; c < componentsN; c++) {
+				const Component &comp = components[c];
+				int sx = x * comp.h / hmax;
+				int sy = y * comp.v / vmax;
+				samples[c] = comp.plane[sy * comp.blocksW * 8 + sx];
+			}
+
+			int r, g, b;
+			if (componentsN == 1) {
+				r = g = b = samples[0];
+			} else if (!ycc) {
+				r = samples[0];
+				g = samples[1];
+				b = samples[2];
+			} else {
+				float yy = (float)samples[0];
+				float cb = (float)samples[1] - 128.0f;
+				float cr = (float)samples[2] - 128.0f;
+				r = ClampToByte(yy + 1.402f * cr);
+				g = ClampToByte(yy - 0.344136f * cb - 0.714136f * cr);
+				b = ClampToByte(yy + 1.772f * cb);
+			}
+
+			row[x] = 0xFF000000 | r | (g << 8) | (b << 16);
+		}
+	}
+
+	return ok;
+}
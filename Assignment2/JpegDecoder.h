@@ -0,0 +1,107 @@
+#pragma once
+
+#include <vector>
+
+/**
+ * Self-contained decoder of baseline JPEG images.
+ * It supports 8-bit Huffman-coded sequential JPEG with one interleaved scan
+ * (grayscale or YCbCr with any sampling factors), which covers the images saved by common tools.
+ * The entropy-coded segments between restart markers are decoded in parallel,
+ * and the inverse DCT and the color conversion are parallelized across block rows and pixel rows.
+ */
+class JpegDecoder {
+private:
+	typedef struct {
+		/** the number of codes of each length (1 - 16) */
+		unsigned char bits[17];
+
+		/** the symbols in the order of the codes */
+		unsigned char values[256];
+
+		/** the largest code of each length (-1 if there is no code) */
+		int maxcode[18];
+
+		/** the index in values of the first code of each length */
+		int valptr[17];
+
+		/** the first code of each length */
+		int mincode[17];
+
+		/** the code length and the symbol for the next 9 bits (the length is 0 for longer codes) */
+		unsigned char lookupLen[512];
+		unsigned char lookupValue[512];
+	} HuffmanTable;
+
+	typedef struct {
+		int id;
+
+		/** the horizontal and vertical sampling factors */
+		int h;
+		int v;
+
+		/** the quantization table and the DC/AC Huffman tables */
+		int tq;
+		int td;
+		int ta;
+
+		/** the number of blocks including the padding of the last MCU */
+		int blocksW;
+		int blocksH;
+
+		/** the quantized coefficients of all the blocks in the natural order */
+		short* coefs;
+
+		/** the decoded samples (blocksW * 8 by blocksH * 8) */
+		unsigned char* plane;
+	} Component;
+
+	/** the whole content of the file */
+	std::vector<unsigned char> data;
+
+	/** the quantization tables in the natural order */
+	unsigned short qt[4][64];
+
+	HuffmanTable dcTables[4];
+	HuffmanTable acTables[4];
+
+	Component components[3];
+	int componentsN;
+
+	int hmax;
+	int vmax;
+	int mcusX;
+	int mcusY;
+
+	/** the number of MCUs between the restart markers (0 if there is no restart marker) */
+	int restartInterval;
+
+	/** false if the Adobe marker says that the three components are RGB rather than YCbCr */
+	bool ycc;
+
+	/** the offset of the entropy-coded data of the scan */
+	int scanOffset;
+
+public:
+	/** the image width */
+	int width;
+
+	/** the image height */
+	int height;
+
+public:
+	JpegDecoder();
+	~JpegDecoder();
+
+	bool Open(const char* filename);
+	bool Decode(unsigned int* image);
+
+private:
+	bool ParseHeaders();
+	void BuildHuffmanTable(HuffmanTable &table);
+	bool DecodeSegment(const unsigned char* segment, int length, int mcuStart, int mcuEnd);
+	void InverseDCT(const short* coefs, const unsigned short* q, unsigned char* out, int stride);
+
+public:
+	static bool IsJpegFilename(const char* filename);
+};
+
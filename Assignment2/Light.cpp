@@ -1,12 +1,55 @@
 #include "Light.h"
 #include "PPC.h"
+#include "M34.h"
 
-Light::Light(const V3 &position, int type, float ambient, float diffuse, float specular) {
+Light::Light(const V3 &position, int type, float ambient, float diffuse, float specular, float range) {
 	this->position = position;
 	this->type = type;
 	this->ambient = ambient;
 	this->diffuse = diffuse;
 	this->specular = specular;
+	this->range = range;
+	this->castShadows = false;
+
+	BuildSpecularTable();
+}
+
+const V3& Light::GetPosition() const {
+	return position;
+}
+
+int Light::GetType() const {
+	return type;
+}
+
+float Light::GetAmbient() const {
+	return ambient;
+}
+
+float Light::GetDiffuse() const {
+	return diffuse;
+}
+
+float Light::GetSpecular() const {
+	return specular;
+}
+
+float Light::GetRange() const {
+	return range;
+}
+
+bool Light::CastsShadows() const {
+	return castShadows;
+}
+
+/**
+ * Enable or disable the shadows of this light.
+ * The shadow map is rendered by LightList::RenderShadowMaps().
+ *
+ * @param castShadows	true if this light casts shadows
+ */
+void Light::SetCastShadows(bool castShadows) {
+	this->castShadows = castShadows;
 }
 
 /**
@@ -17,24 +60,111 @@ Light::Light(const V3 &position, int type, float ambient, float diffuse, float s
  * @param orig		the ogin coordinate of the axis
  */
 void Light::RotateAbout(const V3& axis, float angle, const V3& orig) {
-	position = position.RotateAbout(axis, angle, orig);
+	position = M34::Rotation(axis, angle, orig).TransformPoint(position);
+}
+
+/**
+ * Cache the lighting terms of this light for the current frame.
+ *
+ * @param ppc		the camera
+ * @return			the prepared light
+ */
+PreparedLight Light::Prepare(PPC* ppc) const {
+	PreparedLight ret;
+
+	V3 p = (type == TYPE_DIRECTIONAL_LIGHT) ? position.UnitVector() : position;
+	ret.type = type;
+	ret.x = p.x();
+	ret.y = p.y();
+	ret.z = p.z();
+	ret.eyeX = ppc->C.x();
+	ret.eyeY = ppc->C.y();
+	ret.eyeZ = ppc->C.z();
+	ret.ambient = ambient;
+	ret.diffuse = diffuse;
+	ret.invRange2 = (type == TYPE_POINT_LIGHT && range > 0.0f) ? 1.0f / (range * range) : 0.0f;
+	ret.specularTable = specularTable;
+
+	return ret;
 }
 
 /**
  * Get the color of the specified point with specified color according to this light source.
  */
 V3 Light::GetColor(PPC* ppc, const V3 &p, const V3 &c, const V3 &n) const {
-	V3 ret;
+	PreparedLight l = Prepare(ppc);
 
-	if (type == TYPE_DIRECTIONAL_LIGHT) {
-		ret = c * (ambient + diffuse * max(position.UnitVector() * n.UnitVector() * -1, 0.0f) + powf(max((p - ppc->C).reflect(n).UnitVector() * position.UnitVector(), 0.0f), specular));
-	} else {
-		ret = c * (ambient + diffuse * max((position - p).UnitVector() * n.UnitVector(), 0.0f) + powf(max((p - ppc->C).reflect(n).UnitVector() * (p - position).UnitVector(), 0.0f), specular));
+	// unit normal
+	float nx = n.x();
+	float ny = n.y();
+	float nz = n.z();
+	float len = sqrtf(nx * nx + ny * ny + nz * nz);
+	nx /= len;
+	ny /= len;
+	nz /= len;
+
+	// unit view direction and its reflection about the normal
+	float ex = p.x() - l.eyeX;
+	float ey = p.y() - l.eyeY;
+	float ez = p.z() - l.eyeZ;
+	len = sqrtf(ex * ex + ey * ey + ez * ez);
+	ex /= len;
+	ey /= len;
+	ez /= len;
+	float en = 2.0f * (ex * nx + ey * ny + ez * nz);
+	float rx = en * nx - ex;
+	float ry = en * ny - ey;
+	float rz = en * nz - ez;
+
+	// unit direction from the light
+	float lx = l.x;
+	float ly = l.y;
+	float lz = l.z;
+	if (type == TYPE_POINT_LIGHT) {
+		lx = p.x() - l.x;
+		ly = p.y() - l.y;
+		lz = p.z() - l.z;
+		len = sqrtf(lx * lx + ly * ly + lz * lz);
+		lx /= len;
+		ly /= len;
+		lz /= len;
 	}
 
+	float d = -(lx * nx + ly * ny + lz * nz);
+	float s = rx * lx + ry * ly + rz * lz;
+	V3 ret = c * (l.ambient + l.diffuse * max(d, 0.0f) + LookupSpecular(specularTable, s));
+
 	if (ret.x() > 1.0f) ret[0] = 1.0f;
 	if (ret.y() > 1.0f) ret[1] = 1.0f;
 	if (ret.z() > 1.0f) ret[2] = 1.0f;
 
 	return ret;
+}
+
+/**
+ * Return the maximum error of LookupSpecular() against powf(cosine, specular).
+ * The error of the linear interpolation over an interval of width h is at most h^2 / 8 * max|f''|,
+ * and f''(x) = e(e - 1)x^(e - 2) is the largest at x = 1 when e >= 2.
+ * For e < 2, the first interval dominates, where both the table and powf stay within [0, h^e].
+ * 1e-6 is added for the rounding error of the float arithmetic.
+ *
+ * @return			the error bound
+ */
+float Light::GetSpecularErrorBound() const {
+	float h = 1.0f / SPECULAR_TABLE_SIZE;
+
+	if (specular >= 2.0f) {
+		return h * h / 8.0f * specular * (specular - 1.0f) + 1.0e-6f;
+	} else {
+		return powf(h, specular) + 1.0e-6f;
+	}
+}
+
+/**
+ * Sample cos^specular uniformly in [0, 1].
+ */
+void Light::BuildSpecularTable() {
+	for (int i = 0; i <= SPECULAR_TABLE_SIZE; i++) {
+		specularTable[i] = powf((float)i / SPECULAR_TABLE_SIZE, specular);
+	}
 }
\ No newline at end of file
@@ -4,9 +4,40 @@
 
 class PPC;
 
+/**
+ * The lighting terms of a light that do not change during a frame.
+ * The direction of the directional light is normalized, and the specular power is looked up from the table of the light.
+ */
+typedef struct {
+	int type;
+
+	/** the unit direction of the directional light, or the position of the point light */
+	float x;
+	float y;
+	float z;
+
+	/** the eye position of the camera */
+	float eyeX;
+	float eyeY;
+	float eyeZ;
+
+	float ambient;
+	float diffuse;
+
+	/** 1 / range^2 (0 means unlimited) */
+	float invRange2;
+
+	/** the table of cos^specular */
+	const float* specularTable;
+} PreparedLight;
+
 class Light {
 public:
 	enum { TYPE_DIRECTIONAL_LIGHT = 0, TYPE_POINT_LIGHT };
+
+	/** the number of intervals of the specular table */
+	enum { SPECULAR_TABLE_SIZE = 1024 };
+
 private:
 	/** For the directional light, this is the direction. For the point light, this is the position. */
 	V3 position;
@@ -23,10 +54,50 @@ private:
 	/** specular coefficient, typeically [40, 100] */
 	float specular;
 
+	/** the distance beyond which the point light has no effect (0 means unlimited) */
+	float range;
+
+	/** true if this light casts shadows */
+	bool castShadows;
+
+	/** cos^specular sampled at SPECULAR_TABLE_SIZE + 1 points in [0, 1] */
+	float specularTable[SPECULAR_TABLE_SIZE + 1];
+
 public:
-	Light(const V3 &position, int type, float ambient, float diffuse, float specular);
+	Light(const V3 &position, int type, float ambient, float diffuse, float specular, float range = 0.0f);
+
+	const V3& GetPosition() const;
+	int GetType() const;
+	float GetAmbient() const;
+	float GetDiffuse() const;
+	float GetSpecular() const;
+	float GetRange() const;
+	bool CastsShadows() const;
+	void SetCastShadows(bool castShadows);
 
 	void RotateAbout(const V3& axis, float angle, const V3& orig);
+	PreparedLight Prepare(PPC* ppc) const;
 	V3 GetColor(PPC* ppc, const V3 &p, const V3 &c, const V3 &n) const;
+	float GetSpecularErrorBound() const;
+
+	/**
+	 * Return cos^specular by linearly interpolating the specular table.
+	 * The error is at most GetSpecularErrorBound().
+	 *
+	 * @param table		the specular table of the light
+	 * @param cosine	the cosine between the reflected view direction and the light direction
+	 * @return			the specular term
+	 */
+	static inline float LookupSpecular(const float* table, float cosine) {
+		if (cosine <= 0.0f) return 0.0f;
+		if (cosine >= 1.0f) return table[SPECULAR_TABLE_SIZE];
+
+		float x = cosine * SPECULAR_TABLE_SIZE;
+		int i = (int)x;
+		return table[i] + (table[i + 1] - table[i]) * (x - i);
+	}
+
+private:
+	void BuildSpecularTable();
 };
 
@@ -0,0 +1,320 @@
+#include "LightList.h"
+#include "PPC.h"
+#include <algorithm>
+
+using namespace std;
+
+LightList::LightList() {
+	ambient = 0.0f;
+	eyeX = 0.0f;
+	eyeY = 0.0f;
+	eyeZ = 0.0f;
+	tilesX = 0;
+	tilesY = 0;
+}
+
+LightList::~LightList() {
+	for (int i = 0; i < (int)shadowMaps.size(); i++) {
+		delete shadowMaps[i];
+	}
+}
+
+/**
+ * Add the specified light to this list.
+ * The list does not take the ownership of the light.
+ *
+ * @param light		the light
+ */
+void LightList::Add(Light* light) {
+	lights.push_back(light);
+	shadowMaps.push_back(NULL);
+}
+
+/**
+ * Replace the i-th light.
+ *
+ * @param i			the index of the light
+ * @param light		the new light
+ */
+void LightList::Set(int i, Light* light) {
+	lights[i] = light;
+}
+
+void LightList::Clear() {
+	for (int i = 0; i < (int)shadowMaps.size(); i++) {
+		delete shadowMaps[i];
+	}
+	shadowMaps.clear();
+	lights.clear();
+}
+
+int LightList::Size() const {
+	return (int)lights.size();
+}
+
+/**
+ * Take the snapshot of the lights, and assign the lights to the screen tiles.
+ * A point light with a limited range is assigned only to the tiles covered by the projection of its
+ * bounding sphere, and the other lights are assigned to all the tiles.
+ * This has to be called once per frame before the rasterization.
+ *
+ * @param ppc		the camera
+ * @param w			the image width
+ * @param h			the image height
+ */
+void LightList::Update(PPC* ppc, int w, int h) {
+	int n = (int)lights.size();
+	types.resize(n);
+	px.resize(n);
+	py.resize(n);
+	pz.resize(n);
+	ranges.resize(n);
+	invRange2s.resize(n);
+	diffuses.resize(n);
+	specularTables.resize(n);
+	allLights.resize(n);
+
+	eyeX = ppc->C.x();
+	eyeY = ppc->C.y();
+	eyeZ = ppc->C.z();
+	ambient = 0.0f;
+	for (int i = 0; i < n; i++) {
+		PreparedLight light = lights[i]->Prepare(ppc);
+		types[i] = light.type;
+		px[i] = light.x;
+		py[i] = light.y;
+		pz[i] = light.z;
+		ranges[i] = (light.invRange2 > 0.0f) ? lights[i]->GetRange() : 0.0f;
+		invRange2s[i] = light.invRange2;
+		diffuses[i] = light.diffuse;
+		specularTables[i] = light.specularTable;
+		ambient = max(ambient, light.ambient);
+		allLights[i] = i;
+	}
+
+	tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+
+	// the tile rectangle covered by each light
+	vector<int> rects(n * 4);
+	V3 vd = ppc->GetVD();
+	for (int i = 0; i < n; i++) {
+		int* rect = &rects[i * 4];
+		rect[0] = 0;
+		rect[1] = 0;
+		rect[2] = tilesX - 1;
+		rect[3] = tilesY - 1;
+		if (ranges[i] <= 0.0f) continue;
+
+		V3 center(px[i], py[i], pz[i]);
+		float r = ranges[i];
+		float depth = (center - ppc->C) * vd;
+
+		// the sphere is entirely behind the camera
+		if (depth < -r) {
+			rect[2] = -1;
+			continue;
+		}
+
+		// the sphere contains the camera, so it may cover the whole screen
+		if (depth - r <= 0.0f) continue;
+
+		// project the bounding box of the sphere
+		AABB box;
+		bool projected = true;
+		for (int k = 0; k < 8; k++) {
+			V3 corner = center + V3((k & 1) ? r : -r, (k & 2) ? r : -r, (k & 4) ? r : -r);
+			V3 pp;
+			if (!ppc->Project(corner, pp)) {
+				projected = false;
+				break;
+			}
+			box.AddPoint(pp);
+		}
+		if (!projected) continue;
+
+		rect[0] = max(0, (int)box.minCorner().x() / TILE_SIZE);
+		rect[1] = max(0, (int)box.minCorner().y() / TILE_SIZE);
+		rect[2] = min(tilesX - 1, (int)box.maxCorner().x() / TILE_SIZE);
+		rect[3] = min(tilesY - 1, (int)box.maxCorner().y() / TILE_SIZE);
+		if (box.maxCorner().x() < 0.0f || box.maxCorner().y() < 0.0f) rect[2] = -1;
+	}
+
+	// build the light index lists of the tiles
+	tileOffsets.assign(tilesX * tilesY + 1, 0);
+	for (int i = 0; i < n; i++) {
+		int* rect = &rects[i * 4];
+		for (int ty = rect[1]; ty <= rect[3]; ty++) {
+			for (int tx = rect[0]; tx <= rect[2]; tx++) {
+				tileOffsets[ty * tilesX + tx + 1]++;
+			}
+		}
+	}
+	for (int t = 0; t < tilesX * tilesY; t++) {
+		tileOffsets[t + 1] += tileOffsets[t];
+	}
+
+	tileIndices.resize(tileOffsets[tilesX * tilesY]);
+	vector<int> filled(tileOffsets.begin(), tileOffsets.end() - 1);
+	for (int i = 0; i < n; i++) {
+		int* rect = &rects[i * 4];
+		for (int ty = rect[1]; ty <= rect[3]; ty++) {
+			for (int tx = rect[0]; tx <= rect[2]; tx++) {
+				tileIndices[filled[ty * tilesX + tx]++] = i;
+			}
+		}
+	}
+}
+
+/**
+ * Render the shadow maps of the lights that cast shadows.
+ * This has to be called once per frame after the lights and the meshes are moved.
+ *
+ * @param instances		the instances that cast shadows
+ * @param instancesN	the number of instances
+ */
+void LightList::RenderShadowMaps(MeshInstance** instances, int instancesN) {
+	for (int i = 0; i < (int)lights.size(); i++) {
+		if (!lights[i]->CastsShadows()) {
+			delete shadowMaps[i];
+			shadowMaps[i] = NULL;
+			continue;
+		}
+
+		if (shadowMaps[i] == NULL) shadowMaps[i] = new ShadowMap();
+		shadowMaps[i]->Update(lights[i], instances, instancesN);
+	}
+}
+
+/**
+ * Get the color of the specified point lit by all the lights.
+ * This is used for the points that do not correspond to a pixel, e.g. the vertices for Gouraud shading.
+ *
+ * @param p			the point
+ * @param c			the color of the point
+ * @param n			the normal of the point
+ * @param ao		the ambient occlusion of the point
+ * @return			the lit color
+ */
+V3 LightList::GetColor(const V3 &p, const V3 &c, const V3 &n, float ao) const {
+	if (allLights.empty()) return c * (ambient * ao);
+
+	return Shade(p, c, n, ao, &allLights[0], (int)allLights.size());
+}
+
+/**
+ * Get the color of the specified point seen at the pixel (u, v).
+ * Only the lights assigned to the tile of the pixel are evaluated.
+ *
+ * @param u			x coordinate of the pixel
+ * @param v			y coordinate of the pixel
+ * @param p			the point
+ * @param c			the color of the point
+ * @param n			the normal of the point
+ * @param ao		the ambient occlusion of the point
+ * @return			the lit color
+ */
+V3 LightList::GetColor(int u, int v, const V3 &p, const V3 &c, const V3 &n, float ao) const {
+	int tile = (v / TILE_SIZE) * tilesX + u / TILE_SIZE;
+	int count = tileOffsets[tile + 1] - tileOffsets[tile];
+	if (count == 0) return c * (ambient * ao);
+
+	return Shade(p, c, n, ao, &tileIndices[tileOffsets[tile]], count);
+}
+
+/**
+ * Return the number of lights assigned to the tile of the pixel (u, v).
+ *
+ * @param u			x coordinate of the pixel
+ * @param v			y coordinate of the pixel
+ * @return			the number of lights
+ */
+int LightList::GetLightsN(int u, int v) const {
+	int tile = (v / TILE_SIZE) * tilesX + u / TILE_SIZE;
+	return tileOffsets[tile + 1] - tileOffsets[tile];
+}
+
+/**
+ * Evaluate the ambient, diffuse, and specular terms of the specified lights.
+ * The ambient term is added once, scaled by the ambient occlusion, and the diffuse and specular terms of a point light with a limited range
+ * are attenuated to zero at the range.
+ * The normal and the reflected view direction are normalized once for all the lights, and the specular power
+ * is looked up from the table of each light. The shadow map is looked up only if the light can contribute.
+ */
+V3 LightList::Shade(const V3 &p, const V3 &c, const V3 &n, float ao, const int* indices, int count) const {
+	float x = p.x();
+	float y = p.y();
+	float z = p.z();
+
+	// unit normal
+	float nx = n.x();
+	float ny = n.y();
+	float nz = n.z();
+	float len = sqrtf(nx * nx + ny * ny + nz * nz);
+	nx /= len;
+	ny /= len;
+	nz /= len;
+
+	// unit view direction and its reflection about the normal
+	float ex = x - eyeX;
+	float ey = y - eyeY;
+	float ez = z - eyeZ;
+	len = sqrtf(ex * ex + ey * ey + ez * ez);
+	ex /= len;
+	ey /= len;
+	ez /= len;
+	float en = 2.0f * (ex * nx + ey * ny + ez * nz);
+	float rx = en * nx - ex;
+	float ry = en * ny - ey;
+	float rz = en * nz - ez;
+
+	float intensity = ambient * ao;
+
+	for (int k = 0; k < count; k++) {
+		int i = indices[k];
+
+		// unit direction from the light
+		float lx = px[i];
+		float ly = py[i];
+		float lz = pz[i];
+		float attenuation = 1.0f;
+
+		if (types[i] == Light::TYPE_POINT_LIGHT) {
+			lx = x - lx;
+			ly = y - ly;
+			lz = z - lz;
+			float dist2 = lx * lx + ly * ly + lz * lz;
+
+			if (invRange2s[i] > 0.0f) {
+				float t = dist2 * invRange2s[i];
+				if (t >= 1.0f) continue;
+				attenuation = (1.0f - t) * (1.0f - t);
+			}
+
+			if (dist2 > 0.0f) {
+				float inv = 1.0f / sqrtf(dist2);
+				lx *= inv;
+				ly *= inv;
+				lz *= inv;
+			}
+		}
+
+		float d = -(lx * nx + ly * ny + lz * nz);
+		float s = rx * lx + ry * ly + rz * lz;
+		if (d <= 0.0f && s <= 0.0f) continue;
+
+		if (shadowMaps[i] != NULL) {
+			attenuation *= shadowMaps[i]->GetVisibility(x, y, z, nx, ny, nz);
+			if (attenuation <= 0.0f) continue;
+		}
+
+		intensity += (diffuses[i] * max(d, 0.0f) + Light::LookupSpecular(specularTables[i], s)) * attenuation;
+	}
+
+	V3 ret = c * intensity;
+	if (ret.x() > 1.0f) ret[0] = 1.0f;
+	if (ret.y() > 1.0f) ret[1] = 1.0f;
+	if (ret.z() > 1.0f) ret[2] = 1.0f;
+
+	return ret;
+}
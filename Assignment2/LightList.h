@@ -0,0 +1,75 @@
+#pragma once
+
+#include "V3.h"
+#include "Light.h"
+#include "ShadowMap.h"
+#include <vector>
+
+class PPC;
+class MeshInstance;
+
+/**
+ * List of the light sources in the scene.
+ * Every frame, Update() takes a snapshot of the lights into structure-of-arrays,
+ * and assigns the lights to the screen tiles they can reach,
+ * so that each pixel evaluates only the lights that affect it.
+ */
+class LightList {
+public:
+	enum { TILE_SIZE = 16 };
+
+private:
+	/** the lights (not owned by the list) */
+	std::vector<Light*> lights;
+
+	/** the snapshot of the lights taken by Update() */
+	std::vector<int> types;
+	std::vector<float> px;
+	std::vector<float> py;
+	std::vector<float> pz;
+	std::vector<float> ranges;
+	std::vector<float> invRange2s;
+	std::vector<float> diffuses;
+	std::vector<const float*> specularTables;
+
+	/** the shadow maps of the lights (NULL if the light does not cast shadows) */
+	std::vector<ShadowMap*> shadowMaps;
+
+	/** the eye position of the camera of the snapshot */
+	float eyeX;
+	float eyeY;
+	float eyeZ;
+
+	/** the ambient coefficient of the scene (the largest one among the lights) */
+	float ambient;
+
+	/** all the light indices, which are used for the points that are not bound to a tile */
+	std::vector<int> allLights;
+
+	/** the number of tiles */
+	int tilesX;
+	int tilesY;
+
+	/** the light indices of the tile i are tileIndices[tileOffsets[i]] - tileIndices[tileOffsets[i + 1] - 1] */
+	std::vector<int> tileOffsets;
+	std::vector<int> tileIndices;
+
+public:
+	LightList();
+	~LightList();
+
+	void Add(Light* light);
+	void Set(int i, Light* light);
+	void Clear();
+	int Size() const;
+
+	void Update(PPC* ppc, int w, int h);
+	void RenderShadowMaps(MeshInstance** instances, int instancesN);
+	V3 GetColor(const V3 &p, const V3 &c, const V3 &n, float ao = 1.0f) const;
+	V3 GetColor(int u, int v, const V3 &p, const V3 &c, const V3 &n, float ao = 1.0f) const;
+	int GetLightsN(int u, int v) const;
+
+private:
+	V3 Shade(const V3 &p, const V3 &c, const V3 &n, float ao, const int* indices, int count) const;
+};
+
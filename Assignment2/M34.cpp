@@ -0,0 +1,152 @@
+#include "M34.h"
+
+M34::M34() : t(0.0f, 0.0f, 0.0f) {
+}
+
+M34::M34(const M33& m, const V3& t) : m(m), t(t) {
+}
+
+/**
+ * Transform the point.
+ *
+ * @param p		the point
+ * @return		the transformed point
+ */
+V3 M34::TransformPoint(const V3& p) const {
+	return m * p + t;
+}
+
+/**
+ * Transform the direction, which is not affected by the translation.
+ *
+ * @param v		the direction
+ * @return		the transformed direction
+ */
+V3 M34::TransformVector(const V3& v) const {
+	return m * v;
+}
+
+/**
+ * Transform the contiguous array of points in place.
+ * The coefficients are loaded once for all the points, so this is cheaper than calling TransformPoint() for each.
+ *
+ * @param points		the points
+ * @param pointsN		the number of the points
+ */
+void M34::TransformPoints(V3* points, int pointsN) const {
+	float m00 = m.GetRow(0).x(), m01 = m.GetRow(0).y(), m02 = m.GetRow(0).z();
+	float m10 = m.GetRow(1).x(), m11 = m.GetRow(1).y(), m12 = m.GetRow(1).z();
+	float m20 = m.GetRow(2).x(), m21 = m.GetRow(2).y(), m22 = m.GetRow(2).z();
+	float tx = t.x(), ty = t.y(), tz = t.z();
+
+	for (int i = 0; i < pointsN; i++) {
+		float x = points[i][0], y = points[i][1], z = points[i][2];
+		points[i][0] = m00 * x + m01 * y + m02 * z + tx;
+		points[i][1] = m10 * x + m11 * y + m12 * z + ty;
+		points[i][2] = m20 * x + m21 * y + m22 * z + tz;
+	}
+}
+
+/**
+ * Transform the contiguous array of directions in place, which are not affected by the translation.
+ *
+ * @param vectors		the directions
+ * @param vectorsN		the number of the directions
+ */
+void M34::TransformVectors(V3* vectors, int vectorsN) const {
+	float m00 = m.GetRow(0).x(), m01 = m.GetRow(0).y(), m02 = m.GetRow(0).z();
+	float m10 = m.GetRow(1).x(), m11 = m.GetRow(1).y(), m12 = m.GetRow(1).z();
+	float m20 = m.GetRow(2).x(), m21 = m.GetRow(2).y(), m22 = m.GetRow(2).z();
+
+	for (int i = 0; i < vectorsN; i++) {
+		float x = vectors[i][0], y = vectors[i][1], z = vectors[i][2];
+		vectors[i][0] = m00 * x + m01 * y + m02 * z;
+		vectors[i][1] = m10 * x + m11 * y + m12 * z;
+		vectors[i][2] = m20 * x + m21 * y + m22 * z;
+	}
+}
+
+/**
+ * Compose the transformations, i.e. (this * m1) * p = this * (m1 * p).
+ */
+M34 M34::operator*(const M34& m1) const {
+	return M34(m * m1.m, m * m1.t + t);
+}
+
+M34 M34::Inverted() const {
+	M33 inv = m;
+	inv = inv.Inverted();
+	return M34(inv, (inv * t) * -1.0f);
+}
+
+/**
+ * Return the matrix that transforms the normals, i.e. the inverse transpose of the linear part,
+ * which keeps the normals perpendicular to the surface under a non-uniform scaling.
+ * The transformed normals have to be normalized again.
+ *
+ * @return		the normal matrix
+ */
+M33 M34::GetNormalMatrix() const {
+	M33 inv = m;
+	return inv.Inverted().Transpose();
+}
+
+const M33& M34::GetLinear() const {
+	return m;
+}
+
+const V3& M34::GetTranslation() const {
+	return t;
+}
+
+/**
+ * Return true if this transformation does not move anything, so that it can be skipped.
+ */
+bool M34::IsIdentity() const {
+	for (int i = 0; i < 3; i++) {
+		V3 row = m.GetRow(i);
+		for (int j = 0; j < 3; j++) {
+			if (row[j] != (i == j ? 1.0f : 0.0f)) return false;
+		}
+	}
+	return t.x() == 0.0f && t.y() == 0.0f && t.z() == 0.0f;
+}
+
+/**
+ * Create the translation by the specified vector.
+ *
+ * @param v		the vector
+ * @return		the transformation
+ */
+M34 M34::Translation(const V3& v) {
+	return M34(M33(), v);
+}
+
+/**
+ * Create the scaling about the specified origin.
+ *
+ * @param scale		the scaling factors along the axes
+ * @param orig		the point that stays fixed
+ * @return			the transformation
+ */
+M34 M34::Scaling(const V3& scale, const V3& orig) {
+	M33 s(V3(scale.x(), 0.0f, 0.0f), V3(0.0f, scale.y(), 0.0f), V3(0.0f, 0.0f, scale.z()));
+	return M34(s, orig - s * orig);
+}
+
+/**
+ * Create the rotation about the specified axis passing through the specified origin,
+ * which is the same as V3::RotateAbout() but is computed once for all the points.
+ *
+ * @param axis		the axis
+ * @param angle		the angle [degrees]
+ * @param orig		the point on the axis
+ * @return			the transformation
+ */
+M34 M34::Rotation(const V3& axis, float angle, const V3& orig) {
+	M33 axes = M33::GenerateAxes(axis);
+	M33 rot;
+	rot.SetRotationX(angle);
+	M33 m = axes * rot * axes.Inverted();
+	return M34(m, orig - m * orig);
+}
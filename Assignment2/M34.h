@@ -0,0 +1,32 @@
+#pragma once
+
+#include "V3.h"
+#include "M33.h"
+
+/**
+ * An affine transformation, i.e. a 3x3 linear part followed by a translation (the upper 3 rows of a 4x4 matrix).
+ * A point p is transformed to m * p + t, and a direction only by m.
+ */
+class M34 {
+private:
+	M33 m;
+	V3 t;
+
+public:
+	M34();
+	M34(const M33& m, const V3& t);
+	V3 TransformPoint(const V3& p) const;
+	V3 TransformVector(const V3& v) const;
+	void TransformPoints(V3* points, int pointsN) const;
+	void TransformVectors(V3* vectors, int vectorsN) const;
+	M34 operator*(const M34& m) const;
+	M34 Inverted() const;
+	M33 GetNormalMatrix() const;
+	const M33& GetLinear() const;
+	const V3& GetTranslation() const;
+	bool IsIdentity() const;
+
+	static M34 Translation(const V3& v);
+	static M34 Scaling(const V3& scale, const V3& orig);
+	static M34 Rotation(const V3& axis, float angle, const V3& orig);
+};
@@ -0,0 +1,161 @@
+#include "MeshInstance.h"
+#include "FrameBuffer.h"
+
+MeshInstance::MeshInstance(TMesh* mesh, int shadingMode) : mesh(mesh), color(1.0f, 1.0f, 1.0f), shadingMode(shadingMode) {
+	lod = 0;
+	version = 0;
+}
+
+/**
+ * Move this instance by the specified vector.
+ *
+ * @param v		the vector
+ */
+void MeshInstance::Translate(const V3 &v) {
+	SetTransform(M34::Translation(v) * transform);
+}
+
+/**
+ * Rotate this instance around the specified axis passing through the specified origin by the specified angle.
+ * Only the transformation is updated, and the vertices of the shared mesh stay the same.
+ *
+ * @param axis		the axis
+ * @param angle		the angle [degrees]
+ * @param orig		the point on the axis
+ */
+void MeshInstance::RotateAbout(const V3 &axis, float angle, const V3 &orig) {
+	SetTransform(M34::Rotation(axis, angle, orig) * transform);
+}
+
+void MeshInstance::SetTransform(const M34 &transform) {
+	this->transform = transform;
+	version++;
+}
+
+/**
+ * Set the material color, which the colors of the vertices are multiplied by.
+ *
+ * @param color		the color (white keeps the colors of the mesh)
+ */
+void MeshInstance::SetColor(const V3 &color) {
+	this->color = color;
+	version++;
+}
+
+void MeshInstance::SetShadingMode(int shadingMode) {
+	this->shadingMode = shadingMode;
+	version++;
+}
+
+TMesh* MeshInstance::GetMesh() const {
+	return mesh;
+}
+
+/**
+ * Return the level of detail of the mesh chosen by the last SelectLOD() call.
+ */
+TMesh* MeshInstance::GetDrawnMesh() const {
+	return mesh->GetLOD(lod);
+}
+
+const M34& MeshInstance::GetTransform() const {
+	return transform;
+}
+
+int MeshInstance::GetShadingMode() const {
+	return shadingMode;
+}
+
+/**
+ * Return the version, which changes whenever this instance or the shared mesh changes.
+ * Both of them only increase, so their sum does not repeat.
+ */
+unsigned int MeshInstance::GetVersion() const {
+	return version + mesh->GetVersion();
+}
+
+/**
+ * Compute the bounding box of the drawn mesh in the world space, and add it to the specified box.
+ *
+ * @param aabb	the box to which the bounding box of this instance is added
+ */
+void MeshInstance::ComputeAABB(AABB &aabb) {
+	TransformAABB(GetDrawnMesh(), aabb);
+}
+
+/**
+ * Return the center of the bounding box in the world space.
+ */
+V3 MeshInstance::GetCentroid() {
+	AABB aabb;
+	TransformAABB(mesh, aabb);
+	return (aabb.minCorner() + aabb.maxCorner()) / 2.0f;
+}
+
+/**
+ * Choose the level of detail of the mesh by the size of this instance on the screen.
+ *
+ * @param ppc		the camera
+ * @return			the level (0 is the mesh itself)
+ */
+int MeshInstance::SelectLOD(PPC *ppc) {
+	AABB aabb;
+	TransformAABB(mesh, aabb);
+	lod = mesh->SelectLOD(ppc, aabb);
+	return lod;
+}
+
+/**
+ * Return the transformation from the object space of the mesh to the world space, i.e. the transformation of
+ * this instance applied after the model matrix of the mesh.
+ */
+M34 MeshInstance::GetWorldTransform() const {
+	return transform * GetDrawnMesh()->GetModel();
+}
+
+/**
+ * Run the vertex stage, i.e. transform the vertices of the drawn mesh to the world space.
+ * The result is kept in the scratch buffer of the mesh, which is valid until the next instance of the same mesh
+ * is transformed.
+ *
+ * @return		the vertices in the world space
+ */
+const Vertex* MeshInstance::TransformVertices() {
+	TMesh* m = GetDrawnMesh();
+	M34 world = GetWorldTransform();
+	if (IsIdentity(world)) return m->GetVertices();
+
+	return m->TransformVertices(world, color);
+}
+
+void MeshInstance::Render(FrameBuffer *fb, PPC *ppc, int id, bool insideFrustum) {
+	TMesh* m = GetDrawnMesh();
+	M34 world = GetWorldTransform();
+	m->Render(fb, ppc, id, insideFrustum, IsIdentity(world) ? m->GetVertices() : m->TransformVertices(world, color), &world);
+}
+
+/**
+ * Render the depth of this instance, which may be called for several cameras in parallel
+ * as long as each thread passes its own scratch buffers.
+ */
+void MeshInstance::RenderDepth(PPC *ppc, float* zb, int w, int h, DepthBuffers &buffers) {
+	// the mesh applies its own model matrix if this instance does not move it
+	M34 world = GetWorldTransform();
+	GetDrawnMesh()->RenderDepth(ppc, zb, w, h, buffers, transform.IsIdentity() ? NULL : &world);
+}
+
+/**
+ * Return true if the vertices of the mesh can be used as they are.
+ *
+ * @param world		the transformation from the object space to the world space
+ */
+bool MeshInstance::IsIdentity(const M34 &world) const {
+	return world.IsIdentity() && color.x() == 1.0f && color.y() == 1.0f && color.z() == 1.0f;
+}
+
+/**
+ * Add the bounding box of the specified mesh placed by this instance.
+ */
+void MeshInstance::TransformAABB(TMesh* m, AABB &aabb) const {
+	m->ComputeAABB(aabb, transform * m->GetModel());
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "V3.h"
+#include "M34.h"
+#include "PPC.h"
+#include "TMesh.h"
+
+class FrameBuffer;
+
+/**
+ * A placement of a shared mesh in the scene.
+ * The vertex data stay in the mesh, which is not owned by the instance, so that many copies of the same mesh
+ * cost only the transformation, the material, and the shading mode. The vertices are transformed to the world
+ * space in the vertex stage of each frame, and each instance is culled and assigned a level of detail by itself.
+ */
+class MeshInstance {
+private:
+	/** the shared mesh */
+	TMesh* mesh;
+
+	/** the transformation from the space of the mesh, i.e. after its model matrix, to the world space */
+	M34 transform;
+
+	/** the material color that the colors of the vertices are multiplied by */
+	V3 color;
+
+	int shadingMode;
+
+	/** the level of detail chosen for the current frame (see SelectLOD()) */
+	int lod;
+
+	/** incremented whenever the transformation or the material changes */
+	unsigned int version;
+
+public:
+	MeshInstance(TMesh* mesh, int shadingMode);
+
+	void Translate(const V3 &v);
+	void RotateAbout(const V3 &axis, float angle, const V3 &orig);
+	void SetTransform(const M34 &transform);
+	void SetColor(const V3 &color);
+	void SetShadingMode(int shadingMode);
+
+	TMesh* GetMesh() const;
+	TMesh* GetDrawnMesh() const;
+	const M34& GetTransform() const;
+	M34 GetWorldTransform() const;
+	int GetShadingMode() const;
+	unsigned int GetVersion() const;
+
+	void ComputeAABB(AABB &aabb);
+	V3 GetCentroid();
+	int SelectLOD(PPC *ppc);
+	const Vertex* TransformVertices();
+	void Render(FrameBuffer *fb, PPC *ppc, int id, bool insideFrustum);
+	void RenderDepth(PPC *ppc, float* zb, int w, int h, DepthBuffers &buffers);
+
+private:
+	bool IsIdentity(const M34 &world) const;
+	void TransformAABB(TMesh* m, AABB &aabb) const;
+};
@@ -1,5 +1,6 @@
 #include "PPC.h"
 #include "M33.h"
+#include "M34.h"
 #include "FrameBuffer.h"
 #include <fstream>
 
@@ -221,14 +222,73 @@ void PPC::Set(const V3& C, const V3& a, const V3& vd) {
  * @param orig		the origin
  */
 void PPC::RotateAbout(const V3& axis, float angle, const V3& orig) {
-	a = a.RotateAbout(axis, angle);
-	b = b.RotateAbout(axis, angle);
-	c = c.RotateAbout(axis, angle);
-	C = C.RotateAbout(axis, angle, orig);
+	// the rotation is built once for the three directions and the center of projection
+	M34 rot = M34::Rotation(axis, angle, orig);
+	V3 dirs[3] = { a, b, c };
+	rot.TransformVectors(dirs, 3);
+	a = dirs[0];
+	b = dirs[1];
+	c = dirs[2];
+	C = rot.TransformPoint(C);
 
 	SetPMat();
 }
 
+/**
+ * Get the planes of the view frustum.
+ * The side planes pass through the eye and the edges of the image, and are oriented toward the center of the image.
+ *
+ * @return		the frustum
+ */
+Frustum PPC::GetFrustum() const {
+	Frustum frustum;
+
+	V3 corners[4] = { c, c + a * (float)w, c + a * (float)w + b * (float)h, c + b * (float)h };
+	V3 center = c + a * ((float)w / 2.0f) + b * ((float)h / 2.0f);
+
+	for (int i = 0; i < 4; i++) {
+		V3 n = (corners[i] ^ corners[(i + 1) % 4]).UnitVector();
+		if (n * center < 0.0f) n = n * -1.0f;
+		frustum.normals[i] = n;
+		frustum.ds[i] = -(n * C);
+	}
+
+	frustum.normals[4] = GetVD();
+	if (frustum.normals[4] * center < 0.0f) frustum.normals[4] = frustum.normals[4] * -1.0f;
+	frustum.ds[4] = -(frustum.normals[4] * C);
+
+	return frustum;
+}
+
+/**
+ * Classify the axis aligned bounding box against the view frustum.
+ * For each plane, only the corners farthest along and against the normal are tested.
+ * The box that straddles the corner of the frustum may be classified as intersecting even if it is outside.
+ *
+ * @param frustum	the frustum
+ * @param aabb		the box
+ * @return			FRUSTUM_OUTSIDE, FRUSTUM_INTERSECTING, or FRUSTUM_INSIDE
+ */
+int PPC::Classify(const Frustum &frustum, const AABB &aabb) {
+	const V3 &p0 = aabb.minCorner();
+	const V3 &p1 = aabb.maxCorner();
+	if (p0.x() > p1.x()) return FRUSTUM_OUTSIDE;
+
+	int ret = FRUSTUM_INSIDE;
+	for (int i = 0; i < 5; i++) {
+		const V3 &n = frustum.normals[i];
+
+		// the corner farthest along the normal, and the one farthest against it
+		V3 pos(n.x() >= 0.0f ? p1.x() : p0.x(), n.y() >= 0.0f ? p1.y() : p0.y(), n.z() >= 0.0f ? p1.z() : p0.z());
+		V3 neg(n.x() >= 0.0f ? p0.x() : p1.x(), n.y() >= 0.0f ? p0.y() : p1.y(), n.z() >= 0.0f ? p0.z() : p1.z());
+
+		if (n * pos + frustum.ds[i] < 0.0f) return FRUSTUM_OUTSIDE;
+		if (n * neg + frustum.ds[i] < 0.0f) ret = FRUSTUM_INTERSECTING;
+	}
+
+	return ret;
+}
+
 /**
  * Draw a frustum of this camera.
  *
@@ -8,7 +8,20 @@ using namespace std;
 
 class FrameBuffer;
 
+/**
+ * The planes bounding the view frustum of a camera.
+ * A point p is inside the plane i if normals[i] * p + ds[i] >= 0.
+ * The planes are the four sides of the image and the plane of the eye, behind which nothing is projected.
+ */
+typedef struct {
+	V3 normals[5];
+	float ds[5];
+} Frustum;
+
 class PPC {
+public:
+	enum { FRUSTUM_OUTSIDE = 0, FRUSTUM_INTERSECTING, FRUSTUM_INSIDE };
+
 public:
 	/** The pixel width vector */
 	V3 a;
@@ -54,5 +67,7 @@ public:
 	void LookAt(const V3 &p, const V3 &vd, const V3 &up, float d);
 	void Set(const V3& C, const V3& a, const V3& vd);
 	void RotateAbout(const V3& axis, float angle, const V3& orig);
+	Frustum GetFrustum() const;
+	static int Classify(const Frustum &frustum, const AABB &aabb);
 	void DrawPPCFrustum(PPC* ppc, FrameBuffer* fp, float scale) const;
 };
\ No newline at end of file
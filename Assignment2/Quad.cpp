@@ -19,6 +19,7 @@ void Quad::init(float w, float h, const V3 &c, float s0, float t0, float s1, flo
 	verts[0].v[2] = 0.0f;
 	verts[0].n = V3(0.0f, 0.0f, 1.0f);
 	verts[0].c = c;
+	verts[0].ao = 1.0f;
 	verts[0].t[0] = s0;
 	verts[0].t[1] = t0;
 
@@ -27,6 +28,7 @@ void Quad::init(float w, float h, const V3 &c, float s0, float t0, float s1, flo
 	verts[1].v[2] = 0.0f;
 	verts[1].n = V3(0.0f, 0.0f, 1.0f);
 	verts[1].c = c;
+	verts[1].ao = 1.0f;
 	verts[1].t[0] = s1;
 	verts[1].t[1] = t0;
 
@@ -35,6 +37,7 @@ void Quad::init(float w, float h, const V3 &c, float s0, float t0, float s1, flo
 	verts[2].v[2] = 0.0f;
 	verts[2].n = V3(0.0f, 0.0f, 1.0f);
 	verts[2].c = c;
+	verts[2].ao = 1.0f;
 	verts[2].t[0] = s1;
 	verts[2].t[1] = t1;
 
@@ -43,6 +46,7 @@ void Quad::init(float w, float h, const V3 &c, float s0, float t0, float s1, flo
 	verts[3].v[2] = 0.0f;
 	verts[3].n = V3(0.0f, 0.0f, 1.0f);
 	verts[3].c = c;
+	verts[3].ao = 1.0f;
 	verts[3].t[0] = s0;
 	verts[3].t[1] = t1;
 	
@@ -52,4 +56,6 @@ void Quad::init(float w, float h, const V3 &c, float s0, float t0, float s1, flo
 	tris[3] = 0;
 	tris[4] = 2;
 	tris[5] = 3;
+
+	PackIndices();
 }
\ No newline at end of file
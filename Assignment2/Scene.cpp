@@ -16,9 +16,15 @@ Scene *scene;
 
 int Scene::rasterization_mode = SCREEN_SPACE_RASTERIZATION;
 int Scene::shading_mode = NO_SHADING;
+bool Scene::z_prepass = false;
+int Scene::shading_rate = 1;
+bool Scene::flat_shading = false;
 Light* Scene::light = new Light(V3(0.0f, 0.0f, -1.0f), Light::TYPE_DIRECTIONAL_LIGHT, 0.4f, 0.6f, 40.0f);
+LightList* Scene::lights = NULL;
 
 Scene::Scene() {
+	visibilityValid = false;
+
 	// create user interface
 	gui = new GUI();
 	gui->show();
@@ -36,36 +42,49 @@ Scene::Scene() {
 	// position UI window
 	gui->uiw->position(fb->w+u0 + 2*20, v0);
 
-	tmsN = 9;
+	// meshes and textures are decoded in the background, and the scene is rendered as soon as
+	// they arrive (textured meshes show a placeholder until then)
+	loader = new AssetLoader();
+
+	// the teapot is loaded once and placed three times
+	// (it is not exactly closed, but its back faces are never seen through the gaps, so they are culled)
+	tmsN = 7;
 	tms = new TMesh*[tmsN];
 	tms[0] = new TMesh();
-	tms[0]->Load("geometry/teapot1K.bin");
-	tms[0]->Translate(V3(-50.0f, 0.0f, 0.0f) - tms[0]->GetCentroid());
-	tms[1] = new TMesh();
-	tms[1]->Load("geometry/teapot1K.bin");
-	tms[1]->Translate(V3(50.0f, 0.0f, 0.0f) - tms[1]->GetCentroid());
-	tms[2] = new TMesh();
-	tms[2]->Load("geometry/teapot1K.bin");
-	tms[2]->Translate(V3(200.0f, 0.0f, 0.0f) - tms[2]->GetCentroid());
-
+	loader->LoadMesh(tms[0], "geometry/teapot1K.bin", V3(0.0f, 0.0f, 0.0f), true, true);
+
+	// the photos are clamped so that the filter does not bleed the opposite edge into the border, and the tiles repeat
+	tms[1] = new Quad(60, 60, V3(0.0f, 0.0f, 0.0f));
+	loader->LoadTexture(tms[1], "texture/mycamera.jpg", false, Texture::WRAP_CLAMP);
+	tms[1]->Translate(V3(300.0f, 0.0f, 0.0f) - tms[1]->GetCentroid());
+	tms[2] = new Quad(60, 60, V3(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, 3.0f, 4.14f);
+	loader->LoadTexture(tms[2], "texture/tile.jpg");
+	tms[2]->Translate(V3(370.0f, 0.0f, 0.0f) - tms[2]->GetCentroid());
 	tms[3] = new Quad(60, 60, V3(0.0f, 0.0f, 0.0f));
-	tms[3]->SetTexture("texture/mycamera.tif");
-	tms[3]->Translate(V3(300.0f, 0.0f, 0.0f) - tms[3]->GetCentroid());
-	tms[4] = new Quad(60, 60, V3(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, 3.0f, 4.14f);
-	tms[4]->SetTexture("texture/tile.tif");
-	tms[4]->Translate(V3(370.0f, 0.0f, 0.0f) - tms[4]->GetCentroid());
+	loader->LoadTexture(tms[3], "texture/web.jpg", false, Texture::WRAP_CLAMP);
+	tms[3]->Translate(V3(440.0f, 0.0f, 0.0f) - tms[3]->GetCentroid());
+	tms[4] = new Quad(60, 60, V3(0.0f, 0.0f, 0.0f));
+	loader->LoadTexture(tms[4], "texture/complex_lighting.jpg", false, Texture::WRAP_CLAMP);
+	tms[4]->Translate(V3(510.0f, 0.0f, 0.0f) - tms[4]->GetCentroid());
 	tms[5] = new Quad(60, 60, V3(0.0f, 0.0f, 0.0f));
-	tms[5]->SetTexture("texture/web.tif");
-	tms[5]->Translate(V3(440.0f, 0.0f, 0.0f) - tms[5]->GetCentroid());
-	tms[6] = new Quad(60, 60, V3(0.0f, 0.0f, 0.0f));
-	tms[6]->SetTexture("texture/complex_lighting.tif");
-	tms[6]->Translate(V3(510.0f, 0.0f, 0.0f) - tms[6]->GetCentroid());
-	tms[7] = new Quad(60, 60, V3(0.0f, 0.0f, 0.0f));
-	tms[7]->SetTexture("texture/reflection.tif");
-	tms[7]->Translate(V3(580.0f, 0.0f, 0.0f) - tms[7]->GetCentroid());
-	tms[8] = new Sphere(120, V3(0, 0, 1.0f), 20, 40);
-	tms[8]->Translate(V3(520.0f, 0.0f, -200.0f));
-	tms[8]->SetTexture("texture/earth.tif");
+	loader->LoadTexture(tms[5], "texture/reflection.jpeg", false, Texture::WRAP_CLAMP);
+	tms[5]->Translate(V3(580.0f, 0.0f, 0.0f) - tms[5]->GetCentroid());
+	tms[6] = new Sphere(120, V3(0, 0, 1.0f), 20, 40);
+	tms[6]->Translate(V3(520.0f, 0.0f, -200.0f));
+	loader->LoadTexture(tms[6], "texture/earth.jpg", true);
+
+	// the first teapot is Gouraud shaded, and the others are Phong shaded
+	instancesN = 9;
+	instances = new MeshInstance*[instancesN];
+	instances[0] = new MeshInstance(tms[0], GOURAUD_SHADING);
+	instances[0]->Translate(V3(-50.0f, 0.0f, 0.0f));
+	instances[1] = new MeshInstance(tms[0], PHONG_SHADING);
+	instances[1]->Translate(V3(50.0f, 0.0f, 0.0f));
+	instances[2] = new MeshInstance(tms[0], PHONG_SHADING);
+	instances[2]->Translate(V3(200.0f, 0.0f, 0.0f));
+	for (int i = 3; i < instancesN; i++) {
+		instances[i] = new MeshInstance(tms[i - 2], PHONG_SHADING);
+	}
 
 
 	// create three cameras
@@ -75,29 +94,52 @@ Scene::Scene() {
 	ppc[0] = new PPC(hfov, fb->w, fb->h);
 	ppc[0]->LookAt(V3(0.0f, 0.0f, 0.0f), V3(0.0f, 0.0f, -1.0f), V3(0.0f, 1.0f, 0.0f), 200.0f);
 	ppc[1] = new PPC(hfov, fb->w, fb->h);
-	ppc[1]->LookAt(tms[2]->GetCentroid(), V3(0.0f, 0.0f, -1.0f), V3(0.0f, 1.0f, 0.0f), 200.0f);
+	ppc[1]->LookAt(V3(200.0f, 0.0f, 0.0f), V3(0.0f, 0.0f, -1.0f), V3(0.0f, 1.0f, 0.0f), 200.0f);
 	ppc[2] = new PPC(hfov, fb->w, fb->h);
-	ppc[2]->LookAt(tms[6]->GetCentroid(), V3(0.0f, 0.0f, -1.0f), V3(0.0f, 1.0f, 0.0f), 200.0f);
+	ppc[2]->LookAt(instances[6]->GetCentroid(), V3(0.0f, 0.0f, -1.0f), V3(0.0f, 1.0f, 0.0f), 200.0f);
 	currentPPC = ppc[0];
+
+	light->SetCastShadows(true);
+	lights = new LightList();
+	lights->Add(light);
 	
 	rasterization_mode = MODEL_SPACE_RASTERIZATION;
 	//shading_mode = GOURAUD_SHADING;
 	shading_mode = PHONG_SHADING;
+	z_prepass = true;
 
 	Render();
+	Fl::add_timeout(0.05, AssetPoll_cb);
 
 	//SaveTIFFs();
 }
 
+/**
+ * Timer callback that re-renders the scene whenever background-loaded assets arrive.
+ * The timer stops once all the assets are published.
+ */
+void Scene::AssetPoll_cb(void* data) {
+	if (scene == NULL) return;
+
+	if (scene->loader->Update()) {
+		scene->Render();
+	}
+
+	if (!scene->loader->IsIdle()) {
+		Fl::repeat_timeout(0.05, AssetPoll_cb);
+	}
+}
+
 // function linked to the DBG GUI button for testing new features
 void Scene::DBG() {
-
+	fb->PrintStats();
 }
 
 /**
  * This function is called when "Demo" button is clicked.
  */
 void Scene::Demo() {
+	loader->WaitAll();
 	currentPPC = ppc[0];
 
 	for (int i = 0; i < 150; i++) {
@@ -108,7 +150,7 @@ void Scene::Demo() {
 
 	for (int i = 0; i < 150; i++) {
 		PPC p = ppc[0]->Interpolate(*ppc[1], (float)i / 150.0f);
-		tms[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, tms[8]->GetCentroid());
+		instances[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, instances[8]->GetCentroid());
 
 		currentPPC = &p;
 		Render();
@@ -117,11 +159,13 @@ void Scene::Demo() {
 
 	delete light;
 	light = new Light(V3(240.0f, 0.0f, 0.0f), Light::TYPE_POINT_LIGHT, 0.4f, 0.6f, 40.0f);
+	light->SetCastShadows(true);
+	lights->Set(0, light);
 
 	currentPPC = ppc[1];
 	for (int i = 0; i < 150; i++) {
-		light->RotateAbout(V3(0.0f, 1.0f, 0.0f), -0.6f, tms[2]->GetCentroid());
-		tms[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, tms[8]->GetCentroid());
+		light->RotateAbout(V3(0.0f, 1.0f, 0.0f), -0.6f, instances[2]->GetCentroid());
+		instances[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, instances[8]->GetCentroid());
 
 		Render();
 		Fl::wait();
@@ -131,12 +175,12 @@ void Scene::Demo() {
 		PPC p = ppc[1]->Interpolate(*ppc[2], (float)i / 150.0f);
 		for (int j = 3; j <= 7; j++) {
 			if (i < 15 || (int)((i - 15) / 30) % 2 == 1) {
-				tms[j]->RotateAbout(V3(0.0f, 1.0f, 0.0f), -2.0f, tms[j]->GetCentroid());
+				instances[j]->RotateAbout(V3(0.0f, 1.0f, 0.0f), -2.0f, instances[j]->GetCentroid());
 			} else {
-				tms[j]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 2.0f, tms[j]->GetCentroid());
+				instances[j]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 2.0f, instances[j]->GetCentroid());
 			}
 		}
-		tms[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, tms[8]->GetCentroid());
+		instances[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, instances[8]->GetCentroid());
 
 		currentPPC = &p;
 		Render();
@@ -155,6 +199,7 @@ void Scene::SaveTIFFs() {
 	int count = 0;
 	char filename[32];
 
+	loader->WaitAll();
 	currentPPC = ppc[0];
 
 	for (int i = 0; i < 150; i++) {
@@ -167,7 +212,7 @@ void Scene::SaveTIFFs() {
 
 	for (int i = 0; i < 150; i++) {
 		PPC p = ppc[0]->Interpolate(*ppc[1], (float)i / 150.0f);
-		tms[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, tms[8]->GetCentroid());
+		instances[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, instances[8]->GetCentroid());
 
 		currentPPC = &p;
 		Render();
@@ -178,11 +223,13 @@ void Scene::SaveTIFFs() {
 
 	delete light;
 	light = new Light(V3(240.0f, 0.0f, 0.0f), Light::TYPE_POINT_LIGHT, 0.4f, 0.6f, 40.0f);
+	light->SetCastShadows(true);
+	lights->Set(0, light);
 
 	currentPPC = ppc[1];
 	for (int i = 0; i < 150; i++) {
-		light->RotateAbout(V3(0.0f, 1.0f, 0.0f), -0.6f, tms[2]->GetCentroid());
-		tms[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, tms[8]->GetCentroid());
+		light->RotateAbout(V3(0.0f, 1.0f, 0.0f), -0.6f, instances[2]->GetCentroid());
+		instances[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, instances[8]->GetCentroid());
 
 		Render();
 		sprintf(filename, "captured\\scene%03d.tif", count++);
@@ -194,12 +241,12 @@ void Scene::SaveTIFFs() {
 		PPC p = ppc[1]->Interpolate(*ppc[2], (float)i / 150.0f);
 		for (int j = 3; j <= 7; j++) {
 			if (i < 15 || (int)((i - 15) / 30) % 2 == 1) {
-				tms[j]->RotateAbout(V3(0.0f, 1.0f, 0.0f), -2.0f, tms[j]->GetCentroid());
+				instances[j]->RotateAbout(V3(0.0f, 1.0f, 0.0f), -2.0f, instances[j]->GetCentroid());
 			} else {
-				tms[j]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 2.0f, tms[j]->GetCentroid());
+				instances[j]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 2.0f, instances[j]->GetCentroid());
 			}
 		}
-		tms[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, tms[8]->GetCentroid());
+		instances[8]->RotateAbout(V3(0.0f, 1.0f, 0.0f), 0.2f, instances[8]->GetCentroid());
 
 		currentPPC = &p;
 		Render();
@@ -215,18 +262,57 @@ void Scene::SaveTIFFs() {
  * Render all the models.
  */
 void Scene::Render() {
+	loader->Update();
+	fb->ResetStats();
+
+	// each instance is drawn with the level of detail that fits its size on the screen
+	for (int i = 0; i < instancesN; i++) {
+		if (instances[i]->SelectLOD(currentPPC) == 0) continue;
+		fb->stats.lodMeshesN++;
+		fb->stats.lodTrianglesSavedN += instances[i]->GetMesh()->GetTrianglesN() - instances[i]->GetDrawnMesh()->GetTrianglesN();
+	}
+
+	lights->Update(currentPPC, fb->w, fb->h);
+	lights->RenderShadowMaps(instances, instancesN);
+
+	// if only the lights have changed since the last frame, the visible pixels are just lit again
+	if (IsVisibilityValid()) {
+		fb->Reshade(currentPPC, instances, instancesN);
+		fb->redraw();
+		return;
+	}
+
 	fb->SetZB(0.0f);
 	fb->Set(BLACK);
+	fb->ClearVisibility();
+
+	// the instances outside the view frustum are not submitted at all
+	Frustum frustum = currentPPC->GetFrustum();
+	vector<int> visibility(instancesN);
+	for (int i = 0; i < instancesN; i++) {
+		AABB aabb;
+		instances[i]->ComputeAABB(aabb);
+		visibility[i] = PPC::Classify(frustum, aabb);
+		if (visibility[i] == PPC::FRUSTUM_OUTSIDE) fb->stats.culledMeshesN++;
+	}
 
-	for (int i = 0; i < tmsN; i++) {
-		if (i == 0) {
-			shading_mode = GOURAUD_SHADING;
-		} else {
-			shading_mode = PHONG_SHADING;
+	// lay down the depth first, so that the color pass shades each pixel at most once
+	if (z_prepass) {
+		for (int i = 0; i < instancesN; i++) {
+			if (visibility[i] == PPC::FRUSTUM_OUTSIDE) continue;
+			instances[i]->RenderDepth(currentPPC, fb->zb, fb->w, fb->h, depthBuffers);
 		}
-		tms[i]->Render(fb, currentPPC);
+		fb->SetDepthTest(FrameBuffer::DEPTH_TEST_EQUAL);
 	}
 
+	for (int i = 0; i < instancesN; i++) {
+		if (visibility[i] == PPC::FRUSTUM_OUTSIDE) continue;
+		shading_mode = GetShadingMode(i);
+		instances[i]->Render(fb, currentPPC, i, visibility[i] == PPC::FRUSTUM_INSIDE);
+	}
+	fb->SetDepthTest(FrameBuffer::DEPTH_TEST_LESS);
+	SaveVisibilityState();
+
 	/*
 	for (int i = 0; i < ppcN; i++) {
 		if (ppc[i] == currentPPC) continue;
@@ -235,4 +321,50 @@ void Scene::Render() {
 	*/
 
 	fb->redraw();
-}
\ No newline at end of file
+}
+/**
+ * Return the shading mode of the i-th instance, where the Phong shaded ones are flat shaded if requested.
+ */
+int Scene::GetShadingMode(int i) {
+	int mode = instances[i]->GetShadingMode();
+	if (mode == PHONG_SHADING && flat_shading) return FLAT_SHADING;
+	return mode;
+}
+
+/**
+ * Return true if the visibility buffer recorded by the last frame is still valid, that is,
+ * the camera, the instances, and the rasterization settings have not changed since then.
+ */
+bool Scene::IsVisibilityValid() {
+	if (!visibilityValid) return false;
+	if (rasterization_mode != lastRasterizationMode || shading_rate != lastShadingRate || flat_shading != lastFlatShading) return false;
+
+	if (currentPPC->w != lastPPC.w || currentPPC->h != lastPPC.h) return false;
+	const V3* vs[4] = { &currentPPC->a, &currentPPC->b, &currentPPC->c, &currentPPC->C };
+	const V3* lastVs[4] = { &lastPPC.a, &lastPPC.b, &lastPPC.c, &lastPPC.C };
+	for (int i = 0; i < 4; i++) {
+		if (vs[i]->x() != lastVs[i]->x() || vs[i]->y() != lastVs[i]->y() || vs[i]->z() != lastVs[i]->z()) return false;
+	}
+
+	if ((int)lastVersions.size() != instancesN) return false;
+	for (int i = 0; i < instancesN; i++) {
+		if (instances[i]->GetVersion() != lastVersions[i]) return false;
+	}
+
+	return true;
+}
+
+/**
+ * Remember the state that the visibility buffer has been recorded with.
+ */
+void Scene::SaveVisibilityState() {
+	lastPPC = *currentPPC;
+	lastRasterizationMode = rasterization_mode;
+	lastShadingRate = shading_rate;
+	lastFlatShading = flat_shading;
+	lastVersions.resize(instancesN);
+	for (int i = 0; i < instancesN; i++) {
+		lastVersions[i] = instances[i]->GetVersion();
+	}
+	visibilityValid = true;
+}
@@ -6,7 +6,10 @@
 #include "M33.h"
 #include "PPC.h"
 #include "TMesh.h"
+#include "MeshInstance.h"
 #include "Light.h"
+#include "LightList.h"
+#include "AssetLoader.h"
 #include <vector>
 #include <iostream>
 
@@ -16,6 +19,7 @@
 #define NO_SHADING					0
 #define GOURAUD_SHADING				1
 #define PHONG_SHADING				2
+#define FLAT_SHADING				3
 
 using namespace std;
 
@@ -39,16 +43,54 @@ public:
 	/** The number of triangle meshes */
 	int tmsN;
 
+	/** The placements of the meshes, which are the objects drawn (several of them may share a mesh) */
+	MeshInstance** instances;
+	int instancesN;
+
+	/** Background loader of meshes and textures */
+	AssetLoader* loader;
+
+	/** the scratch buffers of the z-prepass */
+	DepthBuffers depthBuffers;
+
+	/** the camera, the versions of the instances, and the modes that the visibility buffer of fb was recorded with */
+	PPC lastPPC;
+	vector<unsigned int> lastVersions;
+	int lastRasterizationMode;
+	int lastShadingRate;
+	bool lastFlatShading;
+	bool visibilityValid;
+
 	static Light* light;
+
+	/** All the light sources, which are culled per screen tile */
+	static LightList* lights;
+
 	static int rasterization_mode;
 	static int shading_mode;
 
+	/** true if the depth of the scene is laid down before the color pass */
+	static bool z_prepass;
+
+	/** the size of the pixel blocks that Phong shading may light once (1, 2, or 4) */
+	static int shading_rate;
+
+	/** true if the meshes lit by Phong shading are flat shaded instead */
+	static bool flat_shading;
+
 public:
 	Scene();
 	void DBG();
 	void Demo();
 	void SaveTIFFs();
 	void Render();
+
+private:
+	int GetShadingMode(int i);
+	bool IsVisibilityValid();
+	void SaveVisibilityState();
+
+	static void AssetPoll_cb(void* data);
 };
 
 extern Scene *scene;
@@ -0,0 +1,154 @@
+#include "ShadowMap.h"
+#include "Light.h"
+#include "MeshInstance.h"
+#include "FrameBuffer.h"
+#include <algorithm>
+
+using namespace std;
+
+/** the distance of the camera of the directional light in the radius of the scene */
+#define DIRECTIONAL_DISTANCE	50.0f
+
+/** the offset of the looked up point along the normal [texels] */
+#define NORMAL_OFFSET			1.0f
+
+/** the depth bias [texels] */
+#define DEPTH_BIAS				1.5f
+
+ShadowMap::ShadowMap() {
+	for (int i = 0; i < 6; i++) {
+		faces[i] = new PPC(90.0f, SIZE, SIZE);
+		zbs[i] = new float[SIZE * SIZE];
+		biasScales[i] = 1.0f;
+	}
+	facesN = 0;
+	valid = false;
+}
+
+ShadowMap::~ShadowMap() {
+	for (int i = 0; i < 6; i++) {
+		delete faces[i];
+		delete [] zbs[i];
+	}
+}
+
+/**
+ * Render the shadow map of the specified light.
+ * The cameras are fit to the bounding sphere of the meshes.
+ *
+ * @param light			the light
+ * @param instances		the instances that cast shadows
+ * @param instancesN	the number of instances
+ */
+void ShadowMap::Update(const Light* light, MeshInstance** instances, int instancesN) {
+	AABB box;
+	for (int i = 0; i < instancesN; i++) {
+		instances[i]->ComputeAABB(box);
+	}
+
+	valid = box.minCorner().x() <= box.maxCorner().x();
+	if (!valid) return;
+
+	V3 center = (box.minCorner() + box.maxCorner()) / 2.0f;
+	float radius = box.Size().Length() / 2.0f + 1.0f;
+
+	if (light->GetType() == Light::TYPE_DIRECTIONAL_LIGHT) {
+		V3 vd = light->GetPosition().UnitVector();
+		V3 up = fabsf(vd.y()) < 0.9f ? V3(0.0f, 1.0f, 0.0f) : V3(1.0f, 0.0f, 0.0f);
+		float distance = radius * DIRECTIONAL_DISTANCE;
+
+		facesN = 1;
+		*faces[0] = PPC(RAD2DEG(2.0f * asinf(1.0f / DIRECTIONAL_DISTANCE)), SIZE, SIZE);
+		faces[0]->LookAt(center, vd, up, distance);
+	} else {
+		static const V3 vds[6] = { V3(1, 0, 0), V3(-1, 0, 0), V3(0, 1, 0), V3(0, -1, 0), V3(0, 0, 1), V3(0, 0, -1) };
+		static const V3 ups[6] = { V3(0, 1, 0), V3(0, 1, 0), V3(0, 0, -1), V3(0, 0, 1), V3(0, 1, 0), V3(0, 1, 0) };
+
+		position = light->GetPosition();
+		facesN = 6;
+		for (int i = 0; i < 6; i++) {
+			*faces[i] = PPC(90.0f, SIZE, SIZE);
+			faces[i]->LookAt(position + vds[i], vds[i], ups[i], 1.0f);
+		}
+	}
+
+	#pragma omp parallel for
+	for (int i = 0; i < facesN; i++) {
+		biasScales[i] = 1.0f / (1.0f - DEPTH_BIAS / faces[i]->GetFocalLength());
+
+		float* zb = zbs[i];
+		for (int j = 0; j < SIZE * SIZE; j++) {
+			zb[j] = 0.0f;
+		}
+
+		for (int j = 0; j < instancesN; j++) {
+			instances[j]->RenderDepth(faces[i], zb, SIZE, SIZE, depthBuffers[i]);
+		}
+	}
+}
+
+/**
+ * Return the fraction of the light that reaches the specified point.
+ * The point is offset along the normal by a texel to avoid the self shadowing.
+ *
+ * @param x			x coordinate of the point
+ * @param y			y coordinate of the point
+ * @param z			z coordinate of the point
+ * @param nx		x coordinate of the unit normal
+ * @param ny		y coordinate of the unit normal
+ * @param nz		z coordinate of the unit normal
+ * @return			the visibility in [0, 1]
+ */
+float ShadowMap::GetVisibility(float x, float y, float z, float nx, float ny, float nz) const {
+	if (!valid) return 1.0f;
+
+	// choose the cube face by the major axis of the direction from the light
+	int face = 0;
+	if (facesN == 6) {
+		float dx = x - position.x();
+		float dy = y - position.y();
+		float dz = z - position.z();
+		if (fabsf(dx) >= fabsf(dy) && fabsf(dx) >= fabsf(dz)) {
+			face = dx >= 0.0f ? 0 : 1;
+		} else if (fabsf(dy) >= fabsf(dz)) {
+			face = dy >= 0.0f ? 2 : 3;
+		} else {
+			face = dz >= 0.0f ? 4 : 5;
+		}
+	}
+
+	// the size of a texel at the point is 1/w since the pixel width vector is a unit vector
+	V3 pp;
+	if (!faces[face]->Project(V3(x, y, z), pp)) return 1.0f;
+	float texel = NORMAL_OFFSET / pp.z();
+	if (!faces[face]->Project(V3(x + nx * texel, y + ny * texel, z + nz * texel), pp)) return 1.0f;
+
+	return Lookup(face, pp);
+}
+
+/**
+ * Percentage closer filtering over the 3x3 texels around the projected point.
+ *
+ * @param face		the cube face
+ * @param pp		the projected point
+ * @return			the visibility in [0, 1]
+ */
+float ShadowMap::Lookup(int face, const V3 &pp) const {
+	if (pp.x() < -1.0f || pp.x() > SIZE + 1.0f || pp.y() < -1.0f || pp.y() > SIZE + 1.0f) return 1.0f;
+
+	const float* zb = zbs[face];
+	float threshold = pp.z() * biasScales[face];
+	int u0 = (int)floorf(pp.x());
+	int v0 = (int)floorf(pp.y());
+
+	int lit = 0;
+	for (int v = v0 - 1; v <= v0 + 1; v++) {
+		int vv = min(max(v, 0), SIZE - 1);
+		for (int u = u0 - 1; u <= u0 + 1; u++) {
+			int uu = min(max(u, 0), SIZE - 1);
+			if (zb[(SIZE - 1 - vv) * SIZE + uu] <= threshold) lit++;
+		}
+	}
+
+	return lit / 9.0f;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "V3.h"
+#include "PPC.h"
+#include "TMesh.h"
+
+class Light;
+class MeshInstance;
+
+/**
+ * Shadow map of a light.
+ * The scene is rendered depth-only from cameras placed at the light: six 90 degree cameras of a cube map
+ * for the point light, and one distant narrow camera, which is nearly orthographic, for the directional light.
+ * The visibility of a point is filtered by percentage closer filtering over 3x3 texels.
+ */
+class ShadowMap {
+public:
+	enum { SIZE = 512 };
+
+private:
+	/** the cameras of the faces */
+	PPC* faces[6];
+
+	/** the z buffers of the faces (1/w, the same layout as the frame buffer) */
+	float* zbs[6];
+
+	/** the scratch buffers of the faces, which are rendered in parallel */
+	DepthBuffers depthBuffers[6];
+
+	/** the scale of 1/w that offsets the depth by the bias */
+	float biasScales[6];
+
+	/** the number of the faces in use (6 for the point light, 1 for the directional light) */
+	int facesN;
+
+	/** the position of the point light */
+	V3 position;
+
+	/** false if there is nothing to cast shadows */
+	bool valid;
+
+public:
+	ShadowMap();
+	~ShadowMap();
+
+	void Update(const Light* light, MeshInstance** instances, int instancesN);
+	float GetVisibility(float x, float y, float z, float nx, float ny, float nz) const;
+
+private:
+	float Lookup(int face, const V3 &pp) const;
+};
+
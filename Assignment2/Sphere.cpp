@@ -19,6 +19,7 @@ Sphere::Sphere(float radius, const V3 &c, int nstack, int nslice) {
 			verts[count].v[1] = y0;
 			verts[count].v[2] = z0;
 			verts[count].c = c;
+			verts[count].ao = 1.0f;
 			verts[count].n = verts[count].v.UnitVector();
 			verts[count].t[0] = (float)j / (float)nslice;
 			verts[count].t[1] = (float)i / (float)nstack;
@@ -41,5 +42,8 @@ Sphere::Sphere(float radius, const V3 &c, int nstack, int nslice) {
 			count += 6;
 		}
 	}
+
+	// the sphere is closed, so the meshlets facing away are culled
+	BuildMeshlets();
 }
 
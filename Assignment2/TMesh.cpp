@@ -1,45 +1,223 @@
 #include "TMesh.h"
 #include "FrameBuffer.h"
+#include "Scene.h"
+#include "BVH.h"
 #include <libtiff/tiffio.h>
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <vector>
+#include <algorithm>
+#include <queue>
+#include <math.h>
+#include <string.h>
+#include <emmintrin.h>
 
 using namespace std;
 
+/** the number of rays cast from each vertex to bake the ambient occlusion */
+#define AO_RAYS				64
+
+/** the distance within which the occluders darken the vertex [in the diagonal of the AABB] */
+#define AO_RADIUS			0.25f
+
+/** the offset of the origin of the rays along the normal [in the diagonal of the AABB] */
+#define AO_OFFSET			1e-4f
+
+/** the size of the LRU cache modeled by the triangle reordering */
+#define FORSYTH_CACHE_SIZE	32
+
+/** the coarsest level of detail has at least this many triangles */
+#define LOD_MIN_TRIS		64
+
+/** the level of detail is chosen such that a triangle covers at least this many pixels */
+#define LOD_PIXELS_PER_TRI	4.0f
+
+/** the weight of the planes that keep the boundary edges in place during the simplification */
+#define QEM_BOUNDARY_WEIGHT	100.0
+
+/** the code of a compressed triangle that does not share an edge with the previous one */
+#define INDEX_CODE_NONE		9
+
+/** the bit of the code telling that the i-th new vertex of a compressed triangle is the next unused vertex */
+#define INDEX_CODE_NEXT(i)	(16 << (i))
+
+/** the maximum numbers of the vertices and the triangles of a meshlet */
+#define MESHLET_MAX_VERTS	64
+#define MESHLET_MAX_TRIS	128
+
+/** the penalty of a new vertex when a meshlet is grown, against the cosine to the average normal */
+#define MESHLET_VERTEX_WEIGHT	0.25f
+
+/** the margin by which the normal cone is widened against the rounding errors [cosine] */
+#define MESHLET_CONE_MARGIN	1e-3f
+
+/** the distance within which the vertices are welded to test whether a mesh is closed [in the diagonal of the AABB] */
+#define WELD_EPSILON		1e-5f
+
+/**
+ * Append the integer in the zigzag variable-length encoding (7 bits per byte, small magnitudes first).
+ */
+static void WriteVarint(vector<unsigned char> &bytes, int value) {
+	unsigned int u = ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+	while (u >= 0x80) {
+		bytes.push_back((unsigned char)(u | 0x80));
+		u >>= 7;
+	}
+	bytes.push_back((unsigned char)u);
+}
+
+/**
+ * Read the integer in the zigzag variable-length encoding.
+ *
+ * @return		false if the bytes run out
+ */
+static bool ReadVarint(const unsigned char* bytes, int bytesN, int &pos, int &value) {
+	unsigned int u = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (pos >= bytesN) return false;
+		unsigned char b = bytes[pos++];
+		u |= (unsigned int)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			value = (int)(u >> 1) ^ -(int)(u & 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Add the quadric of the plane n * p + d = 0 with the specified weight to the symmetric 4x4 matrix,
+ * which is stored as its upper triangle (10 elements).
+ */
+static void AddPlaneQuadric(double* q, double nx, double ny, double nz, double d, double weight) {
+	q[0] += weight * nx * nx;
+	q[1] += weight * nx * ny;
+	q[2] += weight * nx * nz;
+	q[3] += weight * nx * d;
+	q[4] += weight * ny * ny;
+	q[5] += weight * ny * nz;
+	q[6] += weight * ny * d;
+	q[7] += weight * nz * nz;
+	q[8] += weight * nz * d;
+	q[9] += weight * d * d;
+}
+
+/**
+ * Return the squared distance error p^T Q p of the point.
+ */
+static double EvaluateQuadric(const double* q, double x, double y, double z) {
+	return q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x
+		+ q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y
+		+ q[7] * z * z + 2.0 * q[8] * z + q[9];
+}
+
+/** an edge collapse candidate (the stamps detect the candidates made stale by other collapses) */
+typedef struct {
+	double cost;
+	int u;
+	int v;
+	unsigned int stampU;
+	unsigned int stampV;
+	V3 p;
+} EdgeCollapse;
+
+/** order the candidates so that the cheapest one is at the top of the priority queue */
+struct CollapseGreater {
+	bool operator()(const EdgeCollapse &a, const EdgeCollapse &b) const {
+		return a.cost > b.cost;
+	}
+};
+
+/**
+ * Transform the point by the columns of a matrix and add the fourth column (the kernel of the vertex stage).
+ * The sums are in the same order as M33::operator*(), so the result matches M34::TransformPoint() exactly.
+ *
+ * @param cols		the three columns and the translation, whose fourth lanes are zero
+ * @return			x, y, z, and zero
+ */
+static inline __m128 TransformColumns(const __m128* cols, float x, float y, float z) {
+	__m128 r = _mm_add_ps(_mm_mul_ps(cols[0], _mm_set1_ps(x)), _mm_mul_ps(cols[1], _mm_set1_ps(y)));
+	r = _mm_add_ps(r, _mm_mul_ps(cols[2], _mm_set1_ps(z)));
+	return _mm_add_ps(r, cols[3]);
+}
+
+/**
+ * Load the columns of the linear part and the translation of the transformation for TransformColumns().
+ *
+ * @param transform		the transformation
+ * @param cols			the three columns and the translation, whose fourth lanes are zero
+ */
+static inline void LoadPositionColumns(const M34 &transform, __m128* cols) {
+	M33 linear = transform.GetLinear();
+	for (int k = 0; k < 3; k++) {
+		V3 col = linear.GetColumn(k);
+		cols[k] = _mm_setr_ps(col.x(), col.y(), col.z(), 0.0f);
+	}
+	const V3 &t = transform.GetTranslation();
+	cols[3] = _mm_setr_ps(t.x(), t.y(), t.z(), 0.0f);
+}
+
 TMesh::TMesh() {
 	verts = NULL;
 	vertsN = 0;
 	tris = NULL;
 	trisN = 0;
+	tris16 = NULL;
+	litVerts = NULL;
+	litVertsN = 0;
+	worldVerts = NULL;
+	worldVertsN = 0;
+	projVerts = NULL;
+	outcodes = NULL;
+	projVertsN = 0;
 
 	texture = NULL;
+	texturePending = false;
+	version = 0;
+	modelVersion = 0;
+	bvh = NULL;
+	bvhVersion = 0;
+	boundsVersion = 0;
+	boundsValid = false;
+	backFaceCulling = false;
 }
 
 TMesh::~TMesh() {
 	if (texture != NULL) {
 		delete texture;
 	}
+	if (bvh != NULL) {
+		delete bvh;
+	}
+	for (int i = 0; i < (int)lods.size(); i++) {
+		delete lods[i];
+	}
 }
 
 /**
  * Load a mesh from bin file.
+ * If the file cannot be read or is corrupted, this mesh is left empty.
+ *
+ * @param filename		the bin file name
+ * @return				true if the mesh is loaded
  */
-void TMesh::Load(char* filename) {
+bool TMesh::Load(char* filename) {
 	Clear();
 
 	ifstream ifs(filename, ios::binary);
 	if (ifs.fail()) {
 		cerr << "INFO: cannot open file: " << filename << endl;
-		return;
+		return false;
 	}
 
 	ifs.read((char*)&vertsN, sizeof(int));
 	char v_yn, c_yn, n_yn, t_yn;
 	ifs.read(&v_yn, 1); // always xyz
-	if (v_yn != 'y') {
+	if (ifs.fail() || vertsN < 0 || v_yn != 'y') {
 		cerr << "INTERNAL ERROR: there should always be vertex xyz data" << endl;
-		return;
+		vertsN = 0;
+		return false;
 	}
 
 	verts = new Vertex[vertsN];
@@ -50,6 +228,7 @@ void TMesh::Load(char* filename) {
 
 	for (int i = 0; i < vertsN; i++) {
 		ifs.read((char*)&verts[i].v[0], 3 * sizeof(float));
+		verts[i].ao = 1.0f;
 	}
 
 	if (c_yn == 'y') {
@@ -71,47 +250,162 @@ void TMesh::Load(char* filename) {
 	}
 
 	ifs.read((char*)&trisN, sizeof(int));
-	tris = new unsigned int[trisN*3];
-	ifs.read((char*)tris, trisN*3*sizeof(unsigned int)); // read tiangles
+	if (trisN >= 0) {
+		tris = new unsigned int[trisN*3];
+		ifs.read((char*)tris, trisN*3*sizeof(unsigned int)); // read tiangles
+	} else {
+		// the negative number means that the triangles are compressed (see Save())
+		trisN = -trisN;
+		tris = new unsigned int[trisN*3];
+		int bytesN = 0;
+		ifs.read((char*)&bytesN, sizeof(int));
+		bytesN = max(bytesN, 0);
+		vector<unsigned char> bytes(max(bytesN, 1));
+		ifs.read((char*)&bytes[0], bytesN);
+		if (!DecodeIndices(&bytes[0], bytesN, tris, trisN)) {
+			cerr << "INFO: corrupted triangles in file: " << filename << endl;
+			Clear();
+			return false;
+		}
+	}
 
+	// the file ended early, or a triangle refers to a vertex that does not exist
+	bool corrupted = ifs.fail();
+	for (int i = 0; i < trisN * 3 && !corrupted; i++) {
+		if (tris[i] >= (unsigned int)vertsN) corrupted = true;
+	}
 	ifs.close();
+	if (corrupted) {
+		cerr << "INFO: corrupted file: " << filename << endl;
+		Clear();
+		return false;
+	}
+
+	PackIndices();
+	version++;
 
 	//cerr << "INFO: loaded " << vertsN << " verts, " << trisN << " tris from " << endl << "      " << filename << endl;
 	//cerr << "      xyz " << ((cols) ? "rgb " : "") << ((norms) ? "nxnynz " : "") << ((tcs) ? "tcstct " : "") << endl;
+	return true;
 }
 
 /**
- * Compute 3D axis aligned bouding box.
+ * Save this mesh to bin file.
+ * The vertices and the normals are saved in the world space, i.e. transformed by the model matrix.
+ * The compressed triangles are marked by the negative number of triangles, which the older readers reject.
  *
- * @param p0	the corner with the minimum coordinates
- * @param p1	the corner with the maximum coordinates
+ * @param filename			the bin file name
+ * @param compressIndices	true if the triangles are compressed (see EncodeIndices())
  */
-void TMesh::ComputeAABB(AABB &aabb) {
+void TMesh::Save(char* filename, bool compressIndices) const {
+	ofstream ofs(filename, ios::binary);
+	if (ofs.fail()) {
+		cerr << "INFO: cannot open file: " << filename << endl;
+		return;
+	}
+
+	ofs.write((char*)&vertsN, sizeof(int));
+	ofs.write("yyyy", 4); // xyz, cols, normals, and texture coordinates
+
+	M33 normalMat = model.GetNormalMatrix();
 	for (int i = 0; i < vertsN; i++) {
-		aabb.AddPoint(verts[i].v);
+		V3 p = model.TransformPoint(verts[i].v);
+		ofs.write((char*)&p[0], 3 * sizeof(float));
+	}
+	for (int i = 0; i < vertsN; i++) {
+		ofs.write((char*)&verts[i].c[0], 3 * sizeof(float));
+	}
+	for (int i = 0; i < vertsN; i++) {
+		V3 n = normalMat * verts[i].n;
+		if (n.Length() > 0.0f) n = n / n.Length();
+		ofs.write((char*)&n[0], 3 * sizeof(float));
+	}
+	for (int i = 0; i < vertsN; i++) {
+		ofs.write((char*)&verts[i].t[0], 2 * sizeof(float));
+	}
+
+	vector<unsigned int> indices(trisN * 3);
+	for (int i = 0; i < trisN * 3; i++) {
+		indices[i] = FetchIndex(tris, tris16, i);
+	}
+
+	if (compressIndices) {
+		vector<unsigned char> bytes;
+		EncodeIndices(trisN > 0 ? &indices[0] : NULL, trisN, bytes);
+		int negTrisN = -trisN;
+		int bytesN = (int)bytes.size();
+		ofs.write((char*)&negTrisN, sizeof(int));
+		ofs.write((char*)&bytesN, sizeof(int));
+		if (bytesN > 0) ofs.write((char*)&bytes[0], bytesN);
+	} else {
+		ofs.write((char*)&trisN, sizeof(int));
+		if (trisN > 0) ofs.write((char*)&indices[0], trisN * 3 * sizeof(unsigned int));
+	}
+}
+
+/**
+ * Compute 3D axis aligned bouding box in the world space.
+ * The box is cached until the vertices move, and is added to the specified box.
+ *
+ * @param aabb	the box to which the bounding box of this mesh is added
+ */
+void TMesh::ComputeAABB(AABB &aabb) {
+	ComputeAABB(aabb, model);
+}
+
+/**
+ * Compute the bounding box of the object space box transformed by the specified transformation.
+ * The transformed corners are bounded, so the box is not tight after a rotation.
+ *
+ * @param aabb			the box to which the bounding box of this mesh is added
+ * @param transform		the transformation from the object space
+ */
+void TMesh::ComputeAABB(AABB &aabb, const M34 &transform) {
+	if (!boundsValid || boundsVersion != version) {
+		bounds = AABB();
+		for (int i = 0; i < vertsN; i++) {
+			bounds.AddPoint(verts[i].v);
+		}
+		boundsVersion = version;
+		boundsValid = true;
+	}
+
+	if (vertsN == 0) return;
+	if (transform.IsIdentity()) {
+		aabb.AddPoint(bounds.minCorner());
+		aabb.AddPoint(bounds.maxCorner());
+		return;
+	}
+
+	V3 corners[8];
+	for (int i = 0; i < 8; i++) {
+		corners[i] = V3((i & 1) ? bounds.maxCorner().x() : bounds.minCorner().x(),
+			(i & 2) ? bounds.maxCorner().y() : bounds.minCorner().y(),
+			(i & 4) ? bounds.maxCorner().z() : bounds.minCorner().z());
+	}
+	transform.TransformPoints(corners, 8);
+	for (int i = 0; i < 8; i++) {
+		aabb.AddPoint(corners[i]);
 	}
 }
 
 /**
- * Translate all the vertices by the specified vector.
+ * Translate this mesh by the specified vector.
+ * Only the model matrix is updated, and the vertices stay in the object space.
  *
  * @param v		the specified vector
  */
 void TMesh::Translate(const V3 &v) {
-	for (int i = 0; i < vertsN; i++) {
-		verts[i].v += v;
-	}
+	SetModel(M34::Translation(v) * model);
 }
 
 /**
- * Scale all the vertices by the specified factor.
+ * Scale this mesh around the origin by the specified factor.
  *
  * @param t		the specified scaling factor
  */
 void TMesh::Scale(float t) {
-	for (int i = 0; i < vertsN; i++) {
-		verts[i].v *= t;
-	}
+	SetModel(M34::Scaling(V3(t, t, t), V3(0.0f, 0.0f, 0.0f)) * model);
 }
 
 /**
@@ -128,103 +422,1779 @@ void TMesh::Scale(const V3 &centroid, const V3 &size) {
 	
 	V3 scale(size.x() / aabb.Size().x(), size.y() / aabb.Size().y(), size.z() / aabb.Size().z());
 
-	for (int i = 0; i < vertsN; i++) {
-		verts[i].v[0] = (verts[i].v.x() - c.x()) * scale.x() + centroid.x();
-		verts[i].v[1] = (verts[i].v.y() - c.y()) * scale.y() + centroid.y();
-		verts[i].v[2] = (verts[i].v.z() - c.z()) * scale.z() + centroid.z();
-	}
+	SetModel(M34::Translation(centroid - c) * M34::Scaling(scale, c) * model);
 }
 
 void TMesh::RenderWireframe(FrameBuffer *fb, PPC *ppc) {
 	for (int i = 0; i < trisN; i++) {
-		fb->Draw3DSegment(ppc, verts[tris[i * 3]].v, verts[tris[i * 3]].c, verts[tris[i * 3 + 1]].v, verts[tris[i * 3 + 1]].c);
-		fb->Draw3DSegment(ppc, verts[tris[i * 3 + 1]].v, verts[tris[i * 3 + 1]].c, verts[tris[i * 3 + 2]].v, verts[tris[i * 3 + 2]].c);
-		fb->Draw3DSegment(ppc, verts[tris[i * 3 + 2]].v, verts[tris[i * 3 + 2]].c, verts[tris[i * 3]].v, verts[tris[i * 3]].c);
+		unsigned int tri[3];
+		GetTriangle(i, tri);
+		V3 p0 = model.TransformPoint(verts[tri[0]].v);
+		V3 p1 = model.TransformPoint(verts[tri[1]].v);
+		V3 p2 = model.TransformPoint(verts[tri[2]].v);
+		fb->Draw3DSegment(ppc, p0, verts[tri[0]].c, p1, verts[tri[1]].c);
+		fb->Draw3DSegment(ppc, p1, verts[tri[1]].c, p2, verts[tri[2]].c);
+		fb->Draw3DSegment(ppc, p2, verts[tri[2]].c, p0, verts[tri[0]].c);
 	}
 }
 
-void TMesh::Render(FrameBuffer *fb, PPC *ppc) {
+/**
+ * Render this mesh.
+ *
+ * @param fb				the frame buffer
+ * @param ppc				the camera
+ * @param id				the index of the mesh written to the visibility buffer (-1 means not written)
+ * @param insideFrustum		true if the whole mesh is known to be inside the view frustum
+ * @param vs				the vertices in the world space (NULL means that they are transformed by the model matrix)
+ * @param transform			the transformation that vs was transformed by (NULL means the model matrix)
+ */
+void TMesh::Render(FrameBuffer *fb, PPC *ppc, int id, bool insideFrustum, const Vertex* vs, const M34* transform) {
 	M33 camMat;
 	camMat.SetColumn(0, ppc->a);
 	camMat.SetColumn(1, ppc->b);
 	camMat.SetColumn(2, ppc->c);
 
-	if (texture != NULL) {
-		for (int i = 0; i < trisN; i++) {
-			fb->rasterizeWithTexture(ppc, camMat, verts[tris[i * 3]], verts[tris[i * 3 + 1]], verts[tris[i * 3 + 2]], texture);
+	// the placeholder is shown until the asynchronously loaded texture arrives
+	Texture* tex = texture;
+	if (tex == NULL && texturePending) tex = Texture::GetPlaceholder();
+
+	// the kernel is chosen once for all the triangles
+	FrameBuffer::Rasterizer rasterizer = FrameBuffer::GetRasterizer(tex != NULL, false);
+	RasterTarget target = fb->GetTarget();
+	target.mesh = id;
+	if (id < 0) target.visMesh = NULL;
+
+	// the vertices in the world space come from the vertex stage of the instance, if any,
+	// and otherwise the vertices are transformed by the model matrix of this mesh
+	const Vertex* v = vs;
+	if (v == NULL) v = model.IsIdentity() ? verts : TransformVertices(model, V3(1.0f, 1.0f, 1.0f));
+
+	// Gouraud shading interpolates the colors of the vertices lit once per frame
+	if (tex == NULL && Scene::shading_mode == GOURAUD_SHADING) {
+		LightVertices(v);
+		target.stats->shadingsN += vertsN;
+		v = litVerts;
+	}
+
+	// each vertex is projected once, instead of once per triangle sharing it
+	if (projVertsN != vertsN) {
+		if (projVerts != NULL) {
+			delete [] projVerts;
+			delete [] outcodes;
 		}
-	} else {
-		for (int i = 0; i < trisN; i++) {
-			fb->rasterize(ppc, camMat, verts[tris[i * 3]], verts[tris[i * 3 + 1]], verts[tris[i * 3 + 2]]);
+		projVerts = new V3[vertsN];
+		outcodes = new unsigned char[vertsN];
+		projVertsN = vertsN;
+	}
+	ProjectVertices(ppc, projVerts, outcodes, v);
+
+	// the clusters outside the frustum or facing away are dropped as a whole before the triangle setup
+	vector<int> ranges;
+	int culledN, culledTrisN;
+	CullMeshlets(ppc, transform != NULL ? *transform : model, insideFrustum, ranges, culledN, culledTrisN);
+	target.stats->culledMeshletsN += culledN;
+	target.stats->culledMeshletTrianglesN += culledTrisN;
+
+	for (int r = 0; r < (int)ranges.size(); r += 2) {
+		for (int i = ranges[r]; i < ranges[r] + ranges[r + 1]; i++) {
+			unsigned int i0 = FetchIndex(tris, tris16, i * 3);
+			unsigned int i1 = FetchIndex(tris, tris16, i * 3 + 1);
+			unsigned int i2 = FetchIndex(tris, tris16, i * 3 + 2);
+
+			// skip the triangle behind the camera or entirely outside one side of the screen
+			// (nothing is outside if the whole mesh is inside the frustum)
+			if (!insideFrustum) {
+				if ((outcodes[i0] | outcodes[i1] | outcodes[i2]) & OUTCODE_BEHIND) continue;
+				if (outcodes[i0] & outcodes[i1] & outcodes[i2]) continue;
+			}
+
+			target.triangle = i;
+			rasterizer(target, ppc, camMat, v[i0], v[i1], v[i2], projVerts[i0], projVerts[i1], projVerts[i2], tex);
 		}
 	}
 }
 
 /**
- * Clear the allocated memory for vertices.
+ * Transform the vertices to the world space in one parallel pass (the vertex stage of an instance).
+ * The normals are transformed by the normal matrix and normalized, and the colors are multiplied by the material color.
+ * The result is kept in a scratch buffer, which is overwritten by the next call.
+ *
+ * @param transform		the transformation to the world space
+ * @param color			the material color
+ * @return				the transformed vertices
  */
-void TMesh::Clear() {
-	if (verts != NULL) {
-		delete [] verts;
+const Vertex* TMesh::TransformVertices(const M34 &transform, const V3 &color) {
+	if (worldVertsN != vertsN) {
+		if (worldVerts != NULL) delete [] worldVerts;
+		worldVerts = new Vertex[vertsN];
+		worldVertsN = vertsN;
 	}
-	verts = NULL;
-	
-	vertsN = 0;
 
-	if (tris != NULL) {
-		delete [] tris;
+	// the matrices are loaded into the registers once for all the vertices
+	__m128 posCols[4];
+	LoadPositionColumns(transform, posCols);
+	M33 normalMat = transform.GetNormalMatrix();
+	__m128 normCols[4];
+	for (int k = 0; k < 3; k++) {
+		V3 col = normalMat.GetColumn(k);
+		normCols[k] = _mm_setr_ps(col.x(), col.y(), col.z(), 0.0f);
 	}
-	trisN = 0;
+	normCols[3] = _mm_setzero_ps();
+	__m128 rgb = _mm_setr_ps(color.x(), color.y(), color.z(), 1.0f);
+
+	#pragma omp parallel for
+	for (int i = 0; i < vertsN; i++) {
+		// a vertex is 12 floats: position, color, normal, texture coordinates, and ambient occlusion.
+		// Each store writes four floats, and the extra one is overwritten by the next field.
+		const float* src = (const float*)&verts[i];
+		float* dst = (float*)&worldVerts[i];
+
+		_mm_storeu_ps(dst, TransformColumns(posCols, src[0], src[1], src[2]));
+		_mm_storeu_ps(dst + 3, _mm_mul_ps(_mm_loadu_ps(src + 3), rgb));
+
+		__m128 n = TransformColumns(normCols, src[6], src[7], src[8]);
+		__m128 sq = _mm_mul_ps(n, n);
+		sq = _mm_add_ps(sq, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(2, 3, 0, 1)));
+		sq = _mm_add_ps(sq, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(1, 0, 3, 2)));
+		if (_mm_cvtss_f32(sq) > 0.0f) n = _mm_div_ps(n, _mm_sqrt_ps(sq));
+		_mm_storeu_ps(dst + 6, n);
+
+		dst[9] = src[9];
+		dst[10] = src[10];
+		dst[11] = src[11];
+	}
+
+	return worldVerts;
 }
 
 /**
- * Rotate this mesh around the specified axis passing through the centroid by the specified angle.
+ * Project all the vertices by the camera in one parallel pass.
+ * The vertices are projected four at a time with SSE2, in the same order of the operations as PPC::Project(),
+ * so the projected point has exactly the screen coordinates and 1/w of PPC::Project(). The outcode tells whether
+ * the vertex is behind the camera or outside each side of the screen.
  *
- * @param axis		the specified axis
- * @param angle		the specified angle
+ * @param ppc		the camera
+ * @param pp		the projected points (vertsN elements)
+ * @param codes		the outcodes (vertsN elements)
+ * @param vs		the vertices in the world space (NULL means the vertices of this mesh, if the model matrix is the identity)
  */
-void TMesh::RotateAbout(const V3 &axis, float angle) {
-	RotateAbout(axis, angle, GetCentroid());
+void TMesh::ProjectVertices(PPC *ppc, V3* pp, unsigned char* codes, const Vertex* vs) const {
+	if (vs == NULL) vs = verts;
+
+	// the matrix and the camera are broadcast to the four lanes once for all the vertices
+	__m128 m[3][3];
+	for (int r = 0; r < 3; r++) {
+		V3 row = ppc->pMat.GetRow(r);
+		for (int k = 0; k < 3; k++) {
+			m[r][k] = _mm_set1_ps(row[k]);
+		}
+	}
+	__m128 cx = _mm_set1_ps(ppc->C.x());
+	__m128 cy = _mm_set1_ps(ppc->C.y());
+	__m128 cz = _mm_set1_ps(ppc->C.z());
+	__m128 w = _mm_set1_ps((float)ppc->w);
+	__m128 h = _mm_set1_ps((float)ppc->h);
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128i behindBit = _mm_set1_epi32(OUTCODE_BEHIND);
+	__m128i leftBit = _mm_set1_epi32(OUTCODE_LEFT);
+	__m128i rightBit = _mm_set1_epi32(OUTCODE_RIGHT);
+	__m128i bottomBit = _mm_set1_epi32(OUTCODE_BOTTOM);
+	__m128i topBit = _mm_set1_epi32(OUTCODE_TOP);
+
+	int blocksN = (vertsN + 3) / 4;
+
+	#pragma omp parallel for
+	for (int b = 0; b < blocksN; b++) {
+		// the last block is padded by repeating the last vertex
+		int first = b * 4;
+		int count = min(4, vertsN - first);
+
+		// a vertex starts with its position, so four loads and a transpose give x, y, and z of the four vertices
+		__m128 x = _mm_loadu_ps((const float*)&vs[first]);
+		__m128 y = _mm_loadu_ps((const float*)&vs[first + min(1, count - 1)]);
+		__m128 z = _mm_loadu_ps((const float*)&vs[first + min(2, count - 1)]);
+		__m128 c = _mm_loadu_ps((const float*)&vs[first + min(3, count - 1)]);
+		_MM_TRANSPOSE4_PS(x, y, z, c);
+		x = _mm_sub_ps(x, cx);
+		y = _mm_sub_ps(y, cy);
+		z = _mm_sub_ps(z, cz);
+
+		__m128 qx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][0], x), _mm_mul_ps(m[0][1], y)), _mm_mul_ps(m[0][2], z));
+		__m128 qy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[1][0], x), _mm_mul_ps(m[1][1], y)), _mm_mul_ps(m[1][2], z));
+		__m128 qz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[2][0], x), _mm_mul_ps(m[2][1], y)), _mm_mul_ps(m[2][2], z));
+
+		__m128 u = _mm_div_ps(qx, qz);
+		__m128 v = _mm_div_ps(qy, qz);
+		__m128 iw = _mm_div_ps(one, qz);
+
+		// the side bits are dropped for the vertices behind the camera
+		__m128i behind = _mm_castps_si128(_mm_cmplt_ps(qz, zero));
+		__m128i sides = _mm_or_si128(
+			_mm_or_si128(_mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(u, zero)), leftBit), _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(u, w)), rightBit)),
+			_mm_or_si128(_mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(v, zero)), bottomBit), _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(v, h)), topBit)));
+		__m128i code = _mm_or_si128(_mm_and_si128(behind, behindBit), _mm_andnot_si128(behind, sides));
+		code = _mm_packs_epi32(code, code);
+		int packed = _mm_cvtsi128_si32(_mm_packus_epi16(code, code));
+
+		// the points of the vertices behind the camera are not used, so they are written as they are
+		if (count == 4) {
+			memcpy(&codes[first], &packed, 4);
+			float* dst = (float*)&pp[first];
+			__m128 uv01 = _mm_unpacklo_ps(u, v);
+			__m128 uv23 = _mm_unpackhi_ps(u, v);
+			_mm_storeu_ps(dst, _mm_shuffle_ps(uv01, _mm_shuffle_ps(iw, u, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 1, 0)));
+			_mm_storeu_ps(dst + 4, _mm_shuffle_ps(_mm_shuffle_ps(uv01, iw, _MM_SHUFFLE(1, 1, 3, 2)), uv23, _MM_SHUFFLE(1, 0, 2, 1)));
+			_mm_storeu_ps(dst + 8, _mm_shuffle_ps(_mm_shuffle_ps(iw, u, _MM_SHUFFLE(3, 3, 2, 2)), _mm_shuffle_ps(v, iw, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0)));
+		} else {
+			float uLanes[4], vLanes[4], iwLanes[4];
+			_mm_storeu_ps(uLanes, u);
+			_mm_storeu_ps(vLanes, v);
+			_mm_storeu_ps(iwLanes, iw);
+			for (int k = 0; k < count; k++) {
+				codes[first + k] = (unsigned char)(packed >> (k * 8));
+				pp[first + k] = V3(uLanes[k], vLanes[k], iwLanes[k]);
+			}
+		}
+	}
 }
 
 /**
- * Rotate this mesh around the specified axis passing through the specified origin by the specified angle.
+ * Light all the vertices for Gouraud shading.
+ * Each vertex is shared by about six triangles, so lighting the vertices once in a parallel pass
+ * is much cheaper than lighting the three vertices of every triangle.
  *
- * @param axis		the specified axis
- * @param angle		the specified angle
- * @param orig		the specified origin
+ * @param vs		the vertices in the world space (NULL means the vertices of this mesh, if the model matrix is the identity)
  */
-void TMesh::RotateAbout(const V3 &axis, float angle, const V3 &orig) {
+void TMesh::LightVertices(const Vertex* vs) {
+	if (vs == NULL) vs = verts;
+
+	if (litVertsN != vertsN) {
+		if (litVerts != NULL) delete [] litVerts;
+		litVerts = new Vertex[vertsN];
+		litVertsN = vertsN;
+	}
+
+	#pragma omp parallel for
 	for (int i = 0; i < vertsN; i++) {
-		verts[i].v = verts[i].v.RotateAbout(axis, angle, orig);
+		litVerts[i] = vs[i];
+		litVerts[i].c = Scene::lights->GetColor(vs[i].v, vs[i].c, vs[i].n, vs[i].ao);
 	}
 }
 
 /**
- * Return the center of axis aligned bounding box of vertices.
+ * Compute the ambient occlusion of all the vertices, which scales the ambient term of the lighting.
+ * The rays are cast from each vertex over the cosine-weighted hemisphere of the normal, and the fraction of
+ * the rays that hit this mesh within AO_RADIUS is the occlusion. The rays are traced through the BVH. The vertices are processed in parallel.
+ * If the cache file is specified, the result is loaded from it if it matches this mesh, and otherwise
+ * the baked result is stored to it.
  *
- * @return		the center of axis aligned bounding box
+ * @param cacheFilename		the cache file (NULL if not cached)
  */
-V3 TMesh::GetCentroid() {
+void TMesh::BakeAmbientOcclusion(const char* cacheFilename) {
+	if (vertsN == 0) return;
+	if (cacheFilename != NULL && LoadAmbientOcclusion(cacheFilename)) return;
+
+	const BVH* tree = GetBVH();
 	AABB aabb;
-	ComputeAABB(aabb);
+	tree->GetBounds(aabb);
+	float diagonal = aabb.Size().Length();
+	float radius = diagonal * AO_RADIUS;
+	float offset = diagonal * AO_OFFSET;
 
-	return (aabb.maxCorner() + aabb.minCorner()) / 2.0f;
+	#pragma omp parallel for schedule(dynamic, 16)
+	for (int i = 0; i < vertsN; i++) {
+		float len = verts[i].n.Length();
+		if (len == 0.0f) {
+			verts[i].ao = 1.0f;
+			continue;
+		}
+
+		// the tangent frame of the normal
+		V3 n = verts[i].n / len;
+		V3 t = (fabsf(n.x()) < 0.9f ? V3(1.0f, 0.0f, 0.0f) : V3(0.0f, 1.0f, 0.0f)) ^ n;
+		t = t.UnitVector();
+		V3 b = n ^ t;
+
+		V3 orig = verts[i].v + n * offset;
+
+		// the Hammersley points are rotated per vertex, so that the vertices do not share the same banding
+		float rotation = (float)((i * 2654435761u) >> 8) / (float)(1 << 24);
+
+		int hits = 0;
+		for (int k = 0; k < AO_RAYS; k++) {
+			float u1 = (k + 0.5f) / AO_RAYS;
+			unsigned int bits = k;
+			bits = (bits << 16) | (bits >> 16);
+			bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+			bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+			bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+			bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+			float u2 = (float)bits / 4294967296.0f + rotation;
+			if (u2 >= 1.0f) u2 -= 1.0f;
+
+			float r = sqrtf(u1);
+			float phi = 2.0f * (float)M_PI * u2;
+			V3 dir = t * (r * cosf(phi)) + b * (r * sinf(phi)) + n * sqrtf(max(0.0f, 1.0f - u1));
+
+			if (tree->Intersects(orig, dir, radius)) hits++;
+		}
+
+		verts[i].ao = 1.0f - (float)hits / AO_RAYS;
+	}
+
+	version++;
+
+	if (cacheFilename != NULL) SaveAmbientOcclusion(cacheFilename);
 }
 
-bool TMesh::isInside2D(const V3 &p0, const V3 &p1, const V3 &p2, const V3 p) const {
-	float den = ((p1 - p0) ^ (p2 - p0)).z();
-	float s = ((p - p0) ^ (p2 - p0)).z() / den;
-	float t = ((p - p0) ^ (p1 - p0)).z() / den;
+/**
+ * Return the score of the vertex for the triangle reordering (Forsyth, "Linear-Speed Vertex Cache Optimisation").
+ * The vertices used by the last triangle get a fixed score, the others in the cache score higher the more recently
+ * they were used, and the vertices with fewer remaining triangles are boosted so that they are finished off early.
+ *
+ * @param cachePos		the position in the LRU cache (-1 if not in the cache)
+ * @param remaining		the number of the triangles not yet emitted that use the vertex
+ * @return				the score
+ */
+static float GetVertexScore(int cachePos, int remaining) {
+	if (remaining == 0) return -1.0f;
 
-	if (s < 0 || s > 1) return false;
-	if (t < 0 || t > 1) return false;
-	if (s + t > 1) return false;
-	return true;
+	float score = 0.0f;
+	if (cachePos >= 0) {
+		if (cachePos < 3) {
+			score = 0.75f;
+		} else {
+			score = powf(1.0f - (float)(cachePos - 3) / (FORSYTH_CACHE_SIZE - 3), 1.5f);
+		}
+	}
+
+	return score + 2.0f / sqrtf((float)remaining);
+}
+
+/**
+ * Reorder the triangles greedily by the score of their vertices in a simulated LRU cache (Forsyth).
+ *
+ * @param tris		the vertex indices of the triangles, which are rewritten in the new order
+ * @param trisN		the number of the triangles
+ * @param vertsN	the number of the vertices, i.e. the indices are less than this
+ */
+static void ReorderForVertexCache(unsigned int* tris, int trisN, int vertsN) {
+	// the triangles that use each vertex
+	vector<int> offsets(vertsN + 1, 0);
+	for (int i = 0; i < trisN * 3; i++) {
+		offsets[tris[i] + 1]++;
+	}
+	for (int i = 0; i < vertsN; i++) {
+		offsets[i + 1] += offsets[i];
+	}
+	vector<int> adjacency(trisN * 3);
+	vector<int> fill(offsets.begin(), offsets.end() - 1);
+	for (int i = 0; i < trisN * 3; i++) {
+		adjacency[fill[tris[i]]++] = i / 3;
+	}
+
+	vector<int> remaining(vertsN);
+	vector<int> cachePos(vertsN, -1);
+	vector<float> vertexScores(vertsN);
+	for (int i = 0; i < vertsN; i++) {
+		remaining[i] = offsets[i + 1] - offsets[i];
+		vertexScores[i] = GetVertexScore(-1, remaining[i]);
+	}
+
+	vector<float> triScores(trisN);
+	vector<bool> emitted(trisN, false);
+	for (int i = 0; i < trisN; i++) {
+		triScores[i] = vertexScores[tris[i * 3]] + vertexScores[tris[i * 3 + 1]] + vertexScores[tris[i * 3 + 2]];
+	}
+
+	vector<unsigned int> newTris(trisN * 3);
+	vector<int> cache;
+	cache.reserve(FORSYTH_CACHE_SIZE + 3);
+
+	int best = 0;
+	for (int i = 1; i < trisN; i++) {
+		if (triScores[i] > triScores[best]) best = i;
+	}
+	int next = 0;
+
+	for (int k = 0; k < trisN; k++) {
+		// if no triangle in the cache is available, take the next one that has not been emitted
+		if (best < 0) {
+			while (emitted[next]) next++;
+			best = next;
+		}
+
+		emitted[best] = true;
+		for (int j = 0; j < 3; j++) {
+			int v = tris[best * 3 + j];
+			newTris[k * 3 + j] = v;
+			remaining[v]--;
+
+			// move the vertex to the front of the cache
+			vector<int>::iterator it = find(cache.begin(), cache.end(), v);
+			if (it != cache.end()) cache.erase(it);
+			cache.insert(cache.begin(), v);
+		}
+
+		// the vertices pushed out of the cache lose their cache score
+		while ((int)cache.size() > FORSYTH_CACHE_SIZE) {
+			int v = cache.back();
+			cache.pop_back();
+			cachePos[v] = -1;
+			vertexScores[v] = GetVertexScore(-1, remaining[v]);
+			for (int j = offsets[v]; j < offsets[v + 1]; j++) {
+				int t = adjacency[j];
+				if (!emitted[t]) triScores[t] = vertexScores[tris[t * 3]] + vertexScores[tris[t * 3 + 1]] + vertexScores[tris[t * 3 + 2]];
+			}
+		}
+
+		for (int i = 0; i < (int)cache.size(); i++) {
+			cachePos[cache[i]] = i;
+			vertexScores[cache[i]] = GetVertexScore(i, remaining[cache[i]]);
+		}
+
+		// the next triangle is the best one that uses a vertex in the cache
+		best = -1;
+		float bestScore = -1.0f;
+		for (int i = 0; i < (int)cache.size(); i++) {
+			int v = cache[i];
+			for (int j = offsets[v]; j < offsets[v + 1]; j++) {
+				int t = adjacency[j];
+				if (emitted[t]) continue;
+				triScores[t] = vertexScores[tris[t * 3]] + vertexScores[tris[t * 3 + 1]] + vertexScores[tris[t * 3 + 2]];
+				if (triScores[t] > bestScore) {
+					bestScore = triScores[t];
+					best = t;
+				}
+			}
+		}
+	}
+
+	copy(newTris.begin(), newTris.end(), tris);
 }
 
-bool TMesh::SetTexture(const char* filename) {
-	texture = new Texture(filename);
+/**
+ * Reorder the triangles for the locality of the vertex cache, and then renumber the vertices in the order
+ * of their first use, so that the vertices are also accessed nearly sequentially.
+ * The triangles are emitted greedily by the score of their vertices in a simulated LRU cache (Forsyth).
+ * If the new order does not lower the average cache miss ratio, the original order is kept.
+ * The rendered image does not change except for the order in which the triangles at the same depth are drawn.
+ */
+void TMesh::OptimizeVertexCache() {
+	if (trisN == 0) return;
+
+	// the triangles are rewritten in place in 32 bits, and the clusters of the old order are dropped
+	UnpackIndices();
+	meshlets.clear();
+	float before = GetACMR();
+
+	vector<unsigned int> oldTris(tris, tris + trisN * 3);
+	ReorderForVertexCache(tris, trisN, vertsN);
+
+	// keep the original order if it is already better
+	float after = GetACMR();
+	if (after >= before) {
+		copy(oldTris.begin(), oldTris.end(), tris);
+		PackIndices();
+		cerr << "INFO: ACMR " << before << " is kept (" << trisN << " tris)" << endl;
+		return;
+	}
+
+	RenumberVertices();
+	PackIndices();
+
+	// the triangles of the tree are stale
+	if (bvh != NULL) {
+		delete bvh;
+		bvh = NULL;
+	}
+	version++;
+
+	cerr << "INFO: ACMR " << before << " -> " << after << " (" << trisN << " tris)" << endl;
+}
+
+/**
+ * Renumber the vertices in the order of their first use by the unpacked triangles,
+ * so that the vertices are accessed nearly sequentially. The unused vertices are moved to the end.
+ */
+void TMesh::RenumberVertices() {
+	vector<int> newIndices(vertsN, -1);
+	Vertex* newVerts = new Vertex[vertsN];
+	int count = 0;
+	for (int i = 0; i < trisN * 3; i++) {
+		int v = tris[i];
+		if (newIndices[v] < 0) {
+			newIndices[v] = count;
+			newVerts[count++] = verts[v];
+		}
+		tris[i] = newIndices[v];
+	}
+	for (int i = 0; i < vertsN; i++) {
+		if (newIndices[i] < 0) newVerts[count++] = verts[i];
+	}
+
+	delete [] verts;
+	verts = newVerts;
+}
+
+/**
+ * Return the average cache miss ratio, i.e. the number of vertices transformed per triangle,
+ * when the triangles are drawn in the current order through a FIFO vertex cache.
+ *
+ * @param cacheSize		the number of the entries of the cache
+ * @return				the average cache miss ratio (0.5 is ideal for a large regular mesh, 3 is the worst)
+ */
+float TMesh::GetACMR(int cacheSize) const {
+	if (trisN == 0) return 0.0f;
+
+	vector<int> fifo(cacheSize, -1);
+	int head = 0;
+	int misses = 0;
+	for (int i = 0; i < trisN * 3; i++) {
+		int v = FetchIndex(tris, tris16, i);
+		if (find(fifo.begin(), fifo.end(), v) != fifo.end()) continue;
+
+		fifo[head] = v;
+		head = (head + 1) % cacheSize;
+		misses++;
+	}
+
+	return (float)misses / trisN;
+}
+
+/**
+ * Compute the cost of collapsing the edge (u, v) and the point that the edge is collapsed to.
+ */
+static EdgeCollapse MakeCollapse(const vector<Vertex> &vs, const vector<double> &quadrics, const vector<unsigned int> &stamps, int u, int v) {
+	double q[10];
+	for (int k = 0; k < 10; k++) {
+		q[k] = quadrics[u * 10 + k] + quadrics[v * 10 + k];
+	}
+
+	EdgeCollapse c;
+	c.u = u;
+	c.v = v;
+	c.stampU = stamps[u];
+	c.stampV = stamps[v];
+
+	// the minimizer of the quadric, if the system is well conditioned
+	double det = q[0] * (q[4] * q[7] - q[5] * q[5]) - q[1] * (q[1] * q[7] - q[5] * q[2]) + q[2] * (q[1] * q[5] - q[4] * q[2]);
+	double scale = fabs(q[0]) + fabs(q[4]) + fabs(q[7]);
+	if (fabs(det) > 1e-9 * scale * scale * scale && scale > 0.0) {
+		double x = (-q[3] * (q[4] * q[7] - q[5] * q[5]) + q[1] * (q[6] * q[7] - q[5] * q[8]) - q[2] * (q[6] * q[5] - q[4] * q[8])) / det;
+		double y = (-q[0] * (q[6] * q[7] - q[8] * q[5]) + q[3] * (q[1] * q[7] - q[5] * q[2]) - q[2] * (q[1] * q[8] - q[6] * q[2])) / det;
+		double z = (-q[0] * (q[4] * q[8] - q[5] * q[6]) + q[1] * (q[1] * q[8] - q[6] * q[2]) - q[3] * (q[1] * q[5] - q[4] * q[2])) / det;
+		c.p = V3((float)x, (float)y, (float)z);
+
+		// the minimizer far from the edge is not trusted
+		V3 mid = (vs[u].v + vs[v].v) / 2.0f;
+		if ((c.p - mid).Length() <= (vs[u].v - vs[v].v).Length() * 2.0f) {
+			c.cost = EvaluateQuadric(q, x, y, z);
+			return c;
+		}
+	}
+
+	// otherwise the best of the end points and the midpoint
+	V3 points[3] = { vs[u].v, vs[v].v, (vs[u].v + vs[v].v) / 2.0f };
+	c.cost = -1.0;
+	for (int k = 0; k < 3; k++) {
+		double cost = EvaluateQuadric(q, points[k].x(), points[k].y(), points[k].z());
+		if (c.cost < 0.0 || cost < c.cost) {
+			c.cost = cost;
+			c.p = points[k];
+		}
+	}
+	return c;
+}
+
+/**
+ * Build the chain of the levels of detail, each of which is simplified from the previous one
+ * to a quarter of its triangles. The chain stops when the level would have less than LOD_MIN_TRIS triangles.
+ * The textured meshes are not simplified, since the texture coordinates at the seams would be lost.
+ *
+ * @param levelsN		the maximum number of the simplified levels
+ */
+void TMesh::BuildLODs(int levelsN) {
+	for (int i = 0; i < (int)lods.size(); i++) {
+		delete lods[i];
+	}
+	lods.clear();
+	if (texture != NULL || texturePending) return;
+
+	TMesh* prev = this;
+	for (int i = 0; i < levelsN; i++) {
+		int target = prev->trisN / 4;
+		if (target < LOD_MIN_TRIS) break;
+
+		TMesh* lod = prev->Simplify(target);
+		lod->OptimizeVertexCache();
+		if (!meshlets.empty()) lod->BuildMeshlets();
+		lod->model = model;
+		lods.push_back(lod);
+		prev = lod;
+	}
+	version++;
+}
+
+/**
+ * Simplify this mesh by the quadric error metric edge collapses (Garland and Heckbert).
+ * Each vertex accumulates the quadrics of the planes of its triangles, and the boundary edges add
+ * perpendicular planes so that the silhouette of an open mesh is preserved. The cheapest edge is collapsed
+ * to the point that minimizes the sum of the quadrics of its end points, unless the collapse flips a triangle.
+ * The attributes of the collapsed vertex are interpolated along the edge.
+ *
+ * @param targetTrisN	the number of the triangles to be reached
+ * @return				the simplified mesh
+ */
+TMesh* TMesh::Simplify(int targetTrisN) const {
+	vector<Vertex> vs(verts, verts + vertsN);
+	vector<unsigned int> ts(trisN * 3);
+	for (int i = 0; i < trisN * 3; i++) {
+		ts[i] = FetchIndex(tris, tris16, i);
+	}
+	vector<bool> triAlive(trisN, true);
+	vector<bool> vertAlive(vertsN, true);
+	vector<unsigned int> stamps(vertsN, 0);
+	vector<vector<int> > vertTris(vertsN);
+	vector<double> quadrics(vertsN * 10, 0.0);
+	int aliveN = trisN;
+
+	// the quadrics of the triangle planes weighted by the area
+	for (int i = 0; i < trisN; i++) {
+		const V3 &p0 = vs[ts[i * 3]].v;
+		V3 n = (vs[ts[i * 3 + 1]].v - p0) ^ (vs[ts[i * 3 + 2]].v - p0);
+		float len = n.Length();
+		for (int j = 0; j < 3; j++) {
+			vertTris[ts[i * 3 + j]].push_back(i);
+		}
+		if (!(len > 0.0f)) continue;
+
+		n = n / len;
+		for (int j = 0; j < 3; j++) {
+			AddPlaneQuadric(&quadrics[ts[i * 3 + j] * 10], n.x(), n.y(), n.z(), -(n * p0), len * 0.5);
+		}
+	}
+
+	// the edges, where the boundary edges appear only once
+	vector<pair<unsigned int, unsigned int> > edges;
+	for (int i = 0; i < trisN; i++) {
+		for (int j = 0; j < 3; j++) {
+			unsigned int a = ts[i * 3 + j];
+			unsigned int b = ts[i * 3 + (j + 1) % 3];
+			edges.push_back(make_pair(min(a, b), max(a, b)));
+		}
+	}
+	sort(edges.begin(), edges.end());
+
+	for (int i = 0; i < trisN; i++) {
+		const V3 &p0 = vs[ts[i * 3]].v;
+		V3 n = ((vs[ts[i * 3 + 1]].v - p0) ^ (vs[ts[i * 3 + 2]].v - p0));
+		if (!(n.Length() > 0.0f)) continue;
+		n = n.UnitVector();
+
+		for (int j = 0; j < 3; j++) {
+			unsigned int a = ts[i * 3 + j];
+			unsigned int b = ts[i * 3 + (j + 1) % 3];
+			pair<unsigned int, unsigned int> e = make_pair(min(a, b), max(a, b));
+			vector<pair<unsigned int, unsigned int> >::iterator it = lower_bound(edges.begin(), edges.end(), e);
+			if (it + 1 != edges.end() && *(it + 1) == e) continue;
+
+			V3 d = vs[b].v - vs[a].v;
+			V3 m = d ^ n;
+			float len = m.Length();
+			if (!(len > 0.0f)) continue;
+			m = m / len;
+			double weight = QEM_BOUNDARY_WEIGHT * (d * d);
+			AddPlaneQuadric(&quadrics[a * 10], m.x(), m.y(), m.z(), -(m * vs[a].v), weight);
+			AddPlaneQuadric(&quadrics[b * 10], m.x(), m.y(), m.z(), -(m * vs[a].v), weight);
+		}
+	}
+	edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+	priority_queue<EdgeCollapse, vector<EdgeCollapse>, CollapseGreater> heap;
+	for (int i = 0; i < (int)edges.size(); i++) {
+		if (edges[i].first == edges[i].second) continue;
+		heap.push(MakeCollapse(vs, quadrics, stamps, edges[i].first, edges[i].second));
+	}
+
+	while (aliveN > targetTrisN && !heap.empty()) {
+		EdgeCollapse c = heap.top();
+		heap.pop();
+		int u = c.u;
+		int v = c.v;
+		if (!vertAlive[u] || !vertAlive[v] || stamps[u] != c.stampU || stamps[v] != c.stampV) continue;
+		if (!(c.cost == c.cost)) continue;
+
+		// reject the collapse that flips a triangle that survives it
+		bool flips = false;
+		for (int k = 0; k < 2 && !flips; k++) {
+			int w = k == 0 ? u : v;
+			for (int j = 0; j < (int)vertTris[w].size() && !flips; j++) {
+				int t = vertTris[w][j];
+				if (!triAlive[t]) continue;
+				unsigned int* tri = &ts[t * 3];
+				bool hasU = tri[0] == u || tri[1] == u || tri[2] == u;
+				bool hasV = tri[0] == v || tri[1] == v || tri[2] == v;
+				if (hasU && hasV) continue;
+
+				V3 p[3];
+				for (int m = 0; m < 3; m++) {
+					p[m] = (int)tri[m] == w ? c.p : vs[tri[m]].v;
+				}
+				V3 before = (vs[tri[1]].v - vs[tri[0]].v) ^ (vs[tri[2]].v - vs[tri[0]].v);
+				V3 after = (p[1] - p[0]) ^ (p[2] - p[0]);
+				if (before * after <= 0.0f) flips = true;
+			}
+		}
+		if (flips) continue;
+
+		// move u to the new point with the interpolated attributes, and remove v
+		V3 e = vs[v].v - vs[u].v;
+		float alpha = e * e > 0.0f ? (c.p - vs[u].v) * e / (e * e) : 0.5f;
+		alpha = min(max(alpha, 0.0f), 1.0f);
+		Vertex &a = vs[u];
+		const Vertex &b = vs[v];
+		a.v = c.p;
+		a.c = a.c * (1.0f - alpha) + b.c * alpha;
+		V3 n = a.n * (1.0f - alpha) + b.n * alpha;
+		if (n.Length() > 0.0f) a.n = n.UnitVector();
+		a.t[0] = a.t[0] * (1.0f - alpha) + b.t[0] * alpha;
+		a.t[1] = a.t[1] * (1.0f - alpha) + b.t[1] * alpha;
+		a.ao = a.ao * (1.0f - alpha) + b.ao * alpha;
+		for (int k = 0; k < 10; k++) {
+			quadrics[u * 10 + k] += quadrics[v * 10 + k];
+		}
+		vertAlive[v] = false;
+		stamps[u]++;
+
+		for (int j = 0; j < (int)vertTris[v].size(); j++) {
+			int t = vertTris[v][j];
+			if (!triAlive[t]) continue;
+			unsigned int* tri = &ts[t * 3];
+			for (int m = 0; m < 3; m++) {
+				if ((int)tri[m] == v) tri[m] = u;
+			}
+			if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0]) {
+				triAlive[t] = false;
+				aliveN--;
+			} else {
+				vertTris[u].push_back(t);
+			}
+		}
+
+		// the edges around u have new costs
+		vector<int> neighbors;
+		for (int j = 0; j < (int)vertTris[u].size(); j++) {
+			int t = vertTris[u][j];
+			if (!triAlive[t]) continue;
+			for (int m = 0; m < 3; m++) {
+				int w = ts[t * 3 + m];
+				if (w != u) neighbors.push_back(w);
+			}
+		}
+		sort(neighbors.begin(), neighbors.end());
+		neighbors.erase(unique(neighbors.begin(), neighbors.end()), neighbors.end());
+		for (int j = 0; j < (int)neighbors.size(); j++) {
+			heap.push(MakeCollapse(vs, quadrics, stamps, u, neighbors[j]));
+		}
+	}
+
+	// compact the surviving vertices and triangles
+	TMesh* ret = new TMesh();
+	vector<int> newIndices(vertsN, -1);
+	ret->verts = new Vertex[vertsN];
+	for (int i = 0; i < trisN; i++) {
+		if (!triAlive[i]) continue;
+		for (int j = 0; j < 3; j++) {
+			int w = ts[i * 3 + j];
+			if (newIndices[w] < 0) {
+				newIndices[w] = ret->vertsN;
+				ret->verts[ret->vertsN++] = vs[w];
+			}
+		}
+	}
+	ret->tris = new unsigned int[aliveN * 3];
+	for (int i = 0; i < trisN; i++) {
+		if (!triAlive[i]) continue;
+		for (int j = 0; j < 3; j++) {
+			ret->tris[ret->trisN * 3 + j] = newIndices[ts[i * 3 + j]];
+		}
+		ret->trisN++;
+	}
+	ret->PackIndices();
+
+	return ret;
+}
+
+/**
+ * Choose the level of detail by the size of this mesh on the screen.
+ * The finest level whose triangles cover LOD_PIXELS_PER_TRI pixels on average is chosen,
+ * where the projected area is estimated by the bounding sphere of the AABB.
+ *
+ * @param ppc		the camera
+ * @return			the level (0 is this mesh)
+ */
+int TMesh::SelectLOD(PPC *ppc) {
+	if (lods.empty()) return 0;
+
+	AABB aabb;
+	ComputeAABB(aabb);
+	return SelectLOD(ppc, aabb);
+}
+
+/**
+ * Choose the level of detail for this mesh placed in the specified bounding box, e.g. by an instance.
+ *
+ * @param ppc		the camera
+ * @param aabb		the bounding box in the world space
+ * @return			the level (0 is this mesh)
+ */
+int TMesh::SelectLOD(PPC *ppc, const AABB &aabb) {
+	if (lods.empty()) return 0;
+
+	V3 center = (aabb.minCorner() + aabb.maxCorner()) / 2.0f;
+	float radius = aabb.Size().Length() / 2.0f;
+	float dist = (center - ppc->C).Length();
+	if (dist <= radius) return 0;
+
+	// the size of a pixel is 1 at the focal length
+	float pixelRadius = radius * ppc->GetFocalLength() / ppc->a.Length() / dist;
+	float maxTrisN = (float)M_PI * pixelRadius * pixelRadius / LOD_PIXELS_PER_TRI;
+
+	for (int level = 0; level < (int)lods.size(); level++) {
+		if (GetLOD(level)->trisN <= maxTrisN) return level;
+	}
+	return (int)lods.size();
+}
+
+/**
+ * Return the level of detail.
+ *
+ * @param level		the level (0 is this mesh)
+ * @return			the mesh of the level
+ */
+TMesh* TMesh::GetLOD(int level) {
+	if (level <= 0 || lods.empty()) return this;
+	return lods[min(level, (int)lods.size()) - 1];
+}
+
+/**
+ * Return the number of the simplified levels.
+ */
+int TMesh::GetLODsN() const {
+	return (int)lods.size();
+}
+
+/**
+ * Split the triangles into meshlets of up to MESHLET_MAX_TRIS triangles and MESHLET_MAX_VERTS vertices,
+ * and reorder the triangles so that each meshlet is a contiguous range, which is then reordered for the vertex cache.
+ * A meshlet is grown from a seed triangle by adding the neighbor that adds the fewest vertices and is the closest
+ * to the average normal, so that the normal cone is narrow. Each meshlet has a bounding sphere, which is culled
+ * by the view frustum, and the cone of its normals, which is culled when all the triangles face away.
+ * The culling by the cones is enabled only if the mesh is closed, since the back faces are drawn otherwise.
+ */
+void TMesh::BuildMeshlets() {
+	meshlets.clear();
+	if (trisN == 0) return;
+
+	backFaceCulling = IsClosed();
+	UnpackIndices();
+
+	// the orientation of the triangles is told by the signed volume of a closed mesh, and by the normals
+	// of the vertices otherwise
+	AABB aabb;
+	ComputeAABB(aabb, M34());
+	V3 o = (aabb.minCorner() + aabb.maxCorner()) / 2.0f;
+	double volume = 0.0;
+	double agreement = 0.0;
+	vector<V3> normals(trisN);
+	for (int i = 0; i < trisN; i++) {
+		const Vertex &v0 = verts[tris[i * 3]];
+		const Vertex &v1 = verts[tris[i * 3 + 1]];
+		const Vertex &v2 = verts[tris[i * 3 + 2]];
+		normals[i] = (v1.v - v0.v) ^ (v2.v - v0.v);
+		volume += (v0.v - o) * ((v1.v - o) ^ (v2.v - o));
+		agreement += normals[i] * (v0.n + v1.n + v2.n);
+	}
+	float orientation = (backFaceCulling ? volume : agreement) < 0.0 ? -1.0f : 1.0f;
+	for (int i = 0; i < trisN; i++) {
+		float len = normals[i].Length();
+		normals[i] = len > 0.0f ? normals[i] * (orientation / len) : V3(0.0f, 0.0f, 0.0f);
+	}
+
+	// the triangles that use each vertex
+	vector<int> offsets(vertsN + 1, 0);
+	for (int i = 0; i < trisN * 3; i++) {
+		offsets[tris[i] + 1]++;
+	}
+	for (int i = 0; i < vertsN; i++) {
+		offsets[i + 1] += offsets[i];
+	}
+	vector<int> adjacency(trisN * 3);
+	vector<int> fill(offsets.begin(), offsets.end() - 1);
+	for (int i = 0; i < trisN * 3; i++) {
+		adjacency[fill[tris[i]]++] = i / 3;
+	}
+
+	vector<bool> used(trisN, false);
+	vector<int> vertexMark(vertsN, -1);
+	vector<int> candidateMark(trisN, -1);
+	vector<int> candidates;
+	vector<unsigned int> newTris;
+	newTris.reserve(trisN * 3);
+
+	// the old index of each triangle in the new order
+	vector<int> order;
+	order.reserve(trisN);
+
+	int next = 0;
+	while (true) {
+		while (next < trisN && used[next]) next++;
+		if (next == trisN) break;
+
+		int id = (int)meshlets.size();
+		Meshlet meshlet;
+		meshlet.firstTri = (int)newTris.size() / 3;
+		meshlet.trisN = 0;
+		int meshletVertsN = 0;
+		V3 normalSum(0.0f, 0.0f, 0.0f);
+		candidates.clear();
+
+		int t = next;
+		while (t >= 0) {
+			used[t] = true;
+			order.push_back(t);
+			meshlet.trisN++;
+			normalSum += normals[t];
+			for (int j = 0; j < 3; j++) {
+				int v = tris[t * 3 + j];
+				newTris.push_back(v);
+				if (vertexMark[v] == id) continue;
+
+				vertexMark[v] = id;
+				meshletVertsN++;
+				for (int k = offsets[v]; k < offsets[v + 1]; k++) {
+					int c = adjacency[k];
+					if (used[c] || candidateMark[c] == id) continue;
+					candidateMark[c] = id;
+					candidates.push_back(c);
+				}
+			}
+			if (meshlet.trisN == MESHLET_MAX_TRIS) break;
+
+			// the next triangle adds the fewest vertices, and then is the closest to the average normal
+			float len = normalSum.Length();
+			V3 axis = len > 0.0f ? normalSum / len : V3(0.0f, 0.0f, 0.0f);
+			t = -1;
+			float bestScore = -numeric_limits<float>::max();
+			int kept = 0;
+			for (int k = 0; k < (int)candidates.size(); k++) {
+				int c = candidates[k];
+				if (used[c]) continue;
+				candidates[kept++] = c;
+
+				int newVertsN = 0;
+				for (int j = 0; j < 3; j++) {
+					if (vertexMark[tris[c * 3 + j]] != id) newVertsN++;
+				}
+				if (meshletVertsN + newVertsN > MESHLET_MAX_VERTS) continue;
+
+				float score = normals[c] * axis - (float)newVertsN * MESHLET_VERTEX_WEIGHT;
+				if (score > bestScore) {
+					bestScore = score;
+					t = c;
+				}
+			}
+			candidates.resize(kept);
+		}
+
+		meshlets.push_back(meshlet);
+	}
+	copy(newTris.begin(), newTris.end(), tris);
+
+	// the bounding spheres and the normal cones
+	for (int m = 0; m < (int)meshlets.size(); m++) {
+		Meshlet &meshlet = meshlets[m];
+		int first = meshlet.firstTri * 3;
+		int last = (meshlet.firstTri + meshlet.trisN) * 3;
+
+		AABB box;
+		for (int i = first; i < last; i++) {
+			box.AddPoint(verts[tris[i]].v);
+		}
+		meshlet.center = (box.minCorner() + box.maxCorner()) / 2.0f;
+		meshlet.radius = 0.0f;
+		for (int i = first; i < last; i++) {
+			meshlet.radius = max(meshlet.radius, (verts[tris[i]].v - meshlet.center).Length());
+		}
+
+		// the degenerate triangles, whose normals are zero, are not drawn, so they do not widen the cone
+		V3 normalSum(0.0f, 0.0f, 0.0f);
+		for (int i = meshlet.firstTri; i < meshlet.firstTri + meshlet.trisN; i++) {
+			normalSum += normals[order[i]];
+		}
+		meshlet.coneAxis = V3(0.0f, 0.0f, 0.0f);
+		meshlet.coneCos = 0.0f;
+		meshlet.coneSin = 1.0f;
+		float len = normalSum.Length();
+		if (len == 0.0f) continue;
+
+		meshlet.coneAxis = normalSum / len;
+		float minCos = 1.0f;
+		for (int i = meshlet.firstTri; i < meshlet.firstTri + meshlet.trisN; i++) {
+			const V3 &n = normals[order[i]];
+			if (n.Length() == 0.0f) continue;
+			minCos = min(minCos, n * meshlet.coneAxis);
+		}
+		minCos -= MESHLET_CONE_MARGIN;
+		if (minCos <= 0.0f) continue;
+
+		meshlet.coneCos = minCos;
+		meshlet.coneSin = sqrtf(1.0f - minCos * minCos);
+	}
+
+	// the growth order scatters the vertices, so the triangles of each meshlet are reordered for the vertex cache
+	// on the local indices of its vertices, and the vertices are renumbered in the order of their first use
+	vector<int> localIndices(vertsN, -1);
+	vector<unsigned int> globalIndices;
+	for (int m = 0; m < (int)meshlets.size(); m++) {
+		unsigned int* meshletTris = &tris[meshlets[m].firstTri * 3];
+		int meshletIndicesN = meshlets[m].trisN * 3;
+		globalIndices.clear();
+		for (int i = 0; i < meshletIndicesN; i++) {
+			unsigned int v = meshletTris[i];
+			if (localIndices[v] < 0) {
+				localIndices[v] = (int)globalIndices.size();
+				globalIndices.push_back(v);
+			}
+			meshletTris[i] = localIndices[v];
+		}
+
+		ReorderForVertexCache(meshletTris, meshlets[m].trisN, (int)globalIndices.size());
+
+		for (int i = 0; i < meshletIndicesN; i++) {
+			meshletTris[i] = globalIndices[meshletTris[i]];
+		}
+		for (int i = 0; i < (int)globalIndices.size(); i++) {
+			localIndices[globalIndices[i]] = -1;
+		}
+	}
+	RenumberVertices();
+
+	PackIndices();
+
+	// the triangles of the tree are stale
+	if (bvh != NULL) {
+		delete bvh;
+		bvh = NULL;
+	}
+	version++;
+}
+
+/**
+ * Return the number of the meshlets (0 unless BuildMeshlets() is called).
+ */
+int TMesh::GetMeshletsN() const {
+	return (int)meshlets.size();
+}
+
+/**
+ * Enable or disable the culling of the meshlets facing away from the camera, including the levels of detail.
+ * BuildMeshlets() enables it only for a closed mesh, but it can also be enabled for a nearly closed one, e.g. a scan
+ * with small holes, at the cost of missing the back faces seen through the holes.
+ *
+ * @param backFaceCulling	true if the meshlets facing away are culled
+ */
+void TMesh::SetBackFaceCulling(bool backFaceCulling) {
+	this->backFaceCulling = backFaceCulling;
+	for (int i = 0; i < (int)lods.size(); i++) {
+		lods[i]->SetBackFaceCulling(backFaceCulling);
+	}
+	version++;
+}
+
+/**
+ * Return true if this mesh is closed and consistently oriented, i.e. each edge is shared by exactly two triangles
+ * in the opposite directions, so that the triangles facing away are always hidden by the others.
+ * The vertices at the same position, e.g. on the seams of the texture coordinates, are welded first,
+ * and the triangles that become degenerate are ignored.
+ *
+ * @return		true if this mesh is closed
+ */
+bool TMesh::IsClosed() const {
+	if (trisN == 0) return false;
+
+	// weld the vertices on a fine grid
+	AABB aabb;
+	for (int i = 0; i < vertsN; i++) {
+		aabb.AddPoint(verts[i].v);
+	}
+	float cell = aabb.Size().Length() * WELD_EPSILON;
+	if (!(cell > 0.0f)) return false;
+
+	vector<pair<pair<int, int>, pair<int, int> > > keys(vertsN);
+	for (int i = 0; i < vertsN; i++) {
+		V3 q = (verts[i].v - aabb.minCorner()) / cell;
+		keys[i] = make_pair(make_pair((int)floorf(q.x() + 0.5f), (int)floorf(q.y() + 0.5f)), make_pair((int)floorf(q.z() + 0.5f), i));
+	}
+	sort(keys.begin(), keys.end());
+	vector<unsigned int> welded(vertsN);
+	unsigned int id = 0;
+	for (int i = 0; i < vertsN; i++) {
+		if (i > 0 && (keys[i].first != keys[i - 1].first || keys[i].second.first != keys[i - 1].second.first)) id++;
+		welded[keys[i].second.second] = id;
+	}
+
+	// each directed edge has to appear once, and so does the reverse one
+	vector<unsigned long long> edges;
+	edges.reserve(trisN * 3);
+	for (int i = 0; i < trisN; i++) {
+		unsigned int w[3];
+		for (int j = 0; j < 3; j++) {
+			w[j] = welded[FetchIndex(tris, tris16, i * 3 + j)];
+		}
+		if (w[0] == w[1] || w[1] == w[2] || w[2] == w[0]) continue;
+		for (int j = 0; j < 3; j++) {
+			edges.push_back(((unsigned long long)w[j] << 32) | w[(j + 1) % 3]);
+		}
+	}
+	if (edges.empty()) return false;
+
+	sort(edges.begin(), edges.end());
+	for (int i = 0; i < (int)edges.size(); i++) {
+		if (i > 0 && edges[i] == edges[i - 1]) return false;
+		unsigned long long reverse = (edges[i] << 32) | (edges[i] >> 32);
+		if (!binary_search(edges.begin(), edges.end(), reverse)) return false;
+	}
+
+	return true;
+}
+
+/**
+ * Find the ranges of the triangles to be drawn after culling the meshlets.
+ * The camera and the planes of the frustum are brought to the object space, where the meshlets are defined.
+ * A meshlet is culled if its bounding sphere is outside a plane of the frustum, or if the back face culling is
+ * enabled and every direction from the camera to the sphere is within 90 degrees minus the half angle of the cone
+ * from the axis, so that every triangle faces away.
+ *
+ * @param ppc				the camera
+ * @param transform			the transformation from the object space to the world space
+ * @param insideFrustum		true if the whole mesh is known to be inside the view frustum
+ * @param ranges			the first triangle and the number of the triangles of each range
+ * @param culledN			the number of the culled meshlets
+ * @param culledTrisN		the number of the triangles in the culled meshlets
+ */
+void TMesh::CullMeshlets(PPC *ppc, const M34 &transform, bool insideFrustum, vector<int> &ranges, int &culledN, int &culledTrisN) const {
+	culledN = 0;
+	culledTrisN = 0;
+	ranges.clear();
+	if (meshlets.empty()) {
+		ranges.push_back(0);
+		ranges.push_back(trisN);
+		return;
+	}
+
+	// a plane n * p + d >= 0 in the world space is (L^T n) * q + (n * t + d) >= 0 for p = L q + t
+	M33 linearT = transform.GetLinear();
+	linearT = linearT.Transpose();
+	const V3 &t = transform.GetTranslation();
+	Frustum frustum = ppc->GetFrustum();
+	for (int i = 0; i < 5; i++) {
+		V3 n = linearT * frustum.normals[i];
+		float len = n.Length();
+		frustum.ds[i] = (frustum.normals[i] * t + frustum.ds[i]) / len;
+		frustum.normals[i] = n / len;
+	}
+	V3 eye = transform.Inverted().TransformPoint(ppc->C);
+
+	for (int m = 0; m < (int)meshlets.size(); m++) {
+		const Meshlet &meshlet = meshlets[m];
+
+		bool culled = false;
+		if (!insideFrustum) {
+			for (int i = 0; i < 5 && !culled; i++) {
+				if (frustum.normals[i] * meshlet.center + frustum.ds[i] < -meshlet.radius) culled = true;
+			}
+		}
+
+		// sin(theta + phi) for the half angle theta of the cone and the angular radius phi of the sphere
+		if (!culled && backFaceCulling && meshlet.coneCos > 0.0f) {
+			V3 d = meshlet.center - eye;
+			float dist = d.Length();
+			if (dist > meshlet.radius) {
+				float sinPhi = meshlet.radius / dist;
+				float cosPhi = sqrtf(1.0f - sinPhi * sinPhi);
+				if (meshlet.coneCos * cosPhi - meshlet.coneSin * sinPhi > 0.0f) {
+					culled = meshlet.coneAxis * d >= (meshlet.coneSin * cosPhi + meshlet.coneCos * sinPhi) * dist;
+				}
+			}
+		}
+
+		if (culled) {
+			culledN++;
+			culledTrisN += meshlet.trisN;
+		} else if (!ranges.empty() && ranges[ranges.size() - 2] + ranges[ranges.size() - 1] == meshlet.firstTri) {
+			ranges[ranges.size() - 1] += meshlet.trisN;
+		} else {
+			ranges.push_back(meshlet.firstTri);
+			ranges.push_back(meshlet.trisN);
+		}
+	}
+}
+
+/**
+ * Load the ambient occlusion of the vertices from the cache file.
+ * The file has the numbers of the vertices and the triangles and the hash of the triangles, followed by
+ * the ambient occlusion of each vertex. The hash rejects the cache of the same mesh with a different vertex order.
+ *
+ * @param filename		the cache file
+ * @return				true if the cache matches this mesh and is loaded
+ */
+bool TMesh::LoadAmbientOcclusion(const char* filename) {
+	ifstream ifs(filename, ios::binary);
+	if (ifs.fail()) return false;
+
+	unsigned int n[3];
+	ifs.read((char*)n, 3 * sizeof(unsigned int));
+	if (ifs.fail() || n[0] != (unsigned int)vertsN || n[1] != (unsigned int)trisN || n[2] != GetTopologyHash()) return false;
+
+	float* ao = new float[vertsN];
+	ifs.read((char*)ao, vertsN * sizeof(float));
+	bool loaded = !ifs.fail();
+	if (loaded) {
+		for (int i = 0; i < vertsN; i++) {
+			verts[i].ao = ao[i];
+		}
+		version++;
+	}
+	delete [] ao;
+
+	return loaded;
+}
+
+/**
+ * Return the FNV-1a hash of the vertex indices of the triangles.
+ */
+unsigned int TMesh::GetTopologyHash() const {
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < trisN * 3; i++) {
+		hash = (hash ^ FetchIndex(tris, tris16, i)) * 16777619u;
+	}
+
+	return hash;
+}
+
+/**
+ * Store the ambient occlusion of the vertices to the cache file.
+ *
+ * @param filename		the cache file
+ */
+void TMesh::SaveAmbientOcclusion(const char* filename) const {
+	ofstream ofs(filename, ios::binary);
+	if (ofs.fail()) {
+		cerr << "INFO: cannot write file: " << filename << endl;
+		return;
+	}
+
+	unsigned int n[3] = { (unsigned int)vertsN, (unsigned int)trisN, GetTopologyHash() };
+	ofs.write((const char*)n, 3 * sizeof(unsigned int));
+	for (int i = 0; i < vertsN; i++) {
+		ofs.write((const char*)&verts[i].ao, sizeof(float));
+	}
+}
+
+/**
+ * Render this mesh into the specified z buffer without color.
+ * Only the positions are transformed, by the same kernel as TransformVertices(), so that the depths are exactly
+ * those of the color pass.
+ *
+ * @param ppc		the camera
+ * @param zb		the z buffer
+ * @param w			the width of the z buffer
+ * @param h			the height of the z buffer
+ * @param buffers	the scratch buffers of the calling thread
+ * @param transform	the transformation to the world space (NULL means the model matrix of this mesh)
+ */
+void TMesh::RenderDepth(PPC *ppc, float* zb, int w, int h, DepthBuffers &buffers, const M34* transform) {
+	if (vertsN == 0) return;
+
+	FrameBuffer::Rasterizer rasterizer = FrameBuffer::GetRasterizer(false, true);
+	RasterTarget target;
+	target.pix = NULL;
+	target.zb = zb;
+	target.w = w;
+	target.h = h;
+	target.depthTest = FrameBuffer::DEPTH_TEST_LESS;
+	target.stats = NULL;
+	target.visMesh = NULL;
+
+	if ((int)buffers.pp.size() < vertsN) {
+		buffers.verts.resize(vertsN);
+		buffers.pp.resize(vertsN);
+		buffers.codes.resize(vertsN);
+	}
+
+	const Vertex* vs = verts;
+	if (transform == NULL && !model.IsIdentity()) transform = &model;
+	if (transform != NULL) {
+		__m128 cols[4];
+		LoadPositionColumns(*transform, cols);
+		Vertex* moved = &buffers.verts[0];
+
+		#pragma omp parallel for
+		for (int i = 0; i < vertsN; i++) {
+			// the fourth float of the store lands on the color, which is not used by the depth pass
+			const float* src = (const float*)&verts[i];
+			_mm_storeu_ps((float*)&moved[i], TransformColumns(cols, src[0], src[1], src[2]));
+		}
+		vs = moved;
+	}
+
+	V3* pp = &buffers.pp[0];
+	unsigned char* codes = &buffers.codes[0];
+	ProjectVertices(ppc, pp, codes, vs);
+
+	int culledN, culledTrisN;
+	CullMeshlets(ppc, transform != NULL ? *transform : M34(), false, buffers.ranges, culledN, culledTrisN);
+
+	M33 camMat;
+	const vector<int> &ranges = buffers.ranges;
+	for (int r = 0; r < (int)ranges.size(); r += 2) {
+		for (int i = ranges[r]; i < ranges[r] + ranges[r + 1]; i++) {
+			unsigned int i0 = FetchIndex(tris, tris16, i * 3);
+			unsigned int i1 = FetchIndex(tris, tris16, i * 3 + 1);
+			unsigned int i2 = FetchIndex(tris, tris16, i * 3 + 2);
+			if ((codes[i0] | codes[i1] | codes[i2]) & OUTCODE_BEHIND) continue;
+			if (codes[i0] & codes[i1] & codes[i2]) continue;
+
+			rasterizer(target, ppc, camMat, vs[i0], vs[i1], vs[i2], pp[i0], pp[i1], pp[i2], NULL);
+		}
+	}
+}
+
+/**
+ * Clear the allocated memory for vertices.
+ */
+void TMesh::Clear() {
+	version++;
+
+	model = M34();
+	modelVersion++;
+
+	if (verts != NULL) {
+		delete [] verts;
+	}
+	verts = NULL;
+	
+	vertsN = 0;
+
+	if (tris != NULL) {
+		delete [] tris;
+	}
+	tris = NULL;
+
+	if (tris16 != NULL) {
+		delete [] tris16;
+	}
+	tris16 = NULL;
+
+	trisN = 0;
+
+	if (litVerts != NULL) {
+		delete [] litVerts;
+	}
+	litVerts = NULL;
+	litVertsN = 0;
+
+	if (worldVerts != NULL) {
+		delete [] worldVerts;
+	}
+	worldVerts = NULL;
+	worldVertsN = 0;
+
+	if (projVerts != NULL) {
+		delete [] projVerts;
+		delete [] outcodes;
+	}
+	projVerts = NULL;
+	outcodes = NULL;
+	projVertsN = 0;
+
+	// the triangles are gone, so the tree cannot be refit
+	if (bvh != NULL) {
+		delete bvh;
+	}
+	bvh = NULL;
+
+	for (int i = 0; i < (int)lods.size(); i++) {
+		delete lods[i];
+	}
+	lods.clear();
+
+	meshlets.clear();
+	backFaceCulling = false;
+}
+
+/**
+ * Rotate this mesh around the specified axis passing through the centroid by the specified angle.
+ *
+ * @param axis		the specified axis
+ * @param angle		the specified angle
+ */
+void TMesh::RotateAbout(const V3 &axis, float angle) {
+	RotateAbout(axis, angle, GetCentroid());
+}
+
+/**
+ * Rotate this mesh around the specified axis passing through the specified origin by the specified angle.
+ * Only the model matrix is updated, so the cost does not depend on the number of the vertices, and
+ * the normals are rotated in the vertex stage.
+ *
+ * @param axis		the specified axis
+ * @param angle		the specified angle
+ * @param orig		the specified origin
+ */
+void TMesh::RotateAbout(const V3 &axis, float angle, const V3 &orig) {
+	SetModel(M34::Rotation(axis, angle, orig) * model);
+}
+
+/**
+ * Return the center of axis aligned bounding box of vertices in the world space.
+ *
+ * @return		the center of axis aligned bounding box
+ */
+V3 TMesh::GetCentroid() {
+	AABB aabb;
+	ComputeAABB(aabb);
+
+	return (aabb.maxCorner() + aabb.minCorner()) / 2.0f;
+}
+
+/**
+ * Set the transformation from the object space to the world space.
+ * The levels of detail share the same transformation.
+ *
+ * @param model		the model matrix
+ */
+void TMesh::SetModel(const M34 &model) {
+	this->model = model;
+	for (int i = 0; i < (int)lods.size(); i++) {
+		lods[i]->SetModel(model);
+	}
+	modelVersion++;
+}
+
+const M34& TMesh::GetModel() const {
+	return model;
+}
+
+bool TMesh::isInside2D(const V3 &p0, const V3 &p1, const V3 &p2, const V3 p) const {
+	float den = ((p1 - p0) ^ (p2 - p0)).z();
+	float s = ((p - p0) ^ (p2 - p0)).z() / den;
+	float t = ((p - p0) ^ (p1 - p0)).z() / den;
+
+	if (s < 0 || s > 1) return false;
+	if (t < 0 || t > 1) return false;
+	if (s + t > 1) return false;
+	return true;
+}
+
+/**
+ * Load the texture from the specified file.
+ *
+ * @param filename		the texture file name
+ * @param compress		true if the texture is stored in the block-compressed format
+ * @return				true if the texture is loaded
+ */
+bool TMesh::SetTexture(const char* filename, bool compress) {
+	SetTexture(new Texture(filename, compress));
+	return true;
+}
+
+/**
+ * Set the specified texture to this mesh.
+ * This mesh takes the ownership of the texture, and the previous texture is deleted.
+ *
+ * @param texture		the texture
+ */
+void TMesh::SetTexture(Texture* texture) {
+	if (this->texture != NULL) {
+		delete this->texture;
+	}
+	this->texture = texture;
+	texturePending = false;
+	version++;
+}
+
+/**
+ * Mark that the texture of this mesh is being loaded.
+ * While the texture is pending, the mesh is rendered with the placeholder texture.
+ *
+ * @param pending		true if the texture is being loaded
+ */
+void TMesh::SetTexturePending(bool pending) {
+	texturePending = pending;
+	version++;
+}
+
+/**
+ * Exchange the vertices and the triangles with the specified mesh.
+ * This is used to publish a mesh that was loaded in the background.
+ *
+ * @param mesh		the specified mesh
+ */
+void TMesh::Swap(TMesh &mesh) {
+	Vertex* tempVerts = verts;
+	verts = mesh.verts;
+	mesh.verts = tempVerts;
+
+	int tempVertsN = vertsN;
+	vertsN = mesh.vertsN;
+	mesh.vertsN = tempVertsN;
+
+	unsigned int* tempTris = tris;
+	tris = mesh.tris;
+	mesh.tris = tempTris;
+
+	int tempTrisN = trisN;
+	trisN = mesh.trisN;
+	mesh.trisN = tempTrisN;
+
+	unsigned short* tempTris16 = tris16;
+	tris16 = mesh.tris16;
+	mesh.tris16 = tempTris16;
+
+	BVH* tempBVH = bvh;
+	bvh = mesh.bvh;
+	mesh.bvh = tempBVH;
+
+	lods.swap(mesh.lods);
+
+	M34 tempModel = model;
+	model = mesh.model;
+	mesh.model = tempModel;
+
+	meshlets.swap(mesh.meshlets);
+
+	bool tempBackFaceCulling = backFaceCulling;
+	backFaceCulling = mesh.backFaceCulling;
+	mesh.backFaceCulling = tempBackFaceCulling;
+
+	version++;
+	mesh.version++;
+	modelVersion++;
+	mesh.modelVersion++;
+}
+
+/**
+ * Return the version, which changes whenever the geometry, the texture, or the model matrix changes.
+ * Both of the counters only increase, so their sum does not repeat.
+ */
+unsigned int TMesh::GetVersion() const {
+	return version + modelVersion;
+}
+
+/**
+ * Return the bounding volume hierarchy over the triangles.
+ * The tree is built over the vertices in the object space at the first call, and refit when the vertices have
+ * changed since then. The model matrix does not affect the tree.
+ *
+ * @return		the tree
+ */
+const BVH* TMesh::GetBVH() {
+	if (bvh == NULL) {
+		bvh = new BVH();
+		bvh->Build(verts, tris, tris16, trisN);
+	} else if (bvhVersion != version) {
+		bvh->Refit(verts);
+	}
+	bvhVersion = version;
+
+	return bvh;
+}
+
+int TMesh::GetVerticesN() const {
+	return vertsN;
+}
+
+int TMesh::GetTrianglesN() const {
+	return trisN;
+}
+
+const Vertex* TMesh::GetVertices() const {
+	return verts;
+}
+
+/**
+ * Return the vertices lit by the last LightVertices() call.
+ */
+const Vertex* TMesh::GetLitVertices() const {
+	return litVerts;
+}
+
+/**
+ * Return the three vertex indices of the i-th triangle.
+ *
+ * @param i		the triangle index
+ * @param tri	the array that receives the vertex indices
+ */
+void TMesh::GetTriangle(int i, unsigned int* tri) const {
+	for (int j = 0; j < 3; j++) {
+		tri[j] = FetchIndex(tris, tris16, i * 3 + j);
+	}
+}
+
+/**
+ * Store the triangles in 16 bits if the vertices are few enough, which halves the memory of the indices
+ * and the bandwidth to fetch them in the triangle loops. This is called whenever the triangles are finalized.
+ */
+void TMesh::PackIndices() {
+	if (tris == NULL || vertsN > MAX_VERTICES_16) return;
+
+	tris16 = new unsigned short[trisN * 3];
+	for (int i = 0; i < trisN * 3; i++) {
+		tris16[i] = (unsigned short)tris[i];
+	}
+	delete [] tris;
+	tris = NULL;
+
+	// the tree refers to the old array
+	if (bvh != NULL) {
+		delete bvh;
+		bvh = NULL;
+	}
+}
+
+/**
+ * Return the size of the index buffer in bytes.
+ */
+int TMesh::GetIndexBytes() const {
+	return trisN * 3 * (int)(tris16 != NULL ? sizeof(unsigned short) : sizeof(unsigned int));
+}
+
+/**
+ * Expand the triangles back to 32 bits to rewrite them in place. PackIndices() should be called after that.
+ */
+void TMesh::UnpackIndices() {
+	if (tris16 == NULL) return;
+
+	tris = new unsigned int[trisN * 3];
+	for (int i = 0; i < trisN * 3; i++) {
+		tris[i] = tris16[i];
+	}
+	delete [] tris16;
+	tris16 = NULL;
+
+	if (bvh != NULL) {
+		delete bvh;
+		bvh = NULL;
+	}
+}
+
+/**
+ * Compress the triangles for the bin file.
+ * Each triangle starts with a code byte. Its lower 4 bits tell which edge of the previous triangle is shared
+ * and where the remaining vertex is (edge * 3 + position), or INDEX_CODE_NONE. Its upper bits tell
+ * which of the new vertices (1 for a shared edge, 3 otherwise) is the next vertex that has never been used.
+ * The other new vertices follow as the varint deltas from the last vertex. Since the triangles are ordered
+ * for the vertex cache and the vertices are numbered in the order of their first use, most triangles
+ * take 1 or 2 bytes. The order of the vertices within each triangle is preserved.
+ *
+ * @param tris		the vertex indices of the triangles
+ * @param trisN		the number of the triangles
+ * @param bytes		the compressed bytes
+ */
+void TMesh::EncodeIndices(const unsigned int* tris, int trisN, vector<unsigned char> &bytes) {
+	bytes.clear();
+	unsigned int next = 0;
+	unsigned int last = 0;
+
+	for (int i = 0; i < trisN; i++) {
+		const unsigned int* tri = &tris[i * 3];
+
+		// a shared edge is traversed in the opposite direction by the neighbor
+		int code = INDEX_CODE_NONE;
+		for (int e = 0; e < 3 && i > 0 && code == INDEX_CODE_NONE; e++) {
+			const unsigned int* prev = &tris[(i - 1) * 3];
+			for (int p = 0; p < 3; p++) {
+				if (tri[(p + 1) % 3] == prev[(e + 1) % 3] && tri[(p + 2) % 3] == prev[e]) {
+					code = e * 3 + p;
+					break;
+				}
+			}
+		}
+
+		unsigned int newVerts[3];
+		int newVertsN = 0;
+		if (code == INDEX_CODE_NONE) {
+			for (int j = 0; j < 3; j++) newVerts[newVertsN++] = tri[j];
+		} else {
+			newVerts[newVertsN++] = tri[code % 3];
+		}
+
+		size_t codePos = bytes.size();
+		bytes.push_back(0);
+		for (int j = 0; j < newVertsN; j++) {
+			if (newVerts[j] == next) {
+				code |= INDEX_CODE_NEXT(j);
+			} else {
+				WriteVarint(bytes, (int)(newVerts[j] - last));
+			}
+			last = newVerts[j];
+			if (newVerts[j] >= next) next = newVerts[j] + 1;
+		}
+		bytes[codePos] = (unsigned char)code;
+	}
+}
+
+/**
+ * Decompress the triangles written by EncodeIndices().
+ *
+ * @param bytes		the compressed bytes
+ * @param bytesN	the number of the bytes
+ * @param tris		the array that receives the vertex indices of the triangles
+ * @param trisN		the number of the triangles
+ * @return			false if the bytes are corrupted
+ */
+bool TMesh::DecodeIndices(const unsigned char* bytes, int bytesN, unsigned int* tris, int trisN) {
+	unsigned int next = 0;
+	unsigned int last = 0;
+	int pos = 0;
+
+	for (int i = 0; i < trisN; i++) {
+		if (pos >= bytesN) return false;
+		int code = bytes[pos++];
+		int edgeCode = code & 15;
+		if (edgeCode > INDEX_CODE_NONE || (edgeCode != INDEX_CODE_NONE && i == 0)) return false;
+
+		int newVertsN = edgeCode == INDEX_CODE_NONE ? 3 : 1;
+		unsigned int newVerts[3];
+		for (int j = 0; j < newVertsN; j++) {
+			if (code & INDEX_CODE_NEXT(j)) {
+				newVerts[j] = next;
+			} else {
+				int delta;
+				if (!ReadVarint(bytes, bytesN, pos, delta)) return false;
+				newVerts[j] = last + delta;
+			}
+			last = newVerts[j];
+			if (newVerts[j] >= next) next = newVerts[j] + 1;
+		}
+
+		unsigned int* tri = &tris[i * 3];
+		if (edgeCode == INDEX_CODE_NONE) {
+			for (int j = 0; j < 3; j++) tri[j] = newVerts[j];
+		} else {
+			const unsigned int* prev = &tris[(i - 1) * 3];
+			int e = edgeCode / 3;
+			int p = edgeCode % 3;
+			tri[p] = newVerts[0];
+			tri[(p + 1) % 3] = prev[(e + 1) % 3];
+			tri[(p + 2) % 3] = prev[e];
+		}
+	}
+
 	return true;
 }
 
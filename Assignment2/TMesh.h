@@ -2,26 +2,132 @@
 
 #include "V3.h"
 #include "PPC.h"
+#include "M34.h"
 #include "Texture.h"
+#include <vector>
 
 class FrameBuffer;
+class BVH;
 
 typedef struct {
 	V3 v;
 	V3 c;
 	V3 n;
 	float t[2];
+
+	/** the ambient occlusion, which scales the ambient term (1 means unoccluded) */
+	float ao;
 } Vertex;
 
+/**
+ * A cluster of neighboring triangles, which is culled as a whole before the triangle setup (see TMesh::BuildMeshlets()).
+ * The bounds are in the object space of the mesh.
+ */
+typedef struct {
+	/** the range of the triangles */
+	int firstTri;
+	int trisN;
+
+	/** the bounding sphere */
+	V3 center;
+	float radius;
+
+	/** the cone that contains the outward normals of the triangles (coneCos <= 0 means the cone is too wide to cull) */
+	V3 coneAxis;
+	float coneSin;
+	float coneCos;
+} Meshlet;
+
+/**
+ * The scratch buffers of a depth-only pass (see TMesh::RenderDepth()), which grow to the largest mesh and are reused
+ * over the frames. Each thread that renders depth needs its own.
+ */
+typedef struct {
+	/** the vertices of which only the positions are transformed to the world space */
+	std::vector<Vertex> verts;
+
+	/** the projected vertices and their outcodes */
+	std::vector<V3> pp;
+	std::vector<unsigned char> codes;
+
+	/** the ranges of the triangles that survive the culling of the meshlets */
+	std::vector<int> ranges;
+} DepthBuffers;
+
+/**
+ * Return the i-th vertex index of the index buffer, which is stored in either 32 or 16 bits
+ * (exactly one of the two arrays is not NULL).
+ */
+static inline unsigned int FetchIndex(const unsigned int* tris, const unsigned short* tris16, int i) {
+	return tris16 != NULL ? tris16[i] : tris[i];
+}
+
 class TMesh {
+public:
+	/** the bits of the outcode of a projected vertex */
+	enum { OUTCODE_BEHIND = 1, OUTCODE_LEFT = 2, OUTCODE_RIGHT = 4, OUTCODE_BOTTOM = 8, OUTCODE_TOP = 16 };
+
+	/** the size of the FIFO vertex cache that the triangle order is measured with */
+	enum { VERTEX_CACHE_SIZE = 16 };
+
+	/** the maximum number of vertices whose indices fit in 16 bits */
+	enum { MAX_VERTICES_16 = 65536 };
+
 protected:
 	Vertex* verts;
 	int vertsN;
 
+	/** the vertex indices of the triangles in 32 bits (NULL when they are packed into tris16) */
 	unsigned int* tris;
 	int trisN;
 
+	/** the vertex indices of the triangles in 16 bits (NULL unless the vertices are few enough) */
+	unsigned short* tris16;
+
+	/** the vertices lit for Gouraud shading in the current frame */
+	Vertex* litVerts;
+	int litVertsN;
+
+	/** the vertices transformed to the world space by the last TransformVertices() call */
+	Vertex* worldVerts;
+	int worldVertsN;
+
+	/** the vertices projected by the camera of the current frame and their outcodes */
+	V3* projVerts;
+	unsigned char* outcodes;
+	int projVertsN;
+
 	Texture* texture;
+
+	/** true while the texture is being loaded asynchronously */
+	bool texturePending;
+
+	/** incremented whenever the geometry or the texture changes */
+	unsigned int version;
+
+	/** the transformation from the object space of the vertices to the world space */
+	M34 model;
+
+	/** incremented whenever the model matrix changes, which keeps the caches of the geometry valid */
+	unsigned int modelVersion;
+
+	/** the bounding volume hierarchy over the triangles (NULL until it is needed) and the version it fits */
+	BVH* bvh;
+	unsigned int bvhVersion;
+
+	/** the cached bounding box of the vertices in the object space and the version it was computed for */
+	AABB bounds;
+	unsigned int boundsVersion;
+	bool boundsValid;
+
+	/** the simplified levels of detail, each with about a quarter of the triangles of the previous one */
+	std::vector<TMesh*> lods;
+
+	/** the clusters of the triangles in the order of the triangles (empty unless BuildMeshlets() is called) */
+	std::vector<Meshlet> meshlets;
+
+	/** true if the clusters facing away from the camera are culled, which does not change the image of a closed mesh */
+	bool backFaceCulling;
 	/*
 	unsigned int* texture;
 	int t_w;
@@ -32,21 +138,65 @@ public:
 	TMesh();
 	~TMesh();
 
-	void Load(char *filename);
+	bool Load(char *filename);
+	void Save(char *filename, bool compressIndices = true) const;
 	void ComputeAABB(AABB &aabb);
+	void ComputeAABB(AABB &aabb, const M34 &transform);
 	void Translate(const V3 &v);
 	void Scale(float t);
 	void Scale(const V3 &centroid, const V3 &size);
 	void RenderWireframe(FrameBuffer *fb, PPC *ppc);
-	void Render(FrameBuffer *fb, PPC *ppc);
+	void Render(FrameBuffer *fb, PPC *ppc, int id = -1, bool insideFrustum = false, const Vertex* vs = NULL, const M34* transform = NULL);
+	void RenderDepth(PPC *ppc, float* zb, int w, int h, DepthBuffers &buffers, const M34* transform = NULL);
+	void LightVertices(const Vertex* vs = NULL);
+	void ProjectVertices(PPC *ppc, V3* pp, unsigned char* codes, const Vertex* vs = NULL) const;
+	const Vertex* TransformVertices(const M34 &transform, const V3 &color);
+	void BakeAmbientOcclusion(const char* cacheFilename = NULL);
+	void OptimizeVertexCache();
+	void BuildLODs(int levelsN = 3);
+	void BuildMeshlets();
+	int GetMeshletsN() const;
+	void SetBackFaceCulling(bool backFaceCulling);
+	TMesh* Simplify(int targetTrisN) const;
+	int SelectLOD(PPC *ppc);
+	int SelectLOD(PPC *ppc, const AABB &aabb);
+	TMesh* GetLOD(int level);
+	int GetLODsN() const;
+	float GetACMR(int cacheSize = VERTEX_CACHE_SIZE) const;
+	void PackIndices();
+	int GetIndexBytes() const;
 
 	void Clear();
 	void RotateAbout(const V3 &axis, float angle);
 	void RotateAbout(const V3 &axis, float angle, const V3 &orig);
 	V3 GetCentroid();
+	void SetModel(const M34 &model);
+	const M34& GetModel() const;
 
 	bool isInside2D(const V3 &p0, const V3 &p1, const V3 &p2, const V3 p) const;
-	bool SetTexture(const char* filename);
+	bool SetTexture(const char* filename, bool compress = false);
+	void SetTexture(Texture* texture);
+	void SetTexturePending(bool pending);
+	void Swap(TMesh &mesh);
+
+	unsigned int GetVersion() const;
+	const BVH* GetBVH();
+	int GetVerticesN() const;
+	int GetTrianglesN() const;
+	const Vertex* GetVertices() const;
+	const Vertex* GetLitVertices() const;
+	void GetTriangle(int i, unsigned int* tri) const;
+
+private:
+	bool LoadAmbientOcclusion(const char* filename);
+	void SaveAmbientOcclusion(const char* filename) const;
+	unsigned int GetTopologyHash() const;
+	bool IsClosed() const;
+	void RenumberVertices();
+	void CullMeshlets(PPC *ppc, const M34 &transform, bool insideFrustum, std::vector<int> &ranges, int &culledN, int &culledTrisN) const;
+	void UnpackIndices();
+	static void EncodeIndices(const unsigned int* tris, int trisN, std::vector<unsigned char> &bytes);
+	static bool DecodeIndices(const unsigned char* bytes, int bytesN, unsigned int* tris, int trisN);
 	//V3 interpolate(const V3 &c0, const V3 &c1, const V3 &c2, float s, float t) const;
 };
 
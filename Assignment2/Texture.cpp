@@ -1,41 +1,138 @@
 #include "Texture.h"
+#include "JpegDecoder.h"
 #include <libtiff/tiffio.h>
 #include <assert.h>
 #include <iostream>
+#include <string.h>
+#include <emmintrin.h>
 
-Texture::Texture(const char* filename) {
-	TIFF* tiff = TIFFOpen(filename, "r");
-	if (tiff == NULL) throw "File is not accessible.";
+/**
+ * Load the texture from the specified tiff or JPEG file.
+ * The file format is determined by the extension (.jpg and .jpeg are JPEG, and the others are tiff).
+ *
+ * @param filename		the tiff or JPEG file name
+ * @param compress		true if the mipmap images are stored in the block-compressed format
+ */
+Texture::Texture(const char* filename, bool compress) {
+	compressed = false;
 
 	int w, h;
 
-	TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &w);
-	TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &h);
+	if (JpegDecoder::IsJpegFilename(filename)) {
+		JpegDecoder decoder;
+		if (!decoder.Open(filename)) throw "File is not accessible.";
+
+		w = decoder.width;
+		h = decoder.height;
+
+		unsigned int* image = (unsigned int*)_TIFFmalloc(sizeof(unsigned int) * w * h);
+		widths.push_back(w);
+		heights.push_back(h);
+		images.push_back(image);
+
+		if (!decoder.Decode(image)) {
+			_TIFFfree(image);
+			widths.pop_back();
+			heights.pop_back();
+			images.pop_back();
+			throw "JPEG data is corrupted.";
+		}
+	} else {
+		TIFF* tiff = TIFFOpen(filename, "r");
+		if (tiff == NULL) throw "File is not accessible.";
+
+		TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &w);
+		TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &h);
+
+		unsigned int* image = (unsigned int*)_TIFFmalloc(sizeof(unsigned int) * w * h);
+		widths.push_back(w);
+		heights.push_back(h);
+		images.push_back(image);
+		if (!TIFFReadRGBAImage(tiff, w, h, image, 0)) {
+			_TIFFfree(image);
+			widths.pop_back();
+			heights.pop_back();
+			images.pop_back();
+			TIFFClose(tiff);
+			throw "TIFF image is not readable.";
+		}
 
-	unsigned int* image = (unsigned int*)_TIFFmalloc(sizeof(unsigned int) * w * h);
-	widths.push_back(w);
-	heights.push_back(h);
-	images.push_back(image);
-	if (!TIFFReadRGBAImage(tiff, w, h, image, 0)) {
-		delete [] image;
-		image = NULL;
 		TIFFClose(tiff);
-		return;
 	}
 
-	TIFFClose(tiff);
-
 	CreateMipMap(w, h);
 
 	mipmap_id1 = 0;
 	mipmap_id2 = 0;
 	mipmap_s = 1.0f;
+
+	wrapMode = WRAP_REPEAT;
+	filterMode = FILTER_TRILINEAR;
+	SelectSampler();
+
+	if (compress) Compress();
+}
+
+/**
+ * Create the texture from the specified RGBA image.
+ * The image is copied, so the caller keeps the ownership of the specified image.
+ *
+ * @param image			the RGBA image (the same byte order as TIFFReadRGBAImage)
+ * @param width			the width of the image
+ * @param height		the height of the image
+ * @param compress		true if the mipmap images are stored in the block-compressed format
+ */
+Texture::Texture(const unsigned int* image, int width, int height, bool compress) {
+	compressed = false;
+
+	unsigned int* copy = (unsigned int*)_TIFFmalloc(sizeof(unsigned int) * width * height);
+	memcpy(copy, image, sizeof(unsigned int) * width * height);
+	widths.push_back(width);
+	heights.push_back(height);
+	images.push_back(copy);
+
+	CreateMipMap(width, height);
+
+	mipmap_id1 = 0;
+	mipmap_id2 = 0;
+	mipmap_s = 1.0f;
+
+	wrapMode = WRAP_REPEAT;
+	filterMode = FILTER_TRILINEAR;
+	SelectSampler();
+
+	if (compress) Compress();
 }
 
 Texture::~Texture() {
 	for (int i = 0; i < images.size(); i++) {
-		delete [] images[i];
+		if (images[i] != NULL) _TIFFfree(images[i]);
 	}
+	for (int i = 0; i < compressedImages.size(); i++) {
+		delete compressedImages[i];
+	}
+}
+
+/**
+ * Return the texture that is shown while the actual texture is being loaded.
+ * The placeholder is a gray checkerboard, and it is shared by all the meshes.
+ *
+ * @return		the placeholder texture
+ */
+Texture* Texture::GetPlaceholder() {
+	static Texture* placeholder = NULL;
+
+	if (placeholder == NULL) {
+		unsigned int image[8 * 8];
+		for (int y = 0; y < 8; y++) {
+			for (int x = 0; x < 8; x++) {
+				image[x + y * 8] = ((x + y) % 2 == 0) ? 0xFF808080 : 0xFFC0C0C0;
+			}
+		}
+		placeholder = new Texture(image, 8, 8);
+	}
+
+	return placeholder;
 }
 
 /**
@@ -48,11 +145,42 @@ Texture::~Texture() {
 V3 Texture::GetColor(float s, float t) {
 	if (images.size() == 0) return V3(0.0f, 0.0f, 0.0f);
 
-	// tri-linear interpolation
-	V3 c1 = GetColor(images[mipmap_id1], widths[mipmap_id1], heights[mipmap_id1], s, t);
-	V3 c2 = GetColor(images[mipmap_id2], widths[mipmap_id2], heights[mipmap_id2], s, t);
+	return (this->*sampler)(s, t);
+}
 
-	return c1 * (1.0f - mipmap_s) + c2 * mipmap_s;
+/**
+ * Sample the texture at n texture coordinates at once.
+ * The samples are processed four at a time with SSE2, so that a span of pixels can be textured
+ * without going back to the scalar sampler for every pixel.
+ * Unlike GetColor(), the mipmap level is specified per sample.
+ *
+ * @param s			the x coordinates (0.0 - 1.0)
+ * @param t			the y coordinates (0.0 - 1.0)
+ * @param lod		the mipmap levels (0 is the original image, and the fraction blends two mipmaps)
+ * @param n			the number of samples
+ * @param colors	the packed colors in the same format as V3::GetColor()
+ */
+void Texture::GetColors(const float* s, const float* t, const float* lod, int n, unsigned int* colors) const {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		(this->*batchSampler)(&s[i], &t[i], &lod[i], &colors[i]);
+	}
+
+	// pad the last batch by repeating the last sample
+	if (i < n) {
+		float s4[4], t4[4], lod4[4];
+		unsigned int colors4[4];
+		for (int k = 0; k < 4; k++) {
+			int j = (i + k < n) ? i + k : n - 1;
+			s4[k] = s[j];
+			t4[k] = t[j];
+			lod4[k] = lod[j];
+		}
+		(this->*batchSampler)(s4, t4, lod4, colors4);
+		for (int k = 0; i + k < n; k++) {
+			colors[i + k] = colors4[k];
+		}
+	}
 }
 
 /**
@@ -104,53 +232,468 @@ void Texture::SetMipMap(int width, int height, float ds, float dt) {
 }
 
 /**
- * Get the color at the texel (u, v) in the specified mipmap image.
+ * Return the mipmap level selected by SetMipMap() as a fractional level for GetColors().
  *
- * @param image		the mipmap image
- * @param width		the width of the mipmap image
- * @param height	the height of the mipmap image
- * @param u			the x coordinate of the texel
- * @param v			the y coordinate of the texel
- * @return			the color
+ * @return		the mipmap level
+ */
+float Texture::GetLOD() const {
+	if (mipmap_id1 == mipmap_id2) return (float)mipmap_id1;
+
+	return (float)mipmap_id1 + mipmap_s;
+}
+
+/**
+ * Convert all the mipmap images into the block-compressed format.
+ * The uncompressed images are released, and the texels are decoded on the fly afterwards.
+ */
+void Texture::Compress() {
+	if (compressed) return;
+
+	for (int i = 0; i < images.size(); i++) {
+		compressedImages.push_back(new CompressedImage(images[i], widths[i], heights[i]));
+		_TIFFfree(images[i]);
+		images[i] = NULL;
+	}
+
+	compressed = true;
+	SelectSampler();
+}
+
+/**
+ * Return the memory size of all the mipmap images in bytes.
+ *
+ * @return		the memory size in bytes
+ */
+int Texture::GetMemorySize() const {
+	int size = 0;
+	for (int i = 0; i < widths.size(); i++) {
+		if (compressed) {
+			size += compressedImages[i]->GetSize();
+		} else {
+			size += widths[i] * heights[i] * sizeof(unsigned int);
+		}
+	}
+	return size;
+}
+
+/**
+ * Set the wrap mode that is applied to the texture coordinates outside [0, 1].
+ *
+ * @param mode		WRAP_REPEAT, WRAP_CLAMP, or WRAP_MIRROR
+ */
+void Texture::SetWrapMode(int mode) {
+	wrapMode = mode;
+	SelectSampler();
+}
+
+/**
+ * Set the texture filter.
+ *
+ * @param mode		FILTER_NEAREST, FILTER_BILINEAR, or FILTER_TRILINEAR
+ */
+void Texture::SetFilterMode(int mode) {
+	filterMode = mode;
+	SelectSampler();
+}
+
+/**
+ * Select the sampler instantiation that matches the current configuration.
+ * This has to be called every time when the wrap mode, the filter, or the storage is changed,
+ * so that GetColor() does not need to branch on them for every sample.
+ */
+void Texture::SelectSampler() {
+	// the sizes are power of two if the original size is, since each mipmap halves the size
+	pow2 = widths.size() > 0 && (widths[0] & (widths[0] - 1)) == 0 && (heights[0] & (heights[0] - 1)) == 0;
+
+	widthShifts.clear();
+	for (int i = 0; i < widths.size(); i++) {
+		int shift = 0;
+		while ((1 << shift) < widths[i]) shift++;
+		widthShifts.push_back(shift);
+	}
+
+	switch (wrapMode) {
+	case WRAP_CLAMP:
+		sampler = SelectFilter<WRAP_CLAMP>();
+		batchSampler = SelectBatch<WRAP_CLAMP>();
+		break;
+	case WRAP_MIRROR:
+		sampler = SelectFilter<WRAP_MIRROR>();
+		batchSampler = SelectBatch<WRAP_MIRROR>();
+		break;
+	default:
+		sampler = SelectFilter<WRAP_REPEAT>();
+		batchSampler = SelectBatch<WRAP_REPEAT>();
+		break;
+	}
+}
+
+template <int WRAP>
+Texture::BatchSampler Texture::SelectBatch() const {
+	switch (filterMode) {
+	case FILTER_NEAREST:
+		return SelectBatchStorage<WRAP, FILTER_NEAREST>();
+	case FILTER_BILINEAR:
+		return SelectBatchStorage<WRAP, FILTER_BILINEAR>();
+	default:
+		return SelectBatchStorage<WRAP, FILTER_TRILINEAR>();
+	}
+}
+
+template <int WRAP, int FILTER>
+Texture::BatchSampler Texture::SelectBatchStorage() const {
+	if (pow2) {
+		if (compressed) return &Texture::SampleBatch<WRAP, FILTER, true, true>;
+		else return &Texture::SampleBatch<WRAP, FILTER, true, false>;
+	} else {
+		if (compressed) return &Texture::SampleBatch<WRAP, FILTER, false, true>;
+		else return &Texture::SampleBatch<WRAP, FILTER, false, false>;
+	}
+}
+
+template <int WRAP>
+Texture::Sampler Texture::SelectFilter() const {
+	switch (filterMode) {
+	case FILTER_NEAREST:
+		return SelectSize<WRAP, FILTER_NEAREST>();
+	case FILTER_BILINEAR:
+		return SelectSize<WRAP, FILTER_BILINEAR>();
+	default:
+		return SelectSize<WRAP, FILTER_TRILINEAR>();
+	}
+}
+
+template <int WRAP, int FILTER>
+Texture::Sampler Texture::SelectSize() const {
+	if (pow2) {
+		return SelectStorage<WRAP, FILTER, true>();
+	} else {
+		return SelectStorage<WRAP, FILTER, false>();
+	}
+}
+
+template <int WRAP, int FILTER, bool POW2>
+Texture::Sampler Texture::SelectStorage() const {
+	if (compressed) {
+		return &Texture::Sample<WRAP, FILTER, POW2, true>;
+	} else {
+		return &Texture::Sample<WRAP, FILTER, POW2, false>;
+	}
+}
+
+/**
+ * Sample the texture at (s, t) with the filter and the mipmaps selected by SetMipMap().
+ * Nearest and bilinear filters use the mipmap closer to the selected level,
+ * and trilinear filter blends the two nearest mipmaps.
+ *
+ * @param s		the x coordinate (0.0 - 1.0)
+ * @param t		the y coordinate (0.0 - 1.0)
+ * @return		the color
  */
-V3 Texture::GetColor(unsigned int* image, int width, int height, float u, float v) {
-	// locate the corresponding (x, y) in the mipmap image
-	float x = (float)(u - (int)u) * (float)width;
-	float y = (float)(v - (int)v) * (float)height;
-	if (x < 0) x += width;
-	if (y < 0) y += height;
-
-	// locte the surrounding 4 texels
-	int x0, y0, x1, y1;
-	float s, t;
-	if (x < 0.5f) {
-		x0 = 0;
-		s = 1.0f;
+template <int WRAP, int FILTER, bool POW2, bool COMPRESSED>
+V3 Texture::Sample(float s, float t) const {
+	if (FILTER == FILTER_TRILINEAR) {
+		V3 c1 = SampleBilinear<WRAP, POW2, COMPRESSED>(mipmap_id1, s, t);
+		if (mipmap_id1 == mipmap_id2) return c1;
+		V3 c2 = SampleBilinear<WRAP, POW2, COMPRESSED>(mipmap_id2, s, t);
+
+		return c1 * (1.0f - mipmap_s) + c2 * mipmap_s;
+	}
+
+	int level = (mipmap_s < 0.5f) ? mipmap_id1 : mipmap_id2;
+	if (FILTER == FILTER_NEAREST) {
+		return SampleNearest<WRAP, POW2, COMPRESSED>(level, s, t);
 	} else {
-		x0 = (int)(x - 0.5f);
-		s = x - (float)x0 - 0.5f;
+		return SampleBilinear<WRAP, POW2, COMPRESSED>(level, s, t);
+	}
+}
+
+/**
+ * Get the color of the texel nearest to (u, v) in the specified mipmap image.
+ *
+ * @param level		the mipmap level
+ * @param u			the x coordinate (0.0 - 1.0)
+ * @param v			the y coordinate (0.0 - 1.0)
+ * @return			the color
+ */
+template <int WRAP, bool POW2, bool COMPRESSED>
+V3 Texture::SampleNearest(int level, float u, float v) const {
+	float x = u * (float)widths[level];
+	float y = v * (float)heights[level];
+	int x0 = (int)x;
+	int y0 = (int)y;
+	if ((float)x0 > x) x0--;
+	if ((float)y0 > y) y0--;
+
+	x0 = WrapCoord<WRAP, POW2>(x0, widths[level]);
+	y0 = WrapCoord<WRAP, POW2>(y0, heights[level]);
+
+	V3 c;
+	c.SetColor(GetTexel<POW2, COMPRESSED>(level, x0, y0));
+	return c;
+}
+
+/**
+ * Get the color at (u, v) in the specified mipmap image by using bi-linear interpolation.
+ *
+ * @param level		the mipmap level
+ * @param u			the x coordinate (0.0 - 1.0)
+ * @param v			the y coordinate (0.0 - 1.0)
+ * @return			the color
+ */
+template <int WRAP, bool POW2, bool COMPRESSED>
+V3 Texture::SampleBilinear(int level, float u, float v) const {
+	int width = widths[level];
+	int height = heights[level];
+
+	// locate the corresponding (x, y) in the mipmap image relative to the texel centers
+	float x = u * (float)width - 0.5f;
+	float y = v * (float)height - 0.5f;
+	int x0 = (int)x;
+	int y0 = (int)y;
+	if ((float)x0 > x) x0--;
+	if ((float)y0 > y) y0--;
+	float s = x - (float)x0;
+	float t = y - (float)y0;
+
+	// locate the surrounding 4 texels
+	int x1 = WrapCoord<WRAP, POW2>(x0 + 1, width);
+	int y1 = WrapCoord<WRAP, POW2>(y0 + 1, height);
+	x0 = WrapCoord<WRAP, POW2>(x0, width);
+	y0 = WrapCoord<WRAP, POW2>(y0, height);
+
+	unsigned int c0 = GetTexel<POW2, COMPRESSED>(level, x0, y0);
+	unsigned int c1 = GetTexel<POW2, COMPRESSED>(level, x1, y0);
+	unsigned int c2 = GetTexel<POW2, COMPRESSED>(level, x1, y1);
+	unsigned int c3 = GetTexel<POW2, COMPRESSED>(level, x0, y1);
+
+	float w0 = (1.0f - s) * (1.0f - t);
+	float w1 = s * (1.0f - t);
+	float w2 = s * t;
+	float w3 = (1.0f - s) * t;
+
+	float rgb[3];
+	for (int k = 0; k < 3; k++) {
+		int shift = k * 8;
+		rgb[k] = ((float)((c0 >> shift) & 0xFF) * w0 + (float)((c1 >> shift) & 0xFF) * w1 + (float)((c2 >> shift) & 0xFF) * w2 + (float)((c3 >> shift) & 0xFF) * w3) / 255.0f;
 	}
-	if (y < 0.5f) {
-		y0 = 0;
-		t = 1.0f;
+
+	return V3(rgb[0], rgb[1], rgb[2]);
+}
+
+/**
+ * Sample four texture coordinates with the filter.
+ * Nearest and bilinear filters use the mipmap closer to the level of each sample,
+ * and trilinear filter blends the two nearest mipmaps.
+ *
+ * @param s			four x coordinates (0.0 - 1.0)
+ * @param t			four y coordinates (0.0 - 1.0)
+ * @param lod		four mipmap levels
+ * @param colors	four packed colors
+ */
+template <int WRAP, int FILTER, bool POW2, bool COMPRESSED>
+void Texture::SampleBatch(const float* s, const float* t, const float* lod, unsigned int* colors) const {
+	int maxLevel = (int)widths.size() - 1;
+	__m128 l = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(lod), _mm_setzero_ps()), _mm_set1_ps((float)maxLevel));
+
+	if (FILTER != FILTER_TRILINEAR) {
+		// use the nearer mipmap only
+		int rounded[4];
+		_mm_storeu_si128((__m128i*)rounded, _mm_cvtps_epi32(l));
+		if (FILTER == FILTER_NEAREST) {
+			SampleNearest4<WRAP, POW2, COMPRESSED>(rounded, s, t, colors);
+			return;
+		}
+
+		float rgb[12];
+		SampleBilinear4<WRAP, POW2, COMPRESSED>(rounded, s, t, rgb);
+
+		__m128i r = _mm_cvtps_epi32(_mm_loadu_ps(&rgb[0]));
+		__m128i g = _mm_cvtps_epi32(_mm_loadu_ps(&rgb[4]));
+		__m128i b = _mm_cvtps_epi32(_mm_loadu_ps(&rgb[8]));
+		__m128i c = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(b, 16), _mm_set1_epi32(0xFF000000)));
+		_mm_storeu_si128((__m128i*)colors, c);
+		return;
+	}
+
+	// split the levels into the two nearest mipmaps and the blending factor
+	__m128i l1 = _mm_cvttps_epi32(l);
+	__m128 frac = _mm_sub_ps(l, _mm_cvtepi32_ps(l1));
+
+	int levels1[4], levels2[4];
+	_mm_storeu_si128((__m128i*)levels1, l1);
+	for (int k = 0; k < 4; k++) {
+		levels2[k] = (levels1[k] < maxLevel) ? levels1[k] + 1 : maxLevel;
+	}
+
+	float rgb1[12], rgb2[12];
+	SampleBilinear4<WRAP, POW2, COMPRESSED>(levels1, s, t, rgb1);
+	SampleBilinear4<WRAP, POW2, COMPRESSED>(levels2, s, t, rgb2);
+
+	// blend the two mipmaps
+	__m128 inv = _mm_sub_ps(_mm_set1_ps(1.0f), frac);
+	__m128i ch[3];
+	for (int k = 0; k < 3; k++) {
+		__m128 c = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&rgb1[k * 4]), inv), _mm_mul_ps(_mm_loadu_ps(&rgb2[k * 4]), frac));
+		ch[k] = _mm_cvtps_epi32(c);
+	}
+	__m128i c = _mm_or_si128(_mm_or_si128(ch[0], _mm_slli_epi32(ch[1], 8)), _mm_or_si128(_mm_slli_epi32(ch[2], 16), _mm_set1_epi32(0xFF000000)));
+	_mm_storeu_si128((__m128i*)colors, c);
+}
+
+/**
+ * Nearest texel lookup of four texture coordinates.
+ * The texel indices are computed with SSE2, and the texels are gathered per lane.
+ *
+ * @param levels	four mipmap levels
+ * @param u			four x coordinates (0.0 - 1.0)
+ * @param v			four y coordinates (0.0 - 1.0)
+ * @param colors	four packed colors
+ */
+template <int WRAP, bool POW2, bool COMPRESSED>
+void Texture::SampleNearest4(const int* levels, const float* u, const float* v, unsigned int* colors) const {
+	__m128 w = _mm_setr_ps((float)widths[levels[0]], (float)widths[levels[1]], (float)widths[levels[2]], (float)widths[levels[3]]);
+	__m128 h = _mm_setr_ps((float)heights[levels[0]], (float)heights[levels[1]], (float)heights[levels[2]], (float)heights[levels[3]]);
+	__m128 x = _mm_mul_ps(_mm_loadu_ps(u), w);
+	__m128 y = _mm_mul_ps(_mm_loadu_ps(v), h);
+
+	// floor
+	__m128i one = _mm_set1_epi32(1);
+	__m128i xi = _mm_cvttps_epi32(x);
+	__m128i yi = _mm_cvttps_epi32(y);
+	xi = _mm_sub_epi32(xi, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(xi), x)), one));
+	yi = _mm_sub_epi32(yi, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(yi), y)), one));
+
+	int x0[4], y0[4];
+	_mm_storeu_si128((__m128i*)x0, xi);
+	_mm_storeu_si128((__m128i*)y0, yi);
+	for (int k = 0; k < 4; k++) {
+		int level = levels[k];
+		int xa = WrapCoord<WRAP, POW2>(x0[k], widths[level]);
+		int ya = WrapCoord<WRAP, POW2>(y0[k], heights[level]);
+		colors[k] = GetTexel<POW2, COMPRESSED>(level, xa, ya) | 0xFF000000;
+	}
+}
+
+/**
+ * Bi-linear lookup of four texture coordinates.
+ * The coordinates and the weights are computed with SSE2, and the texels are gathered per lane.
+ *
+ * @param levels	four mipmap levels
+ * @param u			four x coordinates (0.0 - 1.0)
+ * @param v			four y coordinates (0.0 - 1.0)
+ * @param rgb		the red, green and blue channels of the four samples in [0, 255]
+ */
+template <int WRAP, bool POW2, bool COMPRESSED>
+void Texture::SampleBilinear4(const int* levels, const float* u, const float* v, float* rgb) const {
+	__m128 w = _mm_setr_ps((float)widths[levels[0]], (float)widths[levels[1]], (float)widths[levels[2]], (float)widths[levels[3]]);
+	__m128 h = _mm_setr_ps((float)heights[levels[0]], (float)heights[levels[1]], (float)heights[levels[2]], (float)heights[levels[3]]);
+
+	// locate the corresponding (x, y) relative to the texel centers
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 x = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(u), w), half);
+	__m128 y = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(v), h), half);
+
+	// floor
+	__m128i one = _mm_set1_epi32(1);
+	__m128i xi = _mm_cvttps_epi32(x);
+	__m128i yi = _mm_cvttps_epi32(y);
+	xi = _mm_sub_epi32(xi, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(xi), x)), one));
+	yi = _mm_sub_epi32(yi, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(yi), y)), one));
+	__m128 s = _mm_sub_ps(x, _mm_cvtepi32_ps(xi));
+	__m128 t = _mm_sub_ps(y, _mm_cvtepi32_ps(yi));
+
+	// bi-linear weights
+	__m128 s1 = _mm_sub_ps(_mm_set1_ps(1.0f), s);
+	__m128 t1 = _mm_sub_ps(_mm_set1_ps(1.0f), t);
+	__m128 w0 = _mm_mul_ps(s1, t1);
+	__m128 w1 = _mm_mul_ps(s, t1);
+	__m128 w2 = _mm_mul_ps(s, t);
+	__m128 w3 = _mm_mul_ps(s1, t);
+
+	// gather the surrounding 4 texels of each lane
+	int x0[4], y0[4];
+	_mm_storeu_si128((__m128i*)x0, xi);
+	_mm_storeu_si128((__m128i*)y0, yi);
+	unsigned int c0[4], c1[4], c2[4], c3[4];
+	for (int k = 0; k < 4; k++) {
+		int level = levels[k];
+		int xa = WrapCoord<WRAP, POW2>(x0[k], widths[level]);
+		int xb = WrapCoord<WRAP, POW2>(x0[k] + 1, widths[level]);
+		int ya = WrapCoord<WRAP, POW2>(y0[k], heights[level]);
+		int yb = WrapCoord<WRAP, POW2>(y0[k] + 1, heights[level]);
+		c0[k] = GetTexel<POW2, COMPRESSED>(level, xa, ya);
+		c1[k] = GetTexel<POW2, COMPRESSED>(level, xb, ya);
+		c2[k] = GetTexel<POW2, COMPRESSED>(level, xb, yb);
+		c3[k] = GetTexel<POW2, COMPRESSED>(level, xa, yb);
+	}
+	__m128i t0 = _mm_loadu_si128((const __m128i*)c0);
+	__m128i t1i = _mm_loadu_si128((const __m128i*)c1);
+	__m128i t2 = _mm_loadu_si128((const __m128i*)c2);
+	__m128i t3 = _mm_loadu_si128((const __m128i*)c3);
+
+	// weight the channels
+	__m128i mask = _mm_set1_epi32(0xFF);
+	for (int k = 0; k < 3; k++) {
+		__m128i shift = _mm_cvtsi32_si128(k * 8);
+		__m128 a0 = _mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(t0, shift), mask));
+		__m128 a1 = _mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(t1i, shift), mask));
+		__m128 a2 = _mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(t2, shift), mask));
+		__m128 a3 = _mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(t3, shift), mask));
+		__m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a0, w0), _mm_mul_ps(a1, w1)), _mm_add_ps(_mm_mul_ps(a2, w2), _mm_mul_ps(a3, w3)));
+		_mm_storeu_ps(&rgb[k * 4], c);
+	}
+}
+
+/**
+ * Get the texel (x, y) of the specified mipmap level.
+ *
+ * @param level		the mipmap level
+ * @param x			the x coordinate of the texel
+ * @param y			the y coordinate of the texel
+ * @return			the color in the same byte order as TIFFReadRGBAImage
+ */
+template <bool POW2, bool COMPRESSED>
+unsigned int Texture::GetTexel(int level, int x, int y) const {
+	if (COMPRESSED) {
+		return compressedImages[level]->GetTexel(x, y);
+	} else if (POW2) {
+		return images[level][x + (y << widthShifts[level])];
 	} else {
-		y0 = (int)(y - 0.5f);
-		t = y - (float)y0 - 0.5f;
+		return images[level][x + y * widths[level]];
 	}
+}
 
-	x1 = x0 + 1;
-	y1 = y0 + 1;
-	if (x1 >= width) x1 = width - 1;
-	if (y1 >= height) y1 -= height - 1;
-	
-	// get the colors of 4 texels
-	V3 c0, c1, c2, c3;
-	c0.SetColor(image[x0 + y0 * width]);
-	c1.SetColor(image[x1 + y0 * width]);
-	c2.SetColor(image[x1 + y1 * width]);
-	c3.SetColor(image[x0 + y1 * width]);
-	
-	return c0 * (1 - s) * (1 - t) + c1 * s * (1 - t) + c2 * s * t  + c3 * (1 - s) * t;
+/**
+ * Map the texel index into [0, size - 1] according to the wrap mode.
+ *
+ * @param i			the texel index
+ * @param size		the width or the height of the mipmap image
+ * @return			the wrapped texel index
+ */
+template <int WRAP, bool POW2>
+int Texture::WrapCoord(int i, int size) {
+	if (WRAP == WRAP_CLAMP) {
+		if (i < 0) return 0;
+		if (i >= size) return size - 1;
+		return i;
+	} else if (WRAP == WRAP_MIRROR) {
+		int period = size * 2;
+		if (POW2) {
+			i &= period - 1;
+		} else {
+			i %= period;
+			if (i < 0) i += period;
+		}
+		return (i < size) ? i : period - 1 - i;
+	} else {
+		if (POW2) {
+			return i & (size - 1);
+		} else {
+			i %= size;
+			return (i < 0) ? i + size : i;
+		}
+	}
 }
 
 /**
@@ -1,27 +1,73 @@
 #pragma once
 
 #include "V3.h"
+#include "CompressedImage.h"
 #include <vector>
 
 class Texture {
+public:
+	enum { WRAP_REPEAT = 0, WRAP_CLAMP, WRAP_MIRROR };
+	enum { FILTER_NEAREST = 0, FILTER_BILINEAR, FILTER_TRILINEAR };
+
 private:
+	/** the sampler that is specialized for the current wrap mode, filter, size and storage */
+	typedef V3 (Texture::*Sampler)(float s, float t) const;
+
+	/** the batch sampler that is specialized for the current wrap mode, filter, size and storage */
+	typedef void (Texture::*BatchSampler)(const float* s, const float* t, const float* lod, unsigned int* colors) const;
+
 	std::vector<int> widths;
 	std::vector<int> heights;
 	std::vector<unsigned int*> images;
 
+	/** block-compressed mipmap images, which are used instead of images when compressed is true */
+	std::vector<CompressedImage*> compressedImages;
+	bool compressed;
+
+	/** log2 of the widths, which are used for addressing when all the sizes are power of two */
+	std::vector<int> widthShifts;
+	bool pow2;
+
 	int mipmap_id1;
 	int mipmap_id2;
 	float mipmap_s;
 
+	int wrapMode;
+	int filterMode;
+	Sampler sampler;
+	BatchSampler batchSampler;
+
 public:
-	Texture(const char* filename);
+	Texture(const char* filename, bool compress = false);
+	Texture(const unsigned int* image, int width, int height, bool compress = false);
 	~Texture();
 
+	static Texture* GetPlaceholder();
+
 	V3 GetColor(float s, float t);
+	void GetColors(const float* s, const float* t, const float* lod, int n, unsigned int* colors) const;
 	void SetMipMap(int width, int height, float ds, float dt);
+	float GetLOD() const;
+	void Compress();
+	int GetMemorySize() const;
+	void SetWrapMode(int mode);
+	void SetFilterMode(int mode);
 
 private:
-	V3 GetColor(unsigned int* image, int width, int height, float u, float v);
+	void SelectSampler();
+	template <int WRAP, int FILTER, bool POW2, bool COMPRESSED> V3 Sample(float s, float t) const;
+	template <int WRAP, bool POW2, bool COMPRESSED> V3 SampleNearest(int level, float u, float v) const;
+	template <int WRAP, bool POW2, bool COMPRESSED> V3 SampleBilinear(int level, float u, float v) const;
+	template <bool POW2, bool COMPRESSED> unsigned int GetTexel(int level, int x, int y) const;
+	template <int WRAP, bool POW2> static int WrapCoord(int i, int size);
+	template <int WRAP, int FILTER, bool POW2> Sampler SelectStorage() const;
+	template <int WRAP, int FILTER> Sampler SelectSize() const;
+	template <int WRAP> Sampler SelectFilter() const;
+	template <int WRAP, int FILTER, bool POW2, bool COMPRESSED> void SampleBatch(const float* s, const float* t, const float* lod, unsigned int* colors) const;
+	template <int WRAP, bool POW2, bool COMPRESSED> void SampleNearest4(const int* levels, const float* u, const float* v, unsigned int* colors) const;
+	template <int WRAP, bool POW2, bool COMPRESSED> void SampleBilinear4(const int* levels, const float* u, const float* v, float* rgb) const;
+	template <int WRAP, int FILTER> BatchSampler SelectBatchStorage() const;
+	template <int WRAP> BatchSampler SelectBatch() const;
 	void CreateMipMap(int width, int height);
 };
 
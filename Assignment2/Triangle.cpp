@@ -15,6 +15,9 @@ Triangle::Triangle(const V3 &p0, const V3 &c0, const V3 &t0, const V3 &p1, const
 	verts[0].c = c0;
 	verts[1].c = c1;
 	verts[2].c = c2;
+	verts[0].ao = 1.0f;
+	verts[1].ao = 1.0f;
+	verts[2].ao = 1.0f;
 	verts[0].n = normal;
 	verts[1].n = normal;
 	verts[2].n = normal;
@@ -28,5 +31,7 @@ Triangle::Triangle(const V3 &p0, const V3 &c0, const V3 &t0, const V3 &p1, const
 	tris[0] = 0;
 	tris[1] = 1;
 	tris[2] = 2;
+
+	PackIndices();
 }
 